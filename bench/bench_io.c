@@ -0,0 +1,145 @@
+///////////////////////////////////////////////////////////////////////////////////
+//                                                                               //
+// Benchmark of reading and writing uncompressed MCPL files, for comparing the   //
+// io_uring backend with standard file I/O. The same source is built twice, as   //
+// mcplbench_io (standard file I/O) and, where linux/io_uring.h is available, as //
+// mcplbench_io_uring (mcpl.c compiled with MCPL_HASIOURING). Run both on the    //
+// storage of interest, preferably with cold caches between the runs.            //
+//                                                                               //
+// Files with the given number of particles (default 10000000) are written to    //
+// the given directory (default: the current one) and removed again.             //
+// Timed operations, best of a number of repetitions:                            //
+//                                                                               //
+//   write : mcpl_add_particle of all particles, including mcpl_close_outfile.   //
+//   scan  : sequential mcpl_read_block over the whole file.                     //
+//   merge : mcpl_merge_files of two such files.                                 //
+//                                                                               //
+// Usage: mcplbench_io [directory [nparticles [repetitions]]]                    //
+//                                                                               //
+// This file can be freely used as per the terms in the LICENSE file.            //
+//                                                                               //
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "mcpl.c"
+#include <time.h>
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static int bench_uring_used = 0;
+static unsigned bench_particle_size = 0;
+
+static double bench_write(const char * filename, uint64_t n)
+{
+  double t0 = bench_now();
+  mcpl_outfile_t of = mcpl_create_outfile(filename);
+  mcpl_hdr_set_srcname(of,"mcplbench_io");
+#ifdef MCPLIMP_HAS_IO_URING
+  bench_uring_used = ((mcpl_outfileinternal_t*)of.internal)->uring != 0;
+#endif
+  mcpl_particle_t * p = mcpl_get_empty_particle(of);
+  uint64_t i;
+  for (i = 0; i < n; ++i) {
+    double x = (double)( i % 1000 ) * 1e-3;
+    p->pdgcode = ( i % 3 ? 2112 : 22 );
+    p->ekin = 0.1 + x;
+    p->position[0] = x;
+    p->position[1] = 1.0 - x;
+    p->position[2] = 0.5 * x;
+    p->direction[0] = 0.6;
+    p->direction[1] = 0.0;
+    p->direction[2] = 0.8;
+    p->time = x;
+    p->weight = 1.0;
+    mcpl_add_particle(of,p);
+  }
+  mcpl_close_outfile(of);
+  return bench_now() - t0;
+}
+
+static double bench_scan(const char * filename, uint64_t n)
+{
+  static mcpl_particle_t buf[1024];
+  double t0 = bench_now();
+  mcpl_file_t f = mcpl_open_file(filename);
+  bench_particle_size = mcpl_hdr_particle_size(f);
+  double sum = 0.0;
+  uint64_t nread = 0, nb;
+  while ( ( nb = mcpl_read_block(f, buf, 1024) ) ) {
+    uint64_t i;
+    for (i = 0; i < nb; ++i)
+      sum += buf[i].ekin;
+    nread += nb;
+  }
+  mcpl_close_file(f);
+  double t = bench_now() - t0;
+  if ( nread != n || sum <= 0.0 ) {
+    printf("Unexpected file contents\n");
+    exit(1);
+  }
+  return t;
+}
+
+static double bench_merge(const char * output, const char * filename, const char * copy)
+{
+  const char * files[2];
+  files[0] = filename;
+  files[1] = copy;
+  remove(output);
+  double t0 = bench_now();
+  mcpl_outfile_t of = mcpl_merge_files(output, 2, files);
+  mcpl_close_outfile(of);
+  return bench_now() - t0;
+}
+
+int main(int argc,char**argv) {
+
+  const char * dir = argc > 1 ? argv[1] : ".";
+  uint64_t n = argc > 2 ? (uint64_t)strtoull(argv[2],0,10) : 10000000;
+  unsigned nrep = argc > 3 ? (unsigned)atoi(argv[3]) : 3;
+  if ( argc > 4 || !n || !nrep ) {
+    printf("Usage: %s [directory [nparticles [repetitions]]]\n",argv[0]);
+    return 1;
+  }
+  size_t ldir = strlen(dir);
+  char * filename = (char*)malloc(ldir + 32);
+  char * copy = (char*)malloc(ldir + 32);
+  char * merged = (char*)malloc(ldir + 32);
+  if ( !filename || !copy || !merged )
+    return 1;
+  sprintf(filename, "%s/mcplbench_io.mcpl", dir);
+  sprintf(copy, "%s/mcplbench_io_copy.mcpl", dir);
+  sprintf(merged, "%s/mcplbench_io_merged.mcpl", dir);
+  bench_write(copy, n);//second (untimed) input file for the merge
+
+  double best[3] = { -1.0, -1.0, -1.0 };
+  unsigned irep;
+  for (irep = 0; irep < nrep; ++irep) {
+    double t[3];
+    t[0] = bench_write(filename, n);
+    t[1] = bench_scan(filename, n);
+    t[2] = bench_merge(merged, filename, copy);
+    int i;
+    for (i = 0; i < 3; ++i)
+      if ( best[i] < 0.0 || t[i] < best[i] )
+        best[i] = t[i];
+  }
+  remove(merged);
+  remove(copy);
+  remove(filename);
+
+  double mb = n * (double)bench_particle_size / 1e6;
+  printf("Backend: %s\n", bench_uring_used ? "io_uring" : "standard file I/O");
+  printf("%" PRIu64 " particles (%.0fMB), best of %u:\n", n, mb, nrep);
+  printf("  write : %8.3fs (%7.1f MB/s)\n", best[0], mb / best[0]);
+  printf("  scan  : %8.3fs (%7.1f MB/s)\n", best[1], mb / best[1]);
+  printf("  merge : %8.3fs (%7.1f MB/s, 2 x input)\n", best[2], 2 * mb / best[2]);
+  free(filename);
+  free(copy);
+  free(merged);
+  return 0;
+}
@@ -0,0 +1,219 @@
+///////////////////////////////////////////////////////////////////////////////////
+//                                                                               //
+// Benchmark of the particle decoders and encoders which are specialised for     //
+// each of the 32 possible layouts of packed particle records (selected once     //
+// per file), compared with generic code which instead tests the layout options  //
+// of the file for every particle.                                               //
+//                                                                               //
+// As the kernels are internal to MCPL, this file includes mcpl.c directly.      //
+// For each layout, a file with the given number of particles (default 200000)   //
+// is written and its packed data loaded into memory. Decoding (packed record to //
+// mcpl_particle_t, including ekin and direction) and encoding are then timed    //
+// with both variants, and the best of a number of repetitions is reported.      //
+//                                                                               //
+// Usage: mcplbench_layouts [nparticles [repetitions]]                           //
+//                                                                               //
+// This file can be freely used as per the terms in the LICENSE file.            //
+//                                                                               //
+///////////////////////////////////////////////////////////////////////////////////
+
+#include "mcpl.c"
+#include <time.h>
+
+typedef void (*bench_unpack_fct_t)(const mcpl_fileinternal_t*, const char*, mcpl_particle_t*);
+typedef void (*bench_pack_fct_t)(const mcpl_fileinternal_t*, int, const mcpl_particle_t*, char*);
+
+static void bench_unpack_runtime(const mcpl_fileinternal_t* f, const char * pbuf, mcpl_particle_t * p)
+{
+  //Generic decoding, testing the options of the file:
+  double pack_ekindir[3];
+  mcpl_internal_unpack_fields_generic( f, pbuf, p, pack_ekindir,
+                                       f->opt_singleprec, f->opt_polarisation,
+                                       f->opt_universalpdgcode != 0,
+                                       f->opt_universalweight != 0.0,
+                                       f->opt_userflags );
+  mcpl_internal_unpack_ekindir_generic( f->format_version, pack_ekindir, &(p->ekin), p->direction );
+}
+
+static void bench_unpack_specialised(const mcpl_fileinternal_t* f, const char * pbuf, mcpl_particle_t * p)
+{
+  f->unpack(f,pbuf,p);
+}
+
+static void bench_pack_ekindir(const mcpl_particle_t* p, double * pack_ekindir)
+{
+  //As in mcpl_internal_serialise_particle_to_buffer:
+  mcpl_unitvect_pack_adaptproj(p->direction,pack_ekindir);
+  pack_ekindir[2] = copysign(p->ekin,pack_ekindir[2]);
+}
+
+static void bench_pack_runtime(const mcpl_fileinternal_t* f, int layout, const mcpl_particle_t* p, char * pbuf)
+{
+  //Generic encoding, testing the options of the file:
+  (void)layout;
+  double pack_ekindir[3];
+  bench_pack_ekindir(p,pack_ekindir);
+  mcpl_internal_pack_fields_generic( p, pack_ekindir, pbuf,
+                                     f->opt_singleprec, f->opt_polarisation,
+                                     f->opt_universalpdgcode != 0,
+                                     f->opt_universalweight != 0.0,
+                                     f->opt_userflags );
+}
+
+static void bench_pack_specialised(const mcpl_fileinternal_t* f, int layout, const mcpl_particle_t* p, char * pbuf)
+{
+  (void)f;
+  double pack_ekindir[3];
+  bench_pack_ekindir(p,pack_ekindir);
+  mcpl_internal_pack_fields_fcts[layout](p,pack_ekindir,pbuf);
+}
+
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static volatile double bench_sink;
+
+static double bench_decode(bench_unpack_fct_t fct, const mcpl_fileinternal_t* f,
+                           const char * data, uint64_t n, unsigned nrep)
+{
+  //Returns best time per particle in ns:
+  double best = -1.0;
+  unsigned irep;
+  for (irep = 0; irep < nrep; ++irep) {
+    mcpl_particle_t p;
+    double sum = 0.0;
+    double t0 = bench_now();
+    uint64_t i;
+    for (i = 0; i < n; ++i) {
+      fct(f, data + i * f->particle_size, &p);
+      sum += p.ekin + p.direction[2] + p.position[0] + p.weight + p.pdgcode + p.userflags;
+    }
+    double t = bench_now() - t0;
+    bench_sink = sum;
+    if ( best < 0.0 || t < best )
+      best = t;
+  }
+  return 1e9 * best / n;
+}
+
+static double bench_encode(bench_pack_fct_t fct, const mcpl_fileinternal_t* f, int layout,
+                           const mcpl_particle_t* particles, uint64_t n, char * out, unsigned nrep)
+{
+  //Returns best time per particle in ns:
+  double best = -1.0;
+  unsigned irep;
+  for (irep = 0; irep < nrep; ++irep) {
+    double t0 = bench_now();
+    uint64_t i;
+    for (i = 0; i < n; ++i)
+      fct(f, layout, particles + i, out + i * f->particle_size);
+    double t = bench_now() - t0;
+    bench_sink = out[(n-1) * f->particle_size];
+    if ( best < 0.0 || t < best )
+      best = t;
+  }
+  return 1e9 * best / n;
+}
+
+int main(int argc,char**argv) {
+
+  uint64_t n = argc > 1 ? (uint64_t)strtoull(argv[1],0,10) : 200000;
+  unsigned nrep = argc > 2 ? (unsigned)atoi(argv[2]) : 5;
+  if ( argc > 3 || !n || !nrep ) {
+    printf("Usage: %s [nparticles [repetitions]]\n",argv[0]);
+    return 1;
+  }
+  const char * filename = "mcplbench_layouts.mcpl";
+
+  printf("Decoding and encoding of %" PRIu64 " particles per layout, best of %u (ns/particle):\n\n",n,nrep);
+  printf("layout  options                 size   decode generic -> specialised   encode generic -> specialised\n");
+  double sum_dec[2] = {0.0,0.0}, sum_enc[2] = {0.0,0.0};
+  int layout;
+  for (layout = 0; layout < MCPLIMP_NLAYOUTS; ++layout) {
+    //Write file with the layout (MCPLIMP_LAYOUT_INDEX gives the bit of each option):
+    mcpl_outfile_t of = mcpl_create_outfile(filename);
+    mcpl_hdr_set_srcname(of,"mcplbench_layouts");
+    if (!(layout&1))
+      mcpl_enable_doubleprec(of);
+    if (layout&2)
+      mcpl_enable_polarisation(of);
+    if (layout&4)
+      mcpl_enable_universal_pdgcode(of,2112);
+    if (layout&8)
+      mcpl_enable_universal_weight(of,1.5);
+    if (layout&16)
+      mcpl_enable_userflags(of);
+    char * data = (char*)malloc(n * MCPLIMP_MAX_PARTICLE_SIZE);
+    char * out = (char*)malloc(n * MCPLIMP_MAX_PARTICLE_SIZE);
+    mcpl_particle_t * particles = (mcpl_particle_t*)calloc(n, sizeof(mcpl_particle_t));
+    if ( !data || !out || !particles ) {
+      printf("Unable to allocate memory\n");
+      return 1;
+    }
+    uint64_t i, seed = 12345;
+    for (i = 0; i < n; ++i) {
+      mcpl_particle_t * p = particles + i;
+      double r[6];
+      int j;
+      for (j = 0; j < 6; ++j) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        r[j] = ( seed >> 11 ) * ( 1.0 / 9007199254740992.0 );
+      }
+      double cth = 2.0 * r[0] - 1.0, sth = sqrt( 1.0 - cth * cth ), phi = 6.283185307179586 * r[1];
+      p->direction[0] = sth * cos(phi);
+      p->direction[1] = sth * sin(phi);
+      p->direction[2] = cth;
+      p->ekin = 10.0 * r[2];
+      p->position[0] = 100.0 * r[3];
+      p->position[1] = -100.0 * r[4];
+      p->position[2] = r[5];
+      p->polarisation[0] = r[4];
+      p->time = 1e-3 * r[3];
+      p->weight = (layout&8) ? 1.5 : r[5];
+      p->pdgcode = (layout&4) ? 2112 : (i%2 ? 22 : 2112);
+      p->userflags = (uint32_t)i;
+      mcpl_add_particle(of,p);
+    }
+    mcpl_close_outfile(of);
+
+    //Load the packed data into memory:
+    mcpl_file_t ff = mcpl_open_file(filename);
+    mcpl_fileinternal_t * f = (mcpl_fileinternal_t *)ff.internal;
+    if ( fseek(f->file, f->first_particle_pos, SEEK_SET) != 0
+         || fread(data, f->particle_size, n, f->file) != n ) {
+      printf("Unable to read particle data\n");
+      return 1;
+    }
+
+    double dec[2], enc[2];
+    dec[0] = bench_decode(&bench_unpack_runtime, f, data, n, nrep);
+    dec[1] = bench_decode(&bench_unpack_specialised, f, data, n, nrep);
+    enc[0] = bench_encode(&bench_pack_runtime, f, layout, particles, n, out, nrep);
+    enc[1] = bench_encode(&bench_pack_specialised, f, layout, particles, n, out, nrep);
+    if (memcmp(out, data, n * f->particle_size) != 0) {
+      printf("Encoded data differs from file contents for layout %i\n",layout);
+      return 1;
+    }
+    printf("  %2i    %s %s %s %s %s   %3u    %6.2f -> %6.2f (%.2fx)           %6.2f -> %6.2f (%.2fx)\n",
+           layout, (layout&1) ? "sp" : "dp", (layout&2) ? "pol" : "---",
+           (layout&4) ? "upg" : "---", (layout&8) ? "uwt" : "---", (layout&16) ? "ufl" : "---",
+           f->particle_size, dec[0], dec[1], dec[0]/dec[1], enc[0], enc[1], enc[0]/enc[1]);
+    sum_dec[0] += dec[0]; sum_dec[1] += dec[1];
+    sum_enc[0] += enc[0]; sum_enc[1] += enc[1];
+
+    free(particles);
+    free(out);
+    free(data);
+    mcpl_close_file(ff);
+  }
+  remove(filename);
+  printf("\nOverall speedup: decode %.2fx, encode %.2fx\n",
+         sum_dec[0] / sum_dec[1], sum_enc[0] / sum_enc[1]);
+  printf("(options: sp/dp = single/double precision, pol = polarisation, upg = universal pdgcode,\n"
+         " uwt = universal weight, ufl = userflags)\n");
+  return 0;
+}
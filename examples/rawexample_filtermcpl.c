@@ -12,6 +12,7 @@
 
 #include "mcpl.h"
 #include <stdio.h>
+#include <string.h>
 
 int main(int argc,char**argv) {
 
@@ -32,16 +33,26 @@ int main(int argc,char**argv) {
   mcpl_transfer_metadata(fi, fo);
   mcpl_hdr_add_comment(fo,"Applied custom filter to select neutrons with ekin<0.1MeV");
 
-  //Loop over particles from input, only adding the chosen particles to the output file:
-
-  const mcpl_particle_t* particle;
-  while ( ( particle = mcpl_read(fi) ) ) {
-    if ( particle->pdgcode == 2112 && particle->ekin < 0.1 ) {
-      mcpl_add_particle(fo,particle);
-      //Note that a guaranteed non-lossy alternative to mcpl_add_particle(fo,particle)
-      //would be mcpl_transfer_last_read_particle(fi,fo) which can work directly on
-      //the serialised on-disk particle data.
-    }
+  //Define the filter. It is evaluated directly on the packed particle data in
+  //the file, so particles which are not chosen are never fully unpacked:
+
+  int32_t neutron = 2112;
+  mcpl_filter_t filter;
+  memset(&filter,0,sizeof(filter));
+  filter.criteria = MCPL_FILTER_PDGCODE | MCPL_FILTER_EKIN;
+  filter.npdgcodes = 1;
+  filter.pdgcodes = &neutron;
+  filter.ekin_min = 0.0;
+  filter.ekin_max = 0.1;
+
+  //Loop over the chosen particles from input, adding them to the output file:
+
+  mcpl_particle_t particle;
+  while ( mcpl_read_filtered(fi,&filter,&particle,1) ) {
+    mcpl_add_particle(fo,&particle);
+    //Note that a guaranteed non-lossy alternative to mcpl_add_particle(fo,&particle)
+    //would be mcpl_transfer_last_read_particle(fi,fo) which can work directly on
+    //the serialised on-disk particle data.
   }
 
   //Close up files:
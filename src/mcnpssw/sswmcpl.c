@@ -474,7 +474,21 @@ int mcpl2ssw(const char * inmcplfile, const char * outsswfile, const char * refs
 
   printf("Initiating particle conversion loop.\n");
 
-  while ( ( mcpl_p = mcpl_read(fmcpl) ) ) {
+  //Read particles in blocks for efficiency:
+  const uint64_t nblockmax = 1000;
+  mcpl_particle_t* pblock = (mcpl_particle_t*)malloc(nblockmax*sizeof(mcpl_particle_t));
+  assert(pblock);
+  uint64_t nblock = 0;
+  uint64_t iblock = 0;
+
+  while ( 1 ) {
+    if (iblock==nblock) {
+      iblock = 0;
+      nblock = mcpl_read_block(fmcpl,pblock,nblockmax);
+      if (!nblock)
+        break;
+    }
+    mcpl_p = &pblock[iblock++];
     ++ssb[0];
     ssb[2] = mcpl_p->weight;
     ssb[3] = mcpl_p->ekin;//already in MeV
@@ -551,6 +565,8 @@ int mcpl2ssw(const char * inmcplfile, const char * outsswfile, const char * refs
     }
   }
 
+  free(pblock);
+
   printf("Ending particle conversion loop.\n");
 
   if (skipped_nosswtype) {
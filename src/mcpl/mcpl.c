@@ -19,7 +19,8 @@
 //  process and the capabilities of the resulting binary.                          //
 //                                                                                 //
 //  MCPL_HASZLIB        : Define if compiling and linking with zlib, to allow      //
-//                        direct reading of .mcpl.gz files.                        //
+//                        direct reading and writing of .mcpl.gz files, and        //
+//                        multi-threaded compression in mcpl_gzip_file.            //
 //  MCPL_ZLIB_INCPATH   : Specify alternative value if the zlib header is not to   //
 //                        be included as "zlib.h".                                 //
 //  MCPL_HEADER_INCPATH : Specify alternative value if the MCPL header itself is   //
@@ -29,6 +30,23 @@
 //                        provided gzip executable.                                //
 //  MCPL_NO_CUSTOM_GZIP : Define to make sure that mcpl_gzip_file will never       //
 //                        compress via custom zlib-based code.                     //
+//  MCPL_NO_SIMD        : Define to disable the SIMD (SSSE3/SSE4.1/AVX2/AVX-512)   //
+//                        kernels used on x86 platforms for batch packing and      //
+//                        unpacking of directions, and for byte swapping of data   //
+//                        from files with foreign endianness (scalar code is then  //
+//                        always used).                                            //
+//  MCPL_NO_MMAP        : Define to make mcpl_open_file_mmap always fall back to   //
+//                        reading via standard file I/O.                           //
+//  MCPL_NO_THREADS     : Define to build without use of POSIX threads, in which   //
+//                        case MCPL_OPEN_READAHEAD and MCPL_CREATE_ASYNC are       //
+//                        ignored. Otherwise, on unix platforms mcpl.c must be     //
+//                        linked with -pthread.                                    //
+//  MCPL_NO_DIRECT_IO   : Define to make mcpl_enable_bulk_write do nothing (it is  //
+//                        otherwise supported on Linux only).                      //
+//  MCPL_HASIOURING     : Define on Linux to read and write uncompressed files via //
+//                        io_uring, keeping several large requests in flight. If   //
+//                        io_uring turns out to be unavailable at runtime (e.g.    //
+//                        old kernel), standard file I/O is used instead.          //
 //                                                                                 //
 //  This file can be freely used as per the terms in the LICENSE file.             //
 //                                                                                 //
@@ -74,6 +92,9 @@
 #ifndef _C99_SOURCE
 #  define _C99_SOURCE 1
 #endif
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE)
+#  define _DEFAULT_SOURCE 1//for syscall()
+#endif
 #include <inttypes.h>
 #include <stdio.h>
 #ifndef PRIu64//bad compiler - fallback to guessing
@@ -108,13 +129,106 @@
 #include <math.h>
 #include <unistd.h>
 #include <limits.h>
+#include <time.h>
 #ifdef MCPL_THIS_IS_MS
 #  include <fcntl.h>
 #  include <io.h>
 #endif
+#if defined(MCPL_THIS_IS_UNIX) && !defined(MCPL_NO_MMAP)
+#  define MCPLIMP_HAS_MMAP
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+#ifdef MCPL_THIS_IS_UNIX
+#  define MCPLIMP_HAS_PREAD
+#  include <errno.h>
+#endif
+#if defined(MCPL_THIS_IS_UNIX) && !defined(MCPL_NO_THREADS)
+#  define MCPLIMP_HAS_THREADS
+#  include <pthread.h>
+#  if defined(__GNUC__) || defined(__clang__)
+#    define MCPLIMP_HAS_ATOMICS
+#  endif
+#endif
+#ifdef __linux__
+#  include <sys/syscall.h>
+#  include <fcntl.h>
+#  ifdef SYS_copy_file_range
+#    define MCPLIMP_HAS_COPY_FILE_RANGE
+#  endif
+#  if defined(O_DIRECT)
+#    define MCPLIMP_O_DIRECT O_DIRECT
+#  elif defined(__O_DIRECT)
+#    define MCPLIMP_O_DIRECT __O_DIRECT//(O_DIRECT itself requires _GNU_SOURCE)
+#  endif
+#  ifdef FALLOC_FL_KEEP_SIZE
+#    define MCPLIMP_FALLOC_KEEP_SIZE FALLOC_FL_KEEP_SIZE
+#  else
+#    define MCPLIMP_FALLOC_KEEP_SIZE 0x01//(value from linux/falloc.h)
+#  endif
+#  if defined(MCPLIMP_O_DIRECT) && defined(SYS_fallocate) && !defined(MCPL_NO_DIRECT_IO)
+#    define MCPLIMP_HAS_DIRECT_IO
+#  endif
+#endif
+#if defined(MCPL_HASIOURING) && defined(__linux__)
+#  define MCPLIMP_HAS_IO_URING
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#  include <sys/mman.h>
+#  include <sys/uio.h>
+#endif
+
+//SIMD kernels with runtime dispatch require gcc/clang function target
+//attributes and the __builtin_cpu_supports function:
+#if !defined(MCPL_NO_SIMD) && ( defined(__x86_64__) || defined(__i386__) )
+#  if ( defined(__clang__) && __clang_major__ >= 7 ) || ( !defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 6 )
+#    define MCPLIMP_X86_SIMD
+#    include <immintrin.h>
+#  endif
+#endif
 
 #define MCPLIMP_NPARTICLES_POS 8
 #define MCPLIMP_MAX_PARTICLE_SIZE 96
+#define MCPLIMP_READBLOCK_NPARTICLES 4096
+#define MCPLIMP_READBUF_DEFAULT_SIZE 4194304
+#define MCPLIMP_READBUF_INITIAL_FILL 65536
+#define MCPLIMP_GZBUFFER_SIZE 131072
+#define MCPLIMP_GZBUFFER_HEADER_SIZE 4096
+#define MCPLIMP_BATCH_NPARTICLES 256
+#define MCPLIMP_URING_NSLOTS 8
+#define MCPLIMP_URING_WRITE_SLOT_SIZE 1048576
+#define MCPLIMP_WRITEBUF_DEFAULT_SIZE 1048576
+#define MCPLIMP_WRITEBUF_ALIGNMENT 4096
+#define MCPLIMP_INGEST_MAX_SLABS 64
+#define MCPLIMP_ASYNC_NBUFFERS 4
+#define MCPLIMP_CHECKPOINT_TIMECHECK_NPARTICLES 4096
+#define MCPLIMP_GZSTREAM_BLOCK_SIZE 131072
+#define MCPLIMP_GZSTREAM_DICT_SIZE 32768
+#define MCPLIMP_GZSTREAM_MAX_THREADS 64
+#define MCPLIMP_GZSTREAM_PREFIX_SIZE 39
+
+//Functions which must be inlined to be useful (the generic implementations
+//used to generate layout-specific code):
+#if defined(__GNUC__) || defined(__clang__)
+#  define MCPLIMP_FORCEINLINE static inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#  define MCPLIMP_FORCEINLINE static __forceinline
+#else
+#  define MCPLIMP_FORCEINLINE static inline
+#endif
+
+//The options affecting the layout of packed particle data give rise to 32
+//different layouts. For each layout, specialised code is generated (by
+//instantiating a generic implementation with compile time constant options),
+//so the code processing particles will not need to test the options:
+#define MCPLIMP_NLAYOUTS 32
+#define MCPLIMP_LAYOUT_INDEX(singleprec,polarisation,universalpdgcode,universalweight,userflags) \
+  ( ((singleprec)?1:0) + ((polarisation)?2:0) + ((universalpdgcode)?4:0)  \
+    + ((universalweight)?8:0) + ((userflags)?16:0) )
+#define MCPLIMP_FOREACH_LAYOUT(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)     \
+  X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19)        \
+  X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)
+#define MCPLIMP_LAYOUT_OPTIONS(L) ((L)&1), ((L)&2), ((L)&4), ((L)&8), ((L)&16)
 
 int mcpl_platform_is_little_endian() {
   //Return 0 for big endian, 1 for little endian.
@@ -122,6 +236,16 @@ int mcpl_platform_is_little_endian() {
   return (*((uint8_t*)(&i))) == 0x67;
 }
 
+MCPLIMP_FORCEINLINE uint32_t mcpl_internal_bswap32(uint32_t x)
+{
+  return ( x >> 24 ) | ( ( x >> 8 ) & 0xff00 ) | ( ( x << 8 ) & 0xff0000 ) | ( x << 24 );
+}
+
+MCPLIMP_FORCEINLINE uint64_t mcpl_internal_bswap64(uint64_t x)
+{
+  return ( (uint64_t)mcpl_internal_bswap32((uint32_t)x) << 32 ) | mcpl_internal_bswap32((uint32_t)(x >> 32));
+}
+
 void mcpl_default_error_handler(const char * msg) {
   printf("MCPL ERROR: %s\n",msg);
   exit(1);
@@ -142,6 +266,63 @@ void mcpl_set_error_handler(void (*handler)(const char *))
   mcpl_error_handler = handler;
 }
 
+//Lock guarding header data which can be accessed from several threads at once
+//(the comments and blobs of shared files, which are loaded on demand, and the
+//header of mcpl_outfile_mt_t parents, which is copied when writers are created).
+//Without threads, no lock is ever created and locking a null lock does nothing:
+typedef struct mcpl_internal_hdrlock {
+#ifdef MCPLIMP_HAS_THREADS
+  pthread_mutex_t mutex;
+#else
+  int unused;
+#endif
+} mcpl_internal_hdrlock_t;
+
+mcpl_internal_hdrlock_t * mcpl_internal_hdrlock_create(void)
+{
+#ifdef MCPLIMP_HAS_THREADS
+  mcpl_internal_hdrlock_t * l = (mcpl_internal_hdrlock_t*)malloc(sizeof(mcpl_internal_hdrlock_t));
+  if (!l)
+    mcpl_error("Unable to allocate memory for lock");
+  pthread_mutex_init(&l->mutex, 0);
+  return l;
+#else
+  return 0;
+#endif
+}
+
+void mcpl_internal_hdrlock_destroy(mcpl_internal_hdrlock_t * l)
+{
+#ifdef MCPLIMP_HAS_THREADS
+  if (l) {
+    pthread_mutex_destroy(&l->mutex);
+    free(l);
+  }
+#else
+  (void)l;
+#endif
+}
+
+void mcpl_internal_hdrlock_lock(mcpl_internal_hdrlock_t * l)
+{
+#ifdef MCPLIMP_HAS_THREADS
+  if (l)
+    pthread_mutex_lock(&l->mutex);
+#else
+  (void)l;
+#endif
+}
+
+void mcpl_internal_hdrlock_unlock(mcpl_internal_hdrlock_t * l)
+{
+#ifdef MCPLIMP_HAS_THREADS
+  if (l)
+    pthread_mutex_unlock(&l->mutex);
+#else
+  (void)l;
+#endif
+}
+
 void mcpl_store_string(char** dest, const char * src)
 {
   size_t n = strlen(src);
@@ -150,25 +331,289 @@ void mcpl_store_string(char** dest, const char * src)
     free(*dest);
   *dest = (char*)calloc(n+1,1);
   assert(*dest);
-  strncpy( *dest,src,n );
+  memcpy( *dest,src,n );
   (*dest)[n] = '\0';
   return;
 }
 
-void mcpl_write_buffer(FILE* f, uint32_t n, const char * data, const char * errmsg)
+#ifdef MCPLIMP_HAS_PREAD
+size_t mcpl_internal_pread(int fd, char * buf, size_t n, uint64_t offset)
 {
-  size_t nb = fwrite(&n, 1, sizeof(n), f);
-  if (nb!=sizeof(n))
-    mcpl_error(errmsg);
-  nb = fwrite(data, 1, n, f);
-  if (nb!=n)
-    mcpl_error(errmsg);
+  //Like pread, but continues after partial reads. Returns number of bytes read:
+  size_t nb = 0;
+  while (nb < n) {
+    ssize_t r = pread(fd, buf + nb, n - nb, (off_t)(offset + nb));
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    nb += (size_t)r;
+  }
+  return nb;
 }
-void mcpl_write_string(FILE* f, const char * str, const char * errmsg)
+
+size_t mcpl_internal_pwrite(int fd, const char * buf, size_t n, uint64_t offset)
 {
-  size_t n = strlen(str);
-  mcpl_write_buffer(f,n,str,errmsg);//nb: we don't write the terminating null-char
+  //Like pwrite, but continues after partial writes. Returns number of bytes written:
+  size_t nb = 0;
+  while (nb < n) {
+    ssize_t r = pwrite(fd, buf + nb, n - nb, (off_t)(offset + nb));
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    nb += (size_t)r;
+  }
+  return nb;
+}
+#endif
+
+#ifdef MCPLIMP_HAS_IO_URING
+//Minimal io_uring based I/O for uncompressed files (using the system calls
+//directly, so there is no dependency on liburing). Data is transferred in large
+//chunks between the file and a fixed set of buffers ("slots"), with requests
+//for all slots kept in flight simultaneously. If io_uring is not available at
+//runtime, mcpl_internal_uring_create returns null and standard file I/O is used.
+
+typedef struct {
+  char * buf;
+  struct iovec iov;
+  uint64_t offset;//position in file (bytes)
+  size_t nbytes;//size of request
+  int state;//MCPLIMP_URING_SLOT_xxx
+  int ok;//request completed with all bytes transferred
+} mcpl_internal_uring_slot_t;
+
+#define MCPLIMP_URING_SLOT_FREE 0
+#define MCPLIMP_URING_SLOT_INFLIGHT 1
+#define MCPLIMP_URING_SLOT_DONE 2
+
+typedef struct mcpl_internal_uring {
+  int ring_fd;
+  int fd;//file being read or written
+  int is_write;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  struct io_uring_sqe * sqes;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_cqe * cqes;
+  void * sq_map;
+  size_t sq_map_size;
+  void * cq_map;
+  size_t cq_map_size;
+  size_t sqes_map_size;
+  unsigned ninflight;
+  mcpl_internal_uring_slot_t slots[MCPLIMP_URING_NSLOTS];
+  size_t slot_size;//capacity of slot buffers (bytes)
+  int current;//reading: slot providing the read buffer (or -1), writing: slot being filled
+  size_t fill;//writing: bytes in current slot
+  uint64_t offset;//writing: file position of current slot
+} mcpl_internal_uring_t;
+
+mcpl_internal_uring_t * mcpl_internal_uring_create(int fd, int is_write)
+{
+  if (fd < 0)
+    return 0;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int ring_fd = (int)syscall(__NR_io_uring_setup, MCPLIMP_URING_NSLOTS, &p);
+  if (ring_fd < 0)
+    return 0;//not supported by kernel (or disabled), use standard file I/O
+  mcpl_internal_uring_t * u = (mcpl_internal_uring_t*)calloc(sizeof(mcpl_internal_uring_t),1);
+  assert(u);
+  u->ring_fd = ring_fd;
+  u->fd = fd;
+  u->is_write = is_write;
+  u->current = -1;
+  u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->sq_map = mmap(0, u->sq_map_size, PROT_READ|PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_SQ_RING);
+  u->cq_map = mmap(0, u->cq_map_size, PROT_READ|PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_CQ_RING);
+  void * sqes = mmap(0, u->sqes_map_size, PROT_READ|PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_SQES);
+  if ( u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || sqes == MAP_FAILED ) {
+    if (u->sq_map != MAP_FAILED)
+      munmap(u->sq_map, u->sq_map_size);
+    if (u->cq_map != MAP_FAILED)
+      munmap(u->cq_map, u->cq_map_size);
+    if (sqes != MAP_FAILED)
+      munmap(sqes, u->sqes_map_size);
+    close(ring_fd);
+    free(u);
+    return 0;
+  }
+  char * sq = (char*)u->sq_map;
+  char * cq = (char*)u->cq_map;
+  u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned*)(sq + p.sq_off.array);
+  u->sqes = (struct io_uring_sqe*)sqes;
+  u->cq_head = (unsigned*)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return u;
+}
+
+void mcpl_internal_uring_submit(mcpl_internal_uring_t * u, int islot, uint64_t offset, size_t nbytes)
+{
+  //Queue a read or write of nbytes at offset, to or from the buffer of the slot:
+  mcpl_internal_uring_slot_t * s = &u->slots[islot];
+  assert(s->state == MCPLIMP_URING_SLOT_FREE && nbytes <= u->slot_size);
+  s->iov.iov_base = s->buf;
+  s->iov.iov_len = nbytes;
+  s->offset = offset;
+  s->nbytes = nbytes;
+  s->state = MCPLIMP_URING_SLOT_INFLIGHT;
+  s->ok = 0;
+  unsigned tail = *u->sq_tail;
+  unsigned index = tail & *u->sq_mask;
+  struct io_uring_sqe * sqe = &u->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = u->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = u->fd;
+  sqe->addr = (uint64_t)(uintptr_t)&s->iov;
+  sqe->len = 1;
+  sqe->off = offset;
+  sqe->user_data = (uint64_t)islot;
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++u->ninflight;
+  while ( syscall(__NR_io_uring_enter, u->ring_fd, 1, 0, 0, (void*)0, 0) < 0 ) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+      mcpl_error("Errors encountered while submitting I/O requests.");
+  }
+}
+
+void mcpl_internal_uring_complete_one(mcpl_internal_uring_t * u)
+{
+  //Wait for the next request to complete and mark its slot as done. Partial
+  //transfers (which are rare for regular files) are completed synchronously:
+  assert(u->ninflight);
+  unsigned head = *u->cq_head;
+  while ( head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) ) {
+    if ( syscall(__NR_io_uring_enter, u->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, (void*)0, 0) < 0
+         && errno != EINTR && errno != EAGAIN && errno != EBUSY )
+      mcpl_error("Errors encountered while waiting for I/O requests to complete.");
+  }
+  struct io_uring_cqe * cqe = &u->cqes[head & *u->cq_mask];
+  mcpl_internal_uring_slot_t * s = &u->slots[cqe->user_data];
+  int res = cqe->res;
+  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+  --u->ninflight;
+  size_t nb = res > 0 ? (size_t)res : 0;
+  if ( res >= 0 && nb < s->nbytes ) {
+    if (u->is_write)
+      nb += mcpl_internal_pwrite(u->fd, s->buf + nb, s->nbytes - nb, s->offset + nb);
+    else
+      nb += mcpl_internal_pread(u->fd, s->buf + nb, s->nbytes - nb, s->offset + nb);
+  }
+  s->ok = ( res >= 0 && nb == s->nbytes );
+  s->state = MCPLIMP_URING_SLOT_DONE;
+}
+
+void mcpl_internal_uring_wait_slot(mcpl_internal_uring_t * u, int islot)
+{
+  while (u->slots[islot].state == MCPLIMP_URING_SLOT_INFLIGHT)
+    mcpl_internal_uring_complete_one(u);
+}
+
+void mcpl_internal_uring_release_slots(mcpl_internal_uring_t * u, int freebufs)
+{
+  //Wait for all requests and mark all slots as free (optionally also freeing
+  //the buffers):
+  while (u->ninflight)
+    mcpl_internal_uring_complete_one(u);
+  int i;
+  for (i = 0; i < MCPLIMP_URING_NSLOTS; ++i) {
+    u->slots[i].state = MCPLIMP_URING_SLOT_FREE;
+    if (freebufs) {
+      free(u->slots[i].buf);
+      u->slots[i].buf = 0;
+    }
+  }
+  if (freebufs)
+    u->slot_size = 0;
+  u->current = -1;
+}
+
+void mcpl_internal_uring_alloc_slots(mcpl_internal_uring_t * u, size_t slot_size)
+{
+  int i;
+  for (i = 0; i < MCPLIMP_URING_NSLOTS; ++i) {
+    u->slots[i].buf = (char*)malloc(slot_size);
+    if (!u->slots[i].buf)
+      mcpl_error("Unable to allocate I/O buffers");
+  }
+  u->slot_size = slot_size;
+}
+
+void mcpl_internal_uring_destroy(mcpl_internal_uring_t * u)
+{
+  mcpl_internal_uring_release_slots(u, 1);
+  munmap(u->sqes, u->sqes_map_size);
+  munmap(u->cq_map, u->cq_map_size);
+  munmap(u->sq_map, u->sq_map_size);
+  close(u->ring_fd);
+  free(u);
+}
+
+void mcpl_internal_uring_write(mcpl_internal_uring_t * u, const char * data, size_t n)
+{
+  //Append data to the output, submitting a write whenever a slot is full:
+  if (!u->slot_size) {
+    mcpl_internal_uring_alloc_slots(u, MCPLIMP_URING_WRITE_SLOT_SIZE);
+    u->current = 0;
+    u->fill = 0;
+  }
+  while (n) {
+    size_t nc = u->slot_size - u->fill;
+    if (nc > n)
+      nc = n;
+    memcpy(u->slots[u->current].buf + u->fill, data, nc);
+    u->fill += nc;
+    data += nc;
+    n -= nc;
+    if (u->fill == u->slot_size) {
+      mcpl_internal_uring_submit(u, u->current, u->offset, u->fill);
+      u->offset += u->fill;
+      u->fill = 0;
+      u->current = ( u->current + 1 ) % MCPLIMP_URING_NSLOTS;
+      mcpl_internal_uring_slot_t * s = &u->slots[u->current];
+      mcpl_internal_uring_wait_slot(u, u->current);
+      if ( s->state == MCPLIMP_URING_SLOT_DONE && !s->ok )
+        mcpl_error("Errors encountered while attempting to write particle data.");
+      s->state = MCPLIMP_URING_SLOT_FREE;
+    }
+  }
+}
+
+void mcpl_internal_uring_flush(mcpl_internal_uring_t * u)
+{
+  //Write any remaining data and wait for all writes to complete:
+  if (!u->slot_size)
+    return;
+  if (u->fill) {
+    mcpl_internal_uring_submit(u, u->current, u->offset, u->fill);
+    u->offset += u->fill;
+    u->fill = 0;
+    u->current = ( u->current + 1 ) % MCPLIMP_URING_NSLOTS;
+  }
+  while (u->ninflight)
+    mcpl_internal_uring_complete_one(u);
+  int i;
+  for (i = 0; i < MCPLIMP_URING_NSLOTS; ++i) {
+    if ( u->slots[i].state == MCPLIMP_URING_SLOT_DONE && !u->slots[i].ok )
+      mcpl_error("Errors encountered while attempting to write particle data.");
+    u->slots[i].state = MCPLIMP_URING_SLOT_FREE;
+  }
 }
+#else
+typedef struct mcpl_internal_uring mcpl_internal_uring_t;
+#endif
 
 typedef struct {
   char * filename;
@@ -190,141 +635,647 @@ typedef struct {
   unsigned particle_size;
   mcpl_particle_t* puser;
   unsigned opt_signature;
+  void (*pack_fields)(const mcpl_particle_t*, const double*, char*);
+  mcpl_internal_uring_t * uring;//writing of particle data via io_uring (or null)
+  char * writebuf;//particle data not yet written to file (allocated on first use)
+  uint64_t writebuf_size;
+  uint64_t writebuf_fill;
+  uint64_t writebuf_limit;//flush when reaching this fill (to keep writes aligned)
+  int role;//MCPLIMP_ROLE_xxx
+  mcpl_internal_hdrlock_t * hdrlock;//mcpl_outfile_mt_t parents: guards header data (or null)
+  struct mcpl_internal_ingest * ingest;//thread-safe ingestion via producers (or null)
+  struct mcpl_internal_slab * slab;//particles not yet published by a producer (or null)
+  struct mcpl_internal_async * async;//background writing of the write buffer (or null)
+  struct mcpl_internal_gzstream * gz;//compression of everything after the prefix (or null)
+  struct mcpl_internal_direct * direct;//bulk writing via mcpl_enable_bulk_write (or null)
+  uint64_t ckpt_interval;//checkpoint every this many particles (0: never)
+  double ckpt_seconds;//checkpoint after this many seconds (0: never)
+  int ckpt_sync;
+  uint64_t ckpt_last;//nparticles at last checkpoint
+  uint64_t ckpt_next;//nparticles at which to consider next checkpoint
+  time_t ckpt_time;//time of last checkpoint
   char particle_buffer[MCPLIMP_MAX_PARTICLE_SIZE];
 } mcpl_outfileinternal_t;
 
 #define MCPLIMP_OUTFILEDECODE mcpl_outfileinternal_t * f = (mcpl_outfileinternal_t *)of.internal; assert(f)
 
-void mcpl_recalc_psize(mcpl_outfile_t of)
+//Roles of output file objects (mcpl_outfile_mt_t parents and writers, and
+//producers from mcpl_outfile_producer):
+#define MCPLIMP_ROLE_NORMAL 0
+#define MCPLIMP_ROLE_SHARD_PARENT 1
+#define MCPLIMP_ROLE_SHARD_WRITER 2
+#define MCPLIMP_ROLE_PRODUCER 3
+
+unsigned mcpl_internal_ncpu(void)
 {
-  MCPLIMP_OUTFILEDECODE;
-  unsigned fp = f->opt_singleprec ? sizeof(float) : sizeof(double);
-  f->particle_size = 7*fp;
-  if (f->opt_polarisation)
-    f->particle_size += 3*fp;
-  if (!f->opt_universalpdgcode)
-    f->particle_size += sizeof(int32_t);
-  if (!f->opt_universalweight)
-    f->particle_size += fp;
-  if (f->opt_userflags)
-    f->particle_size += sizeof(uint32_t);
-  assert(f->particle_size<=MCPLIMP_MAX_PARTICLE_SIZE);
-  f->opt_signature = 0
-    + 1 * f->opt_singleprec
-    + 2 * f->opt_polarisation
-    + 4 * f->opt_universalpdgcode
-    + 8 * (f->opt_universalweight?1:0)
-    + 16 * f->opt_userflags;
+#ifdef _SC_NPROCESSORS_ONLN
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  return ( ncpu > 0 ? (unsigned)ncpu : 1 );
+#else
+  return 1;
+#endif
 }
 
-void mcpl_platform_compatibility_check() {
-  static int first = 1;
-  if (!first)
-    return;
-  first = 0;
-
-  if (CHAR_BIT!=8)
-    mcpl_error("Platform compatibility check failed (bytes are not 8 bit)");
-
-  if (sizeof(float)!=4)
-    mcpl_error("Platform compatibility check failed (float is not 4 bytes)");
-
-  if (sizeof(double)!=8)
-    mcpl_error("Platform compatibility check failed (double is not 8 bytes)");
-
-  int32_t m1_32 = -1;
-  int32_t not0_32 = ~0;
-  int64_t m1_64 = -1;
-  int64_t not0_64 = ~0;
-  if ( m1_32 != not0_32 || m1_64 != not0_64 )
-    mcpl_error("Platform compatibility check failed (integers are not two's complement)");
+//Initial bytes of all MCPL files: magic word (MCPL), file format version
+//('001'-'999') and endianness used in the file ('L' or 'B'):
+void mcpl_internal_file_signature(unsigned char * start)
+{
+  start[0] = 'M'; start[1] = 'C'; start[2] = 'P'; start[3] = 'L';
+  start[4] = (MCPL_FORMATVERSION/100)%10 + '0';
+  start[5] = (MCPL_FORMATVERSION/10)%10 + '0';
+  start[6] = MCPL_FORMATVERSION%10 + '0';
+  start[7] = mcpl_platform_is_little_endian() ? 'L' : 'B';
+}
 
+static unsigned mcpl_compression_threads = 0;//0: one per CPU
 
-  if (copysign(1.0, -0.0) != -1.0)
-    mcpl_error("Platform compatibility check failed (floating point numbers do not have signed zero)");
+void mcpl_set_compression_threads(unsigned nthreads)
+{
+  mcpl_compression_threads = nthreads;
+}
 
-  mcpl_particle_t pd;
-  if ( (char*)&(pd.userflags)-(char*)&(pd) != 12*sizeof(double)+sizeof(uint32_t) )
-    mcpl_error("Platform compatibility check failed (unexpected padding in mcpl_particle_t)");
+#ifdef MCPL_HASZLIB
+//Compression of gzip streams, used both for writing .mcpl.gz files directly
+//and by mcpl_gzip_file. As in pigz, the input is cut into blocks which are
+//compressed independently (in parallel by a pool of worker threads, when
+//several CPUs are available) as raw deflate data, each primed with the last
+//32kB of the preceding input as dictionary to preserve the compression ratio,
+//and ended with a sync flush so all but the last block end on byte boundaries
+//and can simply be concatenated. The CRC-32 values of the blocks are combined
+//for the gzip trailer. The output is a single standard gzip stream, which only
+//depends on the input (not on the number of threads). Short streams of a
+//single block are compressed in the calling thread, and the worker threads
+//(and their blocks) are only set up once the second block is submitted:
+typedef struct {
+  char * buf;//dictionary (last part of previous block) followed by the input
+  size_t ndict;
+  size_t nin;
+  unsigned char * out;
+  size_t nout;
+  size_t outcap;
+  uLong crc;
+  int last;
+  int done;//1 when compressed, -1 in case of errors
+} mcpl_internal_gzblock_t;
+
+typedef struct mcpl_internal_gzstream {
+  unsigned nthreads;//0 when compressing in the calling thread
+  unsigned nblocks;
+  mcpl_internal_gzblock_t * blocks;
+  uint64_t nsubmitted;//blocks handed over for compression (the next is being filled)
+  uint64_t ntaken;//blocks taken by workers
+  uint64_t nwritten;//blocks written to the file
+  z_stream zs;//for compression in the calling thread
+  uLong crc;
+  uint64_t isize;
+  int started;
+  int error;
+#ifdef MCPLIMP_HAS_THREADS
+  pthread_t * threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_work;
+  pthread_cond_t cond_done;
+  int quit;
+#endif
+} mcpl_internal_gzstream_t;
 
+int mcpl_internal_gzblock_compress(z_stream * zs, mcpl_internal_gzblock_t * b)
+{
+  char * in = b->buf + MCPLIMP_GZSTREAM_DICT_SIZE;
+  b->crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef*)in, (uInt)b->nin);
+  if (deflateReset(zs) != Z_OK)
+    return 0;
+  if ( b->ndict && deflateSetDictionary(zs, (const Bytef*)(in - b->ndict), (uInt)b->ndict) != Z_OK )
+    return 0;
+  zs->next_in = (Bytef*)in;
+  zs->avail_in = (uInt)b->nin;
+  b->nout = 0;
+  int flush = b->last ? Z_FINISH : Z_SYNC_FLUSH;
+  while (1) {
+    if ( b->outcap - b->nout < 64 ) {
+      size_t newcap = b->outcap ? 2 * b->outcap : deflateBound(zs, (uLong)b->nin) + 64;
+      unsigned char * newout = (unsigned char*)realloc(b->out, newcap);
+      if (!newout)
+        return 0;
+      b->out = newout;
+      b->outcap = newcap;
+    }
+    zs->next_out = b->out + b->nout;
+    zs->avail_out = (uInt)( b->outcap - b->nout );
+    int rc = deflate(zs, flush);
+    b->nout = b->outcap - zs->avail_out;
+    if ( rc == Z_STREAM_ERROR )
+      return 0;
+    if ( flush == Z_FINISH ? rc == Z_STREAM_END : ( zs->avail_out != 0 && !zs->avail_in ) )
+      return 1;
+  }
 }
 
-mcpl_outfile_t mcpl_create_outfile(const char * filename)
+int mcpl_internal_gzstream_init_deflate(z_stream * zs)
 {
-  //Sanity check chosen filename and append ".mcpl" if missing to help people
-  //who forgot to add the extension (in the hope of higher consistency).
-  if (!filename)
-    mcpl_error("mcpl_create_outfile called with null string.");
-  size_t n = strlen(filename);
-  if (!n)
-    mcpl_error("mcpl_create_outfile called with empty string.");
-  if (n>4096)
-    mcpl_error("mcpl_create_outfile called with too long string.");
-  const char * lastdot = strrchr(filename, '.');
-  if (lastdot==filename && n==5)
-    mcpl_error("mcpl_create_outfile called with string with no basename part (\".mcpl\").");
-
-  //Initialise data structures and open file:
-  mcpl_platform_compatibility_check();
-
-  mcpl_outfile_t out;
-  out.internal = 0;
-
-  mcpl_outfileinternal_t * f = (mcpl_outfileinternal_t*)calloc(sizeof(mcpl_outfileinternal_t),1);
-  assert(f);
+  memset(zs, 0, sizeof(*zs));
+  //Negative windowBits gives raw deflate data, without header and trailer:
+  return deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
 
-  if (!lastdot || strcmp(lastdot, ".mcpl") != 0) {
-    f->filename = (char*)malloc(n+6);
-    f->filename[0] = '\0';
-    strcat(f->filename,filename);
-    strcat(f->filename,".mcpl");
-  } else {
-    f->filename = (char*)malloc(n+1);
-    f->filename[0] = '\0';
-    strcat(f->filename,filename);
+#ifdef MCPLIMP_HAS_THREADS
+void * mcpl_internal_gzstream_worker(void * arg)
+{
+  mcpl_internal_gzstream_t * gz = (mcpl_internal_gzstream_t*)arg;
+  z_stream zs;
+  int zs_ok = mcpl_internal_gzstream_init_deflate(&zs);
+  pthread_mutex_lock(&gz->mutex);
+  while (1) {
+    while ( gz->ntaken == gz->nsubmitted && !gz->quit )
+      pthread_cond_wait(&gz->cond_work, &gz->mutex);
+    if ( gz->ntaken == gz->nsubmitted )
+      break;
+    mcpl_internal_gzblock_t * b = &gz->blocks[ gz->ntaken++ % gz->nblocks ];
+    pthread_mutex_unlock(&gz->mutex);
+    int ok = zs_ok && mcpl_internal_gzblock_compress(&zs, b);
+    pthread_mutex_lock(&gz->mutex);
+    b->done = ok ? 1 : -1;
+    pthread_cond_broadcast(&gz->cond_done);
   }
-
-  f->hdr_srcprogname = 0;
-  f->ncomments = 0;
-  f->comments = 0;
-  f->nblobs = 0;
-  f->blobkeys = 0;
-  f->bloblengths = 0;
-  f->blobs = 0;
-  f->opt_userflags = 0;
-  f->opt_polarisation = 0;
-  f->opt_singleprec = 1;
-  f->opt_universalpdgcode = 0;
-  f->opt_universalweight = 0.0;
-  f->header_notwritten = 1;
-  f->nparticles = 0;
-  f->file = fopen(f->filename,"wb");
-  if (!f->file)
-    mcpl_error("Unable to open output file!");
-
-  out.internal = f;
-  mcpl_recalc_psize(out);
-  return out;
+  pthread_mutex_unlock(&gz->mutex);
+  if (zs_ok)
+    deflateEnd(&zs);
+  return 0;
 }
+#endif
 
-const char * mcpl_outfile_filename(mcpl_outfile_t of) {
-  MCPLIMP_OUTFILEDECODE;
-  return f->filename;
+mcpl_internal_gzstream_t * mcpl_internal_gzstream_create(void)
+{
+  mcpl_internal_gzstream_t * gz = (mcpl_internal_gzstream_t*)calloc(sizeof(mcpl_internal_gzstream_t),1);
+  if (!gz)
+    mcpl_error("Unable to allocate memory for compression");
+  if (!mcpl_internal_gzstream_init_deflate(&gz->zs))
+    mcpl_error("Unable to initialise compression");
+  gz->crc = crc32(0L, Z_NULL, 0);
+  gz->nblocks = 1;
+  gz->blocks = (mcpl_internal_gzblock_t*)calloc(sizeof(mcpl_internal_gzblock_t),1);
+  if (!gz->blocks)
+    mcpl_error("Unable to allocate memory for compression");
+  gz->blocks[0].buf = (char*)malloc(MCPLIMP_GZSTREAM_DICT_SIZE + MCPLIMP_GZSTREAM_BLOCK_SIZE);
+  if (!gz->blocks[0].buf)
+    mcpl_error("Unable to allocate memory for compression");
+  return gz;
 }
 
-void mcpl_hdr_set_srcname(mcpl_outfile_t of,const char * spn)
+#ifdef MCPLIMP_HAS_THREADS
+void mcpl_internal_gzstream_start_workers(mcpl_internal_gzstream_t * gz)
 {
-  MCPLIMP_OUTFILEDECODE;
-  if (!f->header_notwritten)
-    mcpl_error("mcpl_hdr_set_srcname called too late.");
-  mcpl_store_string(&(f->hdr_srcprogname),spn);
+  //Called when the second block is submitted (all earlier blocks have been
+  //compressed and written, and the submitted block is the only one in use):
+  assert( gz->nblocks == 1 && gz->nwritten == gz->nsubmitted );
+  unsigned n = mcpl_compression_threads ? mcpl_compression_threads : mcpl_internal_ncpu();
+  if ( n > MCPLIMP_GZSTREAM_MAX_THREADS )
+    n = MCPLIMP_GZSTREAM_MAX_THREADS;
+  if ( n < 2 )
+    return;//compress in the calling thread
+  //Enough blocks to keep all workers busy while the oldest one is written,
+  //with the submitted block moved to its place in the larger ring:
+  unsigned nblocks = 2 * n + 1;
+  mcpl_internal_gzblock_t * blocks = (mcpl_internal_gzblock_t*)calloc(sizeof(mcpl_internal_gzblock_t),nblocks);
+  pthread_t * threads = (pthread_t*)malloc(sizeof(pthread_t)*n);
+  if ( !blocks || !threads )
+    mcpl_error("Unable to allocate memory for compression");
+  unsigned i, icur = (unsigned)( gz->nsubmitted % nblocks );
+  blocks[icur] = gz->blocks[0];
+  for (i = 0; i < nblocks; ++i) {
+    if (i == icur)
+      continue;
+    blocks[i].buf = (char*)malloc(MCPLIMP_GZSTREAM_DICT_SIZE + MCPLIMP_GZSTREAM_BLOCK_SIZE);
+    if (!blocks[i].buf)
+      mcpl_error("Unable to allocate memory for compression");
+  }
+  free(gz->blocks);
+  gz->blocks = blocks;
+  gz->nblocks = nblocks;
+  gz->threads = threads;
+  gz->ntaken = gz->nsubmitted;
+  pthread_mutex_init(&gz->mutex, 0);
+  pthread_cond_init(&gz->cond_work, 0);
+  pthread_cond_init(&gz->cond_done, 0);
+  for (i = 0; i < n; ++i) {
+    if (pthread_create(&gz->threads[gz->nthreads], 0, mcpl_internal_gzstream_worker, gz) != 0)
+      break;//fine, simply proceed with fewer threads (or none)
+    ++gz->nthreads;
+  }
 }
+#endif
 
-void mcpl_hdr_add_comment(mcpl_outfile_t of,const char *comment)
+void mcpl_internal_gzstream_destroy(mcpl_internal_gzstream_t * gz)
 {
-  MCPLIMP_OUTFILEDECODE;
-  if (!f->header_notwritten)
-    mcpl_error("mcpl_hdr_add_comment called too late.");
+#ifdef MCPLIMP_HAS_THREADS
+  if (gz->threads) {
+    pthread_mutex_lock(&gz->mutex);
+    gz->quit = 1;
+    pthread_cond_broadcast(&gz->cond_work);
+    pthread_mutex_unlock(&gz->mutex);
+    unsigned i;
+    for (i = 0; i < gz->nthreads; ++i)
+      pthread_join(gz->threads[i], 0);
+    pthread_cond_destroy(&gz->cond_done);
+    pthread_cond_destroy(&gz->cond_work);
+    pthread_mutex_destroy(&gz->mutex);
+    free(gz->threads);
+  }
+#endif
+  unsigned i;
+  for (i = 0; i < gz->nblocks; ++i) {
+    free(gz->blocks[i].buf);
+    free(gz->blocks[i].out);
+  }
+  free(gz->blocks);
+  deflateEnd(&gz->zs);
+  free(gz);
+}
+
+void mcpl_internal_gzstream_write_blocks(mcpl_internal_gzstream_t * gz, FILE * file, uint64_t nmin)
+{
+  //Write compressed blocks in order, waiting until at least nmin blocks have
+  //been written in total:
+#ifndef MCPLIMP_HAS_THREADS
+  (void)nmin;//(blocks are always compressed already)
+#endif
+  while ( gz->nwritten < gz->nsubmitted ) {
+    mcpl_internal_gzblock_t * b = &gz->blocks[ gz->nwritten % gz->nblocks ];
+    int done;
+#ifdef MCPLIMP_HAS_THREADS
+    if ( gz->nthreads ) {
+      pthread_mutex_lock(&gz->mutex);
+      while ( !b->done && gz->nwritten < nmin )
+        pthread_cond_wait(&gz->cond_done, &gz->mutex);
+      done = b->done;
+      pthread_mutex_unlock(&gz->mutex);
+    } else
+#endif
+      done = b->done;
+    if (!done)
+      break;
+    if ( done < 0 || fwrite(b->out, 1, b->nout, file) != b->nout )
+      gz->error = 1;
+    gz->crc = crc32_combine(gz->crc, b->crc, (z_off_t)b->nin);
+    gz->isize += b->nin;
+    b->done = 0;
+    ++gz->nwritten;
+  }
+}
+
+void mcpl_internal_gzstream_submit(mcpl_internal_gzstream_t * gz, FILE * file, int last)
+{
+#ifdef MCPLIMP_HAS_THREADS
+  if ( gz->nsubmitted == 1 && !last )
+    mcpl_internal_gzstream_start_workers(gz);
+#endif
+  mcpl_internal_gzblock_t * b = &gz->blocks[ gz->nsubmitted % gz->nblocks ];
+  b->last = last;
+#ifdef MCPLIMP_HAS_THREADS
+  if ( gz->nthreads ) {
+    pthread_mutex_lock(&gz->mutex);
+    ++gz->nsubmitted;
+    pthread_cond_signal(&gz->cond_work);
+    pthread_mutex_unlock(&gz->mutex);
+  } else
+#endif
+  {
+    b->done = mcpl_internal_gzblock_compress(&gz->zs, b) ? 1 : -1;
+    ++gz->nsubmitted;
+  }
+  //Make room for the next block, and prime it with the end of this one:
+  uint64_t nmin = gz->nsubmitted;
+  if (!last)
+    nmin = ( nmin + 1 > gz->nblocks ? nmin + 1 - gz->nblocks : 0 );
+  mcpl_internal_gzstream_write_blocks(gz, file, nmin);
+  if (last)
+    return;
+  mcpl_internal_gzblock_t * bnext = &gz->blocks[ gz->nsubmitted % gz->nblocks ];
+  bnext->ndict = b->nin < MCPLIMP_GZSTREAM_DICT_SIZE ? b->nin : MCPLIMP_GZSTREAM_DICT_SIZE;
+  memcpy(bnext->buf + MCPLIMP_GZSTREAM_DICT_SIZE - bnext->ndict,
+         b->buf + MCPLIMP_GZSTREAM_DICT_SIZE + b->nin - bnext->ndict, bnext->ndict);
+  bnext->nin = 0;
+}
+
+int mcpl_internal_gzstream_write(mcpl_internal_gzstream_t * gz, FILE * file,
+                                 const char * buf, uint64_t nbytes, int finish)
+{
+  //Compress data and write to file. With finish, the stream is ended, and no
+  //more data can be written. Returns 0 in case of errors:
+  if (!gz->started) {
+    static const unsigned char gzhdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255 };
+    if ( fwrite(gzhdr, 1, sizeof(gzhdr), file) != sizeof(gzhdr) )
+      gz->error = 1;
+    gz->started = 1;
+  }
+  while ( nbytes ) {
+    mcpl_internal_gzblock_t * b = &gz->blocks[ gz->nsubmitted % gz->nblocks ];
+    size_t n = MCPLIMP_GZSTREAM_BLOCK_SIZE - b->nin;
+    if ( n > nbytes )
+      n = nbytes;
+    memcpy(b->buf + MCPLIMP_GZSTREAM_DICT_SIZE + b->nin, buf, n);
+    b->nin += n;
+    buf += n;
+    nbytes -= n;
+    if ( b->nin == MCPLIMP_GZSTREAM_BLOCK_SIZE )
+      mcpl_internal_gzstream_submit(gz, file, 0);
+  }
+  if (finish) {
+    mcpl_internal_gzstream_submit(gz, file, 1);
+    unsigned char trailer[8];
+    unsigned i;
+    for (i = 0; i < 4; ++i) {
+      trailer[i] = (unsigned char)( ( gz->crc >> (8*i) ) & 0xff );
+      trailer[4+i] = (unsigned char)( ( gz->isize >> (8*i) ) & 0xff );//(modulo 2^32)
+    }
+    if ( fwrite(trailer, 1, sizeof(trailer), file) != sizeof(trailer) )
+      gz->error = 1;
+  }
+  return !gz->error;
+}
+
+//With MCPL_CREATE_GZIP, .mcpl.gz files are compressed while being written. As
+//the compressed data can not be updated afterwards, the file consists of two
+//gzip members (which readers decompress as one continuous stream): A prefix
+//with the initial 16 bytes of the header (up to and including the number of
+//particles) in a single uncompressed ("stored") deflate block, which has a
+//fixed size and is simply rewritten when the file is closed, followed by the
+//rest of the header and all particle data compressed on the fly:
+void mcpl_internal_gzstream_write_prefix(FILE * file, uint64_t nparticles)
+{
+  //Gzip member with the initial 16 bytes of the header, see above:
+  const char * errmsg = "Errors encountered while attempting to write file header.";
+  unsigned char p[MCPLIMP_GZSTREAM_PREFIX_SIZE] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255,//gzip header
+                                                    1, 16, 0, 0xef, 0xff };//final stored block of 16 bytes
+  mcpl_internal_file_signature(p+15);
+  memcpy(p+23, &nparticles, sizeof(nparticles));
+  uLong crc = crc32(crc32(0L, Z_NULL, 0), p+15, 16);
+  unsigned i;
+  for (i = 0; i < 4; ++i) {
+    p[31+i] = (unsigned char)( ( crc >> (8*i) ) & 0xff );
+    p[35+i] = ( i == 0 ? 16 : 0 );//uncompressed size
+  }
+  if ( fseek(file, 0, SEEK_SET) || fwrite(p, 1, sizeof(p), file) != sizeof(p) )
+    mcpl_error(errmsg);
+}
+#else
+typedef struct mcpl_internal_gzstream mcpl_internal_gzstream_t;
+#endif
+
+MCPLIMP_FORCEINLINE void mcpl_internal_pack_fields_generic( const mcpl_particle_t* particle,
+                                                            const double * pack_ekindir,
+                                                            char * pbuf,
+                                                            int opt_singleprec,
+                                                            int opt_polarisation,
+                                                            int opt_universalpdgcode,
+                                                            int opt_universalweight,
+                                                            int opt_userflags )
+{
+  //Serialise particle object (with ekin and direction already packed into
+  //pack_ekindir) to buffer, according to the layout given by the options:
+  unsigned ibuf = 0;
+  int i;
+  if (opt_singleprec) {
+    if (opt_polarisation) {
+      for (i=0;i<3;++i) {
+        *(float*)&pbuf[ibuf] = (float)particle->polarisation[i];
+        ibuf += sizeof(float);
+      }
+    }
+    for (i=0;i<3;++i) {
+      *(float*)&pbuf[ibuf] = (float)particle->position[i];
+      ibuf += sizeof(float);
+    }
+    for (i=0;i<3;++i) {
+      *(float*)&pbuf[ibuf] = (float)pack_ekindir[i];
+      ibuf += sizeof(float);
+    }
+    *(float*)&pbuf[ibuf] = (float)particle->time;
+    ibuf += sizeof(float);
+    if (!opt_universalweight) {
+      *(float*)&pbuf[ibuf] = (float)particle->weight;
+      ibuf += sizeof(float);
+    }
+  } else {
+    if (opt_polarisation) {
+      for (i=0;i<3;++i) {
+        *(double*)&pbuf[ibuf] = particle->polarisation[i];
+        ibuf += sizeof(double);
+      }
+    }
+    for (i=0;i<3;++i) {
+      *(double*)&pbuf[ibuf] = particle->position[i];
+      ibuf += sizeof(double);
+    }
+    for (i=0;i<3;++i) {
+      *(double*)&pbuf[ibuf] = pack_ekindir[i];
+      ibuf += sizeof(double);
+    }
+    *(double*)&pbuf[ibuf] = particle->time;
+    ibuf += sizeof(double);
+    if (!opt_universalweight) {
+      *(double*)&pbuf[ibuf] = particle->weight;
+      ibuf += sizeof(double);
+    }
+  }
+  if (!opt_universalpdgcode) {
+    *(int32_t*)&pbuf[ibuf] = particle->pdgcode;
+    ibuf += sizeof(int32_t);
+  }
+  if (opt_userflags) {
+    *(uint32_t*)&pbuf[ibuf] = particle->userflags;
+  }
+}
+
+#define MCPLIMP_DEFINE_PACK_FIELDS(L)                                                   \
+  static void mcpl_internal_pack_fields_##L( const mcpl_particle_t* particle,           \
+                                             const double * pack_ekindir, char * pbuf ) \
+  {                                                                                     \
+    mcpl_internal_pack_fields_generic( particle, pack_ekindir, pbuf,                   \
+                                       MCPLIMP_LAYOUT_OPTIONS(L) );                    \
+  }
+MCPLIMP_FOREACH_LAYOUT(MCPLIMP_DEFINE_PACK_FIELDS)
+#define MCPLIMP_PACK_FIELDS_ENTRY(L) &mcpl_internal_pack_fields_##L,
+static void (* const mcpl_internal_pack_fields_fcts[MCPLIMP_NLAYOUTS])(const mcpl_particle_t*,
+                                                                       const double*, char*) = {
+  MCPLIMP_FOREACH_LAYOUT(MCPLIMP_PACK_FIELDS_ENTRY)
+};
+
+void mcpl_recalc_psize(mcpl_outfile_t of)
+{
+  MCPLIMP_OUTFILEDECODE;
+  unsigned fp = f->opt_singleprec ? sizeof(float) : sizeof(double);
+  f->particle_size = 7*fp;
+  if (f->opt_polarisation)
+    f->particle_size += 3*fp;
+  if (!f->opt_universalpdgcode)
+    f->particle_size += sizeof(int32_t);
+  if (!f->opt_universalweight)
+    f->particle_size += fp;
+  if (f->opt_userflags)
+    f->particle_size += sizeof(uint32_t);
+  assert(f->particle_size<=MCPLIMP_MAX_PARTICLE_SIZE);
+  f->opt_signature = 0
+    + 1 * f->opt_singleprec
+    + 2 * f->opt_polarisation
+    + 4 * f->opt_universalpdgcode
+    + 8 * (f->opt_universalweight?1:0)
+    + 16 * f->opt_userflags;
+  f->pack_fields = mcpl_internal_pack_fields_fcts[MCPLIMP_LAYOUT_INDEX(f->opt_singleprec,
+                                                                       f->opt_polarisation,
+                                                                       f->opt_universalpdgcode,
+                                                                       f->opt_universalweight,
+                                                                       f->opt_userflags)];
+}
+
+void mcpl_platform_compatibility_check() {
+  static int first = 1;
+  if (!first)
+    return;
+  first = 0;
+
+  if (CHAR_BIT!=8)
+    mcpl_error("Platform compatibility check failed (bytes are not 8 bit)");
+
+  if (sizeof(float)!=4)
+    mcpl_error("Platform compatibility check failed (float is not 4 bytes)");
+
+  if (sizeof(double)!=8)
+    mcpl_error("Platform compatibility check failed (double is not 8 bytes)");
+
+  int32_t m1_32 = -1;
+  int32_t not0_32 = ~0;
+  int64_t m1_64 = -1;
+  int64_t not0_64 = ~0;
+  if ( m1_32 != not0_32 || m1_64 != not0_64 )
+    mcpl_error("Platform compatibility check failed (integers are not two's complement)");
+
+
+  if (copysign(1.0, -0.0) != -1.0)
+    mcpl_error("Platform compatibility check failed (floating point numbers do not have signed zero)");
+
+  mcpl_particle_t pd;
+  if ( (char*)&(pd.userflags)-(char*)&(pd) != 12*sizeof(double)+sizeof(uint32_t) )
+    mcpl_error("Platform compatibility check failed (unexpected padding in mcpl_particle_t)");
+
+}
+
+mcpl_outfile_t mcpl_internal_create_outfile(const char * filename, int gzip)
+{
+  //Sanity check chosen filename and append ".mcpl" if missing to help people
+  //who forgot to add the extension (in the hope of higher consistency).
+  if (!filename)
+    mcpl_error("mcpl_create_outfile called with null string.");
+  size_t n = strlen(filename);
+  if (!n)
+    mcpl_error("mcpl_create_outfile called with empty string.");
+  if (n>4096)
+    mcpl_error("mcpl_create_outfile called with too long string.");
+  //For compressed files, ".gz" is (re)appended below:
+  if ( gzip && n > 3 && strcmp(filename + n - 3, ".gz") == 0 )
+    n -= 3;
+  const char * lastdot = 0;
+  size_t i;
+  for (i = 0; i < n; ++i)
+    if (filename[i] == '.')
+      lastdot = filename + i;
+  if (lastdot==filename && n==5)
+    mcpl_error("mcpl_create_outfile called with string with no basename part (\".mcpl\").");
+
+  //Initialise data structures and open file:
+  mcpl_platform_compatibility_check();
+
+  mcpl_outfile_t out;
+  out.internal = 0;
+
+  mcpl_outfileinternal_t * f = (mcpl_outfileinternal_t*)calloc(sizeof(mcpl_outfileinternal_t),1);
+  assert(f);
+
+  if (!lastdot || (size_t)( filename + n - lastdot ) != 5 || strncmp(lastdot, ".mcpl", 5) != 0) {
+    f->filename = (char*)malloc(n+9);
+    f->filename[0] = '\0';
+    strncat(f->filename,filename,n);
+    strcat(f->filename,".mcpl");
+  } else {
+    f->filename = (char*)malloc(n+4);
+    f->filename[0] = '\0';
+    strncat(f->filename,filename,n);
+  }
+  if (gzip)
+    strcat(f->filename,".gz");
+
+  f->hdr_srcprogname = 0;
+  f->ncomments = 0;
+  f->comments = 0;
+  f->nblobs = 0;
+  f->blobkeys = 0;
+  f->bloblengths = 0;
+  f->blobs = 0;
+  f->opt_userflags = 0;
+  f->opt_polarisation = 0;
+  f->opt_singleprec = 1;
+  f->opt_universalpdgcode = 0;
+  f->opt_universalweight = 0.0;
+  f->header_notwritten = 1;
+  f->nparticles = 0;
+  f->writebuf = 0;
+  f->writebuf_size = MCPLIMP_WRITEBUF_DEFAULT_SIZE;
+  f->writebuf_fill = 0;
+  f->writebuf_limit = 0;
+  f->role = MCPLIMP_ROLE_NORMAL;
+  f->ingest = 0;
+  f->slab = 0;
+  f->async = 0;
+  f->gz = 0;
+  f->direct = 0;
+  f->ckpt_interval = 0;
+  f->ckpt_seconds = 0.0;
+  f->ckpt_sync = 0;
+  f->ckpt_last = 0;
+  f->ckpt_next = UINT64_MAX;
+  f->file = fopen(f->filename,"wb");
+  if (!f->file)
+    mcpl_error("Unable to open output file!");
+#ifdef MCPL_HASZLIB
+  if (gzip)
+    f->gz = mcpl_internal_gzstream_create();
+#endif
+#ifdef MCPLIMP_HAS_IO_URING
+  if (!f->gz)
+    f->uring = mcpl_internal_uring_create(fileno(f->file),1);
+#endif
+
+  out.internal = f;
+  mcpl_recalc_psize(out);
+  return out;
+}
+
+mcpl_outfile_t mcpl_create_outfile(const char * filename)
+{
+  return mcpl_internal_create_outfile(filename,0);
+}
+
+const char * mcpl_outfile_filename(mcpl_outfile_t of) {
+  MCPLIMP_OUTFILEDECODE;
+  return f->filename;
+}
+
+void mcpl_hdr_set_srcname(mcpl_outfile_t of,const char * spn)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (!f->header_notwritten)
+    mcpl_error("mcpl_hdr_set_srcname called too late.");
+  mcpl_internal_hdrlock_lock(f->hdrlock);
+  mcpl_store_string(&(f->hdr_srcprogname),spn);
+  mcpl_internal_hdrlock_unlock(f->hdrlock);
+}
+
+void mcpl_hdr_add_comment(mcpl_outfile_t of,const char *comment)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (!f->header_notwritten)
+    mcpl_error("mcpl_hdr_add_comment called too late.");
+  mcpl_internal_hdrlock_lock(f->hdrlock);
   size_t oldn = f->ncomments;
   f->ncomments += 1;
   if (oldn)
@@ -333,14 +1284,18 @@ void mcpl_hdr_add_comment(mcpl_outfile_t of,const char *comment)
     f->comments = (char **)calloc(f->ncomments,sizeof(char*));
   f->comments[oldn] = 0;
   mcpl_store_string(&(f->comments[oldn]),comment);
+  mcpl_internal_hdrlock_unlock(f->hdrlock);
 }
 
-void mcpl_hdr_add_data(mcpl_outfile_t of, const char * key,
-                       uint32_t ldata, const char * data)
+void mcpl_internal_hdr_add_data_owned(mcpl_outfile_t of, const char * key,
+                                      uint32_t ldata, char * data)
 {
+  //As mcpl_hdr_add_data, but taking ownership of the malloc'ed data instead of
+  //copying it:
   MCPLIMP_OUTFILEDECODE;
   if (!f->header_notwritten)
     mcpl_error("mcpl_hdr_add_data called too late.");
+  mcpl_internal_hdrlock_lock(f->hdrlock);
   size_t oldn = f->nblobs;
   f->nblobs += 1;
   //Check that key is unique
@@ -368,8 +1323,18 @@ void mcpl_hdr_add_data(mcpl_outfile_t of, const char * key,
     f->blobs = (char **)realloc(f->blobs,f->nblobs * sizeof(char*) );
   else
     f->blobs = (char **)calloc(f->nblobs,sizeof(char*));
-  f->blobs[oldn] = (char *)malloc(ldata);
-  memcpy(f->blobs[oldn],data,ldata);
+  f->blobs[oldn] = data;
+  mcpl_internal_hdrlock_unlock(f->hdrlock);
+}
+
+void mcpl_hdr_add_data(mcpl_outfile_t of, const char * key,
+                       uint32_t ldata, const char * data)
+{
+  char * copy = (char *)malloc(ldata);
+  if (ldata && !copy)
+    mcpl_error("Unable to allocate memory for blob");
+  memcpy(copy,data,ldata);
+  mcpl_internal_hdr_add_data_owned(of,key,ldata,copy);
 }
 
 void mcpl_enable_userflags(mcpl_outfile_t of)
@@ -437,33 +1402,132 @@ void mcpl_enable_universal_weight(mcpl_outfile_t of, double w)
   mcpl_recalc_psize(of);
 }
 
+#ifdef MCPLIMP_HAS_DIRECT_IO
+//With mcpl_enable_bulk_write, the file is preallocated when the header is
+//written, and particle data is then written with O_DIRECT (bypassing the page
+//cache) through a separate file descriptor, in chunks of the write buffer which
+//are aligned in both memory and file. Data which can not be written like that
+//(the unaligned first chunk after the header, and the unaligned beginnings of
+//chunks after the write buffer was flushed early, and partial blocks at their
+//ends) is written with normal I/O. The preallocation does not change the file
+//size, so at any time the file only contains particle data actually written:
+typedef struct mcpl_internal_direct {
+  uint64_t nexpected;
+  uint64_t pos;//file position of next particle data
+  int fd;//opened with O_DIRECT (-1 when not available, to use normal I/O)
+} mcpl_internal_direct_t;
+
+void mcpl_internal_direct_start(mcpl_outfileinternal_t * f)
+{
+  //Called once the header has been written:
+  mcpl_internal_direct_t * d = f->direct;
+  int64_t pos = ftell(f->file);
+  if ( pos < 0 || fflush(f->file) )
+    mcpl_error("Errors encountered while attempting to write file header.");
+  d->pos = pos;
+  //Reserve space for all particles up front (errors are not fatal, e.g. file
+  //systems without fallocate support simply get no preallocation):
+  int fd = fileno(f->file);
+  uint64_t nbytes = d->pos + d->nexpected * f->particle_size;
+  (void)syscall(SYS_fallocate, fd, MCPLIMP_FALLOC_KEEP_SIZE, (off_t)0, (off_t)nbytes);
+  d->fd = open(f->filename, O_WRONLY | MCPLIMP_O_DIRECT);
+}
+
+int mcpl_internal_direct_write(mcpl_outfileinternal_t * f, const char * buf, uint64_t nbytes)
+{
+  //Returns 0 in case of errors:
+  mcpl_internal_direct_t * d = f->direct;
+  const uint64_t a = MCPLIMP_WRITEBUF_ALIGNMENT;
+  uint64_t nalign = 0;
+  if ( d->fd >= 0 && d->pos % a == 0 && (uintptr_t)buf % a == 0 ) {
+    nalign = nbytes - nbytes % a;
+    if ( nalign && mcpl_internal_pwrite(d->fd, buf, nalign, d->pos) != nalign ) {
+      if (errno != EINVAL)
+        return 0;
+      //Alignment requirements of the file system are stricter than assumed,
+      //continue with normal I/O:
+      close(d->fd);
+      d->fd = -1;
+      nalign = 0;
+    }
+  }
+  uint64_t ntail = nbytes - nalign;
+  if ( ntail && mcpl_internal_pwrite(fileno(f->file), buf + nbytes - ntail, ntail, d->pos + nbytes - ntail) != ntail )
+    return 0;
+  d->pos += nbytes;
+  return 1;
+}
+
+void mcpl_internal_direct_stop(mcpl_outfileinternal_t * f)
+{
+  //Release any unused preallocated space beyond the end of the file:
+  mcpl_internal_direct_t * d = f->direct;
+  if (d->fd >= 0)
+    close(d->fd);
+  if (ftruncate(fileno(f->file), (off_t)d->pos) != 0)
+    mcpl_error("Errors encountered while attempting to write particle data.");
+  free(d);
+  f->direct = 0;
+}
+#else
+typedef struct mcpl_internal_direct mcpl_internal_direct_t;
+#endif
+
+void mcpl_write_header_data(mcpl_outfileinternal_t * f, const void * data, size_t n, const char * errmsg)
+{
+#ifdef MCPL_HASZLIB
+  if (f->gz) {
+    if (!mcpl_internal_gzstream_write(f->gz, f->file, (const char*)data, n, 0))
+      mcpl_error(errmsg);
+    return;
+  }
+#endif
+  size_t nb = fwrite(data, 1, n, f->file);
+  if (nb!=n)
+    mcpl_error(errmsg);
+}
+void mcpl_write_buffer(mcpl_outfileinternal_t * f, uint32_t n, const char * data, const char * errmsg)
+{
+  mcpl_write_header_data(f, &n, sizeof(n), errmsg);
+  mcpl_write_header_data(f, data, n, errmsg);
+}
+void mcpl_write_string(mcpl_outfileinternal_t * f, const char * str, const char * errmsg)
+{
+  size_t n = strlen(str);
+  mcpl_write_buffer(f,n,str,errmsg);//nb: we don't write the terminating null-char
+}
+
 void mcpl_write_header(mcpl_outfileinternal_t * f)
 {
   if (!f->header_notwritten)
     mcpl_error("Logical error!");
 
   const char * errmsg="Errors encountered while attempting to write file header.";
-  //Always start the file with an unsigned char-array (for endian agnosticity)
-  //containing magic word (MCPL), file format version ('001'-'999') and
-  //endianness used in the file ('L' or 'B'):
-  unsigned char start[8] = {'M','C','P','L','0','0','0','L'};
-  start[4] = (MCPL_FORMATVERSION/100)%10 + '0';
-  start[5] = (MCPL_FORMATVERSION/10)%10 + '0';
-  start[6] = MCPL_FORMATVERSION%10 + '0';
-  if (!mcpl_platform_is_little_endian())
-    start[7] = 'B';
-  size_t nb = fwrite(start, 1, sizeof(start), f->file);
-  if (nb!=sizeof(start))
-    mcpl_error(errmsg);
+#ifdef MCPL_HASZLIB
+  if (f->gz) {
+    //The first 16 bytes go into their own gzip member (see above):
+    mcpl_internal_gzstream_write_prefix(f->file, f->nparticles);
+  } else
+#endif
+  {
+    //Always start the file with an unsigned char-array (for endian
+    //agnosticity) containing magic word, format version and endianness:
+    unsigned char start[8];
+    mcpl_internal_file_signature(start);
+    size_t nb = fwrite(start, 1, sizeof(start), f->file);
+    if (nb!=sizeof(start))
+      mcpl_error(errmsg);
 
-  //Right after the initial 8 bytes, we put the number of particles (0 for now,
-  //but important that position is fixed so we can seek and update it later).:
-  long int nparticles_pos = ftell(f->file);
-  if (nparticles_pos!=MCPLIMP_NPARTICLES_POS)
-    mcpl_error(errmsg);
-  nb = fwrite(&f->nparticles, 1, sizeof(f->nparticles), f->file);
-  if (nb!=sizeof(f->nparticles))
-    mcpl_error(errmsg);
+    //Right after the initial 8 bytes, we put the number of particles (0 for
+    //now, but important that position is fixed so we can seek and update it
+    //later).:
+    long int nparticles_pos = ftell(f->file);
+    if (nparticles_pos!=MCPLIMP_NPARTICLES_POS)
+      mcpl_error(errmsg);
+    nb = fwrite(&f->nparticles, 1, sizeof(f->nparticles), f->file);
+    if (nb!=sizeof(f->nparticles))
+      mcpl_error(errmsg);
+  }
 
   //Then a bunch of numbers:
   uint32_t arr[8];
@@ -476,30 +1540,26 @@ void mcpl_write_header(mcpl_outfileinternal_t * f)
   arr[6] = f->particle_size;
   arr[7] = (f->opt_universalweight?1:0);
   assert(sizeof(arr)==32);
-  nb = fwrite(arr, 1, sizeof(arr), f->file);
-  if (nb!=sizeof(arr))
-    mcpl_error(errmsg);
+  mcpl_write_header_data(f, arr, sizeof(arr), errmsg);
 
   if (f->opt_universalweight) {
     assert(sizeof(f->opt_universalweight)==8);
-    nb = fwrite((void*)(&(f->opt_universalweight)), 1, sizeof(f->opt_universalweight), f->file);
-    if (nb!=sizeof(f->opt_universalweight))
-      mcpl_error(errmsg);
+    mcpl_write_header_data(f, &(f->opt_universalweight), sizeof(f->opt_universalweight), errmsg);
   }
 
   //strings:
-  mcpl_write_string(f->file,f->hdr_srcprogname?f->hdr_srcprogname:"unknown",errmsg);
+  mcpl_write_string(f,f->hdr_srcprogname?f->hdr_srcprogname:"unknown",errmsg);
   uint32_t i;
   for (i = 0; i < f->ncomments; ++i)
-    mcpl_write_string(f->file,f->comments[i],errmsg);
+    mcpl_write_string(f,f->comments[i],errmsg);
 
   //blob keys:
   for (i = 0; i < f->nblobs; ++i)
-    mcpl_write_string(f->file,f->blobkeys[i],errmsg);
+    mcpl_write_string(f,f->blobkeys[i],errmsg);
 
   //blobs:
   for (i = 0; i < f->nblobs; ++i)
-    mcpl_write_buffer(f->file, f->bloblengths[i], f->blobs[i],errmsg);
+    mcpl_write_buffer(f, f->bloblengths[i], f->blobs[i],errmsg);
 
   //Free up acquired memory only needed for header writing:
   free(f->hdr_srcprogname);
@@ -525,6 +1585,21 @@ void mcpl_write_header(mcpl_outfileinternal_t * f)
     f->nblobs = 0;
   }
   f->header_notwritten = 0;
+
+#ifdef MCPLIMP_HAS_IO_URING
+  if (f->uring) {
+    //Particle data will be written directly to the file descriptor, after the
+    //header:
+    int64_t pos = ftell(f->file);
+    if ( pos < 0 || fflush(f->file) )
+      mcpl_error(errmsg);
+    f->uring->offset = pos;
+  }
+#endif
+#ifdef MCPLIMP_HAS_DIRECT_IO
+  if (f->direct)
+    mcpl_internal_direct_start(f);
+#endif
 }
 
 #ifndef INFINITY
@@ -532,6 +1607,16 @@ void mcpl_write_header(mcpl_outfileinternal_t * f)
 #  define  INFINITY (__builtin_inf())
 #endif
 
+//Floating point contraction (e.g. into fused multiply-add instructions) is
+//disabled for the code packing and unpacking unit vectors, to ensure that the
+//scalar and vectorised versions always produce bit-identical results:
+#if defined(__clang__)
+#  pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#  pragma GCC push_options
+#  pragma GCC optimize ("fp-contract=off")
+#endif
+
 void mcpl_unitvect_pack_adaptproj(const double* in, double* out) {
 
   //Precise packing of unit vector into 2 floats + 1 bit using the "Adaptive
@@ -633,6 +1718,334 @@ void mcpl_unitvect_unpack_oct(const double* in, double* out) {
   out[0] *= n; out[1] *= n; out[2] *= n;
 }
 
+//Batch versions of the adaptive projection packing and unpacking, which
+//process arrays of n unit vectors (and ekin values) at a time and in a manner
+//which allows vectorisation. The third packed component holds sign*ekin (see
+//mcpl_internal_serialise_particle_to_buffer). Results are bit-identical to
+//those of mcpl_unitvect_pack_adaptproj and mcpl_unitvect_unpack_adaptproj.
+
+void mcpl_internal_unpack_adaptproj_batch_scalar( uint64_t n,
+                                                  const double* in0, const double* in1,
+                                                  const double* in2, double* ekin,
+                                                  double* ux, double* uy, double* uz )
+{
+  double in[3], out[3];
+  uint64_t i;
+  for (i = 0; i < n; ++i) {
+    in[0] = in0[i]; in[1] = in1[i];
+    ekin[i] = fabs(in2[i]);
+    in[2] = copysign(1.0,in2[i]);
+    mcpl_unitvect_unpack_adaptproj(in,out);
+    ux[i] = out[0]; uy[i] = out[1]; uz[i] = out[2];
+  }
+}
+
+void mcpl_internal_pack_adaptproj_batch_scalar( uint64_t n,
+                                                const double* ux, const double* uy,
+                                                const double* uz, const double* ekin,
+                                                double* out0, double* out1, double* out2 )
+{
+  double in[3], out[3];
+  uint64_t i;
+  for (i = 0; i < n; ++i) {
+    in[0] = ux[i]; in[1] = uy[i]; in[2] = uz[i];
+    mcpl_unitvect_pack_adaptproj(in,out);
+    out0[i] = out[0]; out1[i] = out[1];
+    out2[i] = copysign(ekin[i],out[2]);
+  }
+}
+
+#ifdef MCPLIMP_X86_SIMD
+
+//The vectorised kernels avoid branches by always computing the one division
+//and one square root needed, and then selecting the appropriate result per
+//lane. For unpacking, with a=in0, b=in1 and s=sign(in2):
+//
+//   |a|>1       : inv=1/a, r=s*sqrt(max(0,1-(b*b+inv*inv))), u=( r , b , inv)
+//   |b|>1       : inv=1/b, r=s*sqrt(max(0,1-(a*a+inv*inv))), u=( a , r , inv)
+//   otherwise   :          r=s*sqrt(max(0,1-(a*a+b*b)))    , u=( a , b , r  )
+//
+//Comparisons and max operations are ordered so that NaN inputs are treated
+//exactly like in the scalar code (comparisons false, fmax ignoring NaN).
+
+__attribute__((target("sse4.1")))
+void mcpl_internal_unpack_adaptproj_batch_sse41( uint64_t n,
+                                                 const double* in0, const double* in1,
+                                                 const double* in2, double* ekin,
+                                                 double* ux, double* uy, double* uz )
+{
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d signmask = _mm_set1_pd(-0.0);
+  uint64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d a = _mm_loadu_pd(in0+i);
+    __m128d b = _mm_loadu_pd(in1+i);
+    __m128d c = _mm_loadu_pd(in2+i);
+    __m128d sgn = _mm_or_pd(_mm_and_pd(c,signmask),one);
+    __m128d ma = _mm_cmpgt_pd(_mm_andnot_pd(signmask,a),one);
+    __m128d mb = _mm_andnot_pd(ma,_mm_cmpgt_pd(_mm_andnot_pd(signmask,b),one));
+    __m128d mab = _mm_or_pd(ma,mb);
+    __m128d inv = _mm_div_pd(one,_mm_blendv_pd(b,a,ma));
+    __m128d p = _mm_blendv_pd(a,b,ma);
+    __m128d q = _mm_blendv_pd(b,inv,mab);
+    __m128d r = _mm_sub_pd(one,_mm_add_pd(_mm_mul_pd(p,p),_mm_mul_pd(q,q)));
+    r = _mm_mul_pd(sgn,_mm_sqrt_pd(_mm_max_pd(r,zero)));
+    _mm_storeu_pd(ekin+i,_mm_andnot_pd(signmask,c));
+    _mm_storeu_pd(ux+i,_mm_blendv_pd(a,r,ma));
+    _mm_storeu_pd(uy+i,_mm_blendv_pd(b,r,mb));
+    _mm_storeu_pd(uz+i,_mm_blendv_pd(r,inv,mab));
+  }
+  if (i<n)
+    mcpl_internal_unpack_adaptproj_batch_scalar(n-i,in0+i,in1+i,in2+i,ekin+i,ux+i,uy+i,uz+i);
+}
+
+__attribute__((target("avx2")))
+void mcpl_internal_unpack_adaptproj_batch_avx2( uint64_t n,
+                                                const double* in0, const double* in1,
+                                                const double* in2, double* ekin,
+                                                double* ux, double* uy, double* uz )
+{
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d signmask = _mm256_set1_pd(-0.0);
+  uint64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_loadu_pd(in0+i);
+    __m256d b = _mm256_loadu_pd(in1+i);
+    __m256d c = _mm256_loadu_pd(in2+i);
+    __m256d sgn = _mm256_or_pd(_mm256_and_pd(c,signmask),one);
+    __m256d ma = _mm256_cmp_pd(_mm256_andnot_pd(signmask,a),one,_CMP_GT_OQ);
+    __m256d mb = _mm256_andnot_pd(ma,_mm256_cmp_pd(_mm256_andnot_pd(signmask,b),one,_CMP_GT_OQ));
+    __m256d mab = _mm256_or_pd(ma,mb);
+    __m256d inv = _mm256_div_pd(one,_mm256_blendv_pd(b,a,ma));
+    __m256d p = _mm256_blendv_pd(a,b,ma);
+    __m256d q = _mm256_blendv_pd(b,inv,mab);
+    __m256d r = _mm256_sub_pd(one,_mm256_add_pd(_mm256_mul_pd(p,p),_mm256_mul_pd(q,q)));
+    r = _mm256_mul_pd(sgn,_mm256_sqrt_pd(_mm256_max_pd(r,zero)));
+    _mm256_storeu_pd(ekin+i,_mm256_andnot_pd(signmask,c));
+    _mm256_storeu_pd(ux+i,_mm256_blendv_pd(a,r,ma));
+    _mm256_storeu_pd(uy+i,_mm256_blendv_pd(b,r,mb));
+    _mm256_storeu_pd(uz+i,_mm256_blendv_pd(r,inv,mab));
+  }
+  if (i<n)
+    mcpl_internal_unpack_adaptproj_batch_sse41(n-i,in0+i,in1+i,in2+i,ekin+i,ux+i,uy+i,uz+i);
+}
+
+__attribute__((target("avx512f")))
+void mcpl_internal_unpack_adaptproj_batch_avx512( uint64_t n,
+                                                  const double* in0, const double* in1,
+                                                  const double* in2, double* ekin,
+                                                  double* ux, double* uy, double* uz )
+{
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512i signbits = _mm512_set1_epi64((long long)0x8000000000000000ULL);
+  uint64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512d a = _mm512_loadu_pd(in0+i);
+    __m512d b = _mm512_loadu_pd(in1+i);
+    __m512d c = _mm512_loadu_pd(in2+i);
+    __m512d sgn = _mm512_castsi512_pd(_mm512_or_si512(_mm512_and_si512(_mm512_castpd_si512(c),signbits),
+                                                      _mm512_castpd_si512(one)));
+    __mmask8 ma = _mm512_cmp_pd_mask(_mm512_abs_pd(a),one,_CMP_GT_OQ);
+    __mmask8 mb = (__mmask8)(~ma & _mm512_cmp_pd_mask(_mm512_abs_pd(b),one,_CMP_GT_OQ));
+    __mmask8 mab = (__mmask8)(ma | mb);
+    __m512d inv = _mm512_div_pd(one,_mm512_mask_blend_pd(ma,b,a));
+    __m512d p = _mm512_mask_blend_pd(ma,a,b);
+    __m512d q = _mm512_mask_blend_pd(mab,b,inv);
+    __m512d r = _mm512_sub_pd(one,_mm512_add_pd(_mm512_mul_pd(p,p),_mm512_mul_pd(q,q)));
+    r = _mm512_mul_pd(sgn,_mm512_sqrt_pd(_mm512_max_pd(r,zero)));
+    _mm512_storeu_pd(ekin+i,_mm512_abs_pd(c));
+    _mm512_storeu_pd(ux+i,_mm512_mask_blend_pd(ma,a,r));
+    _mm512_storeu_pd(uy+i,_mm512_mask_blend_pd(mb,b,r));
+    _mm512_storeu_pd(uz+i,_mm512_mask_blend_pd(mab,r,inv));
+  }
+  if (i<n)
+    mcpl_internal_unpack_adaptproj_batch_avx2(n-i,in0+i,in1+i,in2+i,ekin+i,ux+i,uy+i,uz+i);
+}
+
+//For packing, with m=fmax(|x|,|y|) the scalar code selects:
+//
+//   |z|<m and |x|>=|y| : (1/z, y, sign(x))
+//   |z|<m and |x|<|y|  : (x, 1/z, sign(y))
+//   otherwise          : (x, y, sign(z))
+//
+//where 1/z is replaced by +infinity when z is zero (of either sign).
+
+__attribute__((target("sse4.1")))
+void mcpl_internal_pack_adaptproj_batch_sse41( uint64_t n,
+                                               const double* ux, const double* uy,
+                                               const double* uz, const double* ekin,
+                                               double* out0, double* out1, double* out2 )
+{
+  const __m128d one = _mm_set1_pd(1.0);
+  const __m128d zero = _mm_setzero_pd();
+  const __m128d inf = _mm_set1_pd(INFINITY);
+  const __m128d signmask = _mm_set1_pd(-0.0);
+  uint64_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d x = _mm_loadu_pd(ux+i);
+    __m128d y = _mm_loadu_pd(uy+i);
+    __m128d z = _mm_loadu_pd(uz+i);
+    __m128d absx = _mm_andnot_pd(signmask,x);
+    __m128d absy = _mm_andnot_pd(signmask,y);
+    __m128d m = _mm_blendv_pd(_mm_max_pd(absx,absy),absx,_mm_cmpunord_pd(absy,absy));
+    __m128d proj = _mm_cmplt_pd(_mm_andnot_pd(signmask,z),m);
+    __m128d xge = _mm_cmpge_pd(absx,absy);
+    __m128d invz = _mm_blendv_pd(inf,_mm_div_pd(one,z),_mm_cmpneq_pd(z,zero));
+    __m128d projx = _mm_and_pd(proj,xge);
+    __m128d projy = _mm_andnot_pd(xge,proj);
+    __m128d signsrc = _mm_blendv_pd(_mm_blendv_pd(z,x,projx),y,projy);
+    _mm_storeu_pd(out0+i,_mm_blendv_pd(x,invz,projx));
+    _mm_storeu_pd(out1+i,_mm_blendv_pd(y,invz,projy));
+    _mm_storeu_pd(out2+i,_mm_or_pd(_mm_andnot_pd(signmask,_mm_loadu_pd(ekin+i)),
+                                   _mm_and_pd(signmask,signsrc)));
+  }
+  if (i<n)
+    mcpl_internal_pack_adaptproj_batch_scalar(n-i,ux+i,uy+i,uz+i,ekin+i,out0+i,out1+i,out2+i);
+}
+
+__attribute__((target("avx2")))
+void mcpl_internal_pack_adaptproj_batch_avx2( uint64_t n,
+                                              const double* ux, const double* uy,
+                                              const double* uz, const double* ekin,
+                                              double* out0, double* out1, double* out2 )
+{
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d inf = _mm256_set1_pd(INFINITY);
+  const __m256d signmask = _mm256_set1_pd(-0.0);
+  uint64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(ux+i);
+    __m256d y = _mm256_loadu_pd(uy+i);
+    __m256d z = _mm256_loadu_pd(uz+i);
+    __m256d absx = _mm256_andnot_pd(signmask,x);
+    __m256d absy = _mm256_andnot_pd(signmask,y);
+    __m256d m = _mm256_blendv_pd(_mm256_max_pd(absx,absy),absx,_mm256_cmp_pd(absy,absy,_CMP_UNORD_Q));
+    __m256d proj = _mm256_cmp_pd(_mm256_andnot_pd(signmask,z),m,_CMP_LT_OQ);
+    __m256d xge = _mm256_cmp_pd(absx,absy,_CMP_GE_OQ);
+    __m256d invz = _mm256_blendv_pd(inf,_mm256_div_pd(one,z),_mm256_cmp_pd(z,zero,_CMP_NEQ_UQ));
+    __m256d projx = _mm256_and_pd(proj,xge);
+    __m256d projy = _mm256_andnot_pd(xge,proj);
+    __m256d signsrc = _mm256_blendv_pd(_mm256_blendv_pd(z,x,projx),y,projy);
+    _mm256_storeu_pd(out0+i,_mm256_blendv_pd(x,invz,projx));
+    _mm256_storeu_pd(out1+i,_mm256_blendv_pd(y,invz,projy));
+    _mm256_storeu_pd(out2+i,_mm256_or_pd(_mm256_andnot_pd(signmask,_mm256_loadu_pd(ekin+i)),
+                                         _mm256_and_pd(signmask,signsrc)));
+  }
+  if (i<n)
+    mcpl_internal_pack_adaptproj_batch_sse41(n-i,ux+i,uy+i,uz+i,ekin+i,out0+i,out1+i,out2+i);
+}
+
+__attribute__((target("avx512f")))
+void mcpl_internal_pack_adaptproj_batch_avx512( uint64_t n,
+                                                const double* ux, const double* uy,
+                                                const double* uz, const double* ekin,
+                                                double* out0, double* out1, double* out2 )
+{
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d inf = _mm512_set1_pd(INFINITY);
+  const __m512i signbits = _mm512_set1_epi64((long long)0x8000000000000000ULL);
+  uint64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512d x = _mm512_loadu_pd(ux+i);
+    __m512d y = _mm512_loadu_pd(uy+i);
+    __m512d z = _mm512_loadu_pd(uz+i);
+    __m512d absx = _mm512_abs_pd(x);
+    __m512d absy = _mm512_abs_pd(y);
+    __m512d m = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(absy,absy,_CMP_UNORD_Q),_mm512_max_pd(absx,absy),absx);
+    __mmask8 proj = _mm512_cmp_pd_mask(_mm512_abs_pd(z),m,_CMP_LT_OQ);
+    __mmask8 xge = _mm512_cmp_pd_mask(absx,absy,_CMP_GE_OQ);
+    __m512d invz = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(z,zero,_CMP_NEQ_UQ),inf,_mm512_div_pd(one,z));
+    __mmask8 projx = (__mmask8)(proj & xge);
+    __mmask8 projy = (__mmask8)(proj & ~xge);
+    __m512d signsrc = _mm512_mask_blend_pd(projy,_mm512_mask_blend_pd(projx,z,x),y);
+    _mm512_storeu_pd(out0+i,_mm512_mask_blend_pd(projx,x,invz));
+    _mm512_storeu_pd(out1+i,_mm512_mask_blend_pd(projy,y,invz));
+    __m512i e = _mm512_castpd_si512(_mm512_abs_pd(_mm512_loadu_pd(ekin+i)));
+    _mm512_storeu_pd(out2+i,_mm512_castsi512_pd(_mm512_or_si512(e,_mm512_and_si512(signbits,_mm512_castpd_si512(signsrc)))));
+  }
+  if (i<n)
+    mcpl_internal_pack_adaptproj_batch_avx2(n-i,ux+i,uy+i,uz+i,ekin+i,out0+i,out1+i,out2+i);
+}
+
+#endif
+
+typedef void (*mcpl_internal_unpack_batch_fct_t)( uint64_t, const double*, const double*,
+                                                  const double*, double*, double*,
+                                                  double*, double* );
+typedef void (*mcpl_internal_pack_batch_fct_t)( uint64_t, const double*, const double*,
+                                                const double*, const double*, double*,
+                                                double*, double* );
+
+static mcpl_internal_unpack_batch_fct_t mcpl_internal_unpack_batch_fct = 0;
+static mcpl_internal_pack_batch_fct_t mcpl_internal_pack_batch_fct = 0;
+
+void mcpl_internal_select_batch_kernels(void)
+{
+  //Select best kernels supported by the current CPU (at runtime):
+  mcpl_internal_unpack_batch_fct_t fu = &mcpl_internal_unpack_adaptproj_batch_scalar;
+  mcpl_internal_pack_batch_fct_t fp = &mcpl_internal_pack_adaptproj_batch_scalar;
+#ifdef MCPLIMP_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    fu = &mcpl_internal_unpack_adaptproj_batch_avx512;
+    fp = &mcpl_internal_pack_adaptproj_batch_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    fu = &mcpl_internal_unpack_adaptproj_batch_avx2;
+    fp = &mcpl_internal_pack_adaptproj_batch_avx2;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    fu = &mcpl_internal_unpack_adaptproj_batch_sse41;
+    fp = &mcpl_internal_pack_adaptproj_batch_sse41;
+  }
+#endif
+  mcpl_internal_pack_batch_fct = fp;
+  mcpl_internal_unpack_batch_fct = fu;
+}
+
+#ifdef MCPLIMP_HAS_THREADS
+static pthread_once_t mcpl_internal_batch_kernels_once = PTHREAD_ONCE_INIT;
+#endif
+
+void mcpl_internal_init_batch_kernels(void)
+{
+  //The kernels are selected exactly once, also when first needed by several
+  //threads at the same time (shared file cursors, producers, ...):
+#ifdef MCPLIMP_HAS_THREADS
+  pthread_once(&mcpl_internal_batch_kernels_once, mcpl_internal_select_batch_kernels);
+#else
+  if (!mcpl_internal_pack_batch_fct)
+    mcpl_internal_select_batch_kernels();
+#endif
+}
+
+void mcpl_internal_unpack_adaptproj_batch( uint64_t n,
+                                           const double* in0, const double* in1,
+                                           const double* in2, double* ekin,
+                                           double* ux, double* uy, double* uz )
+{
+  mcpl_internal_init_batch_kernels();
+  mcpl_internal_unpack_batch_fct(n,in0,in1,in2,ekin,ux,uy,uz);
+}
+
+void mcpl_internal_pack_adaptproj_batch( uint64_t n,
+                                         const double* ux, const double* uy,
+                                         const double* uz, const double* ekin,
+                                         double* out0, double* out1, double* out2 )
+{
+  mcpl_internal_init_batch_kernels();
+  mcpl_internal_pack_batch_fct(n,ux,uy,uz,ekin,out0,out1,out2);
+}
+
+#if defined(__clang__)
+#  pragma STDC FP_CONTRACT DEFAULT
+#elif defined(__GNUC__)
+#  pragma GCC pop_options
+#endif
+
 void mcpl_internal_serialise_particle_to_buffer( const mcpl_particle_t* particle,
                                                  mcpl_outfileinternal_t * f ) {
 
@@ -656,220 +2069,1414 @@ void mcpl_internal_serialise_particle_to_buffer( const mcpl_particle_t* particle
   //to be sure the signbit is set also if ekin=0:
   pack_ekindir[2] = copysign(particle->ekin,pack_ekindir[2]);
 
-  //serialise particle object to buffer:
+  //serialise particle object to buffer:
+  f->pack_fields(particle,pack_ekindir,f->particle_buffer);
+}
+
+int mcpl_internal_write_data(mcpl_outfileinternal_t * f, const char * buf, uint64_t nbytes ) {
+  //Returns 0 in case of errors:
+#ifdef MCPL_HASZLIB
+  if (f->gz)
+    return mcpl_internal_gzstream_write(f->gz, f->file, buf, nbytes, 0);
+#endif
+#ifdef MCPLIMP_HAS_DIRECT_IO
+  if (f->direct)
+    return mcpl_internal_direct_write(f, buf, nbytes);
+#endif
+  return fwrite(buf, 1, nbytes, f->file) == nbytes;
+}
+
+void mcpl_internal_write_to_file(mcpl_outfileinternal_t * f, const char * buf, uint64_t nbytes ) {
+  if (!mcpl_internal_write_data(f, buf, nbytes))
+    mcpl_error("Errors encountered while attempting to write particle data.");
+}
+
+#ifdef MCPLIMP_HAS_THREADS
+//With MCPL_CREATE_ASYNC, full write buffers are handed to a background thread
+//which writes them to the file, while the caller continues in the next of a
+//fixed number of buffers (waiting if that is still being written). The file
+//handle (and any compression or O_DIRECT state) belongs to the background
+//thread while it runs, and write errors are reported on the next hand-over or
+//when the file is closed:
+typedef struct mcpl_internal_async {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  mcpl_outfileinternal_t * f;
+  char * bufs[MCPLIMP_ASYNC_NBUFFERS];//idle or pending buffers (null if owned by the caller)
+  uint64_t nbytes[MCPLIMP_ASYNC_NBUFFERS];
+  unsigned current;//buffer currently filled by the caller
+  unsigned next;//next buffer to be written by the background thread
+  unsigned npending;
+  uint64_t pos;//file position at which the caller's current buffer will be written (0: not yet known)
+  int error;
+  int quit;
+} mcpl_internal_async_t;
+
+void * mcpl_internal_async_thread(void * arg)
+{
+  mcpl_internal_async_t * a = (mcpl_internal_async_t*)arg;
+  pthread_mutex_lock(&a->mutex);
+  while (1) {
+    while (!a->npending && !a->quit)
+      pthread_cond_wait(&a->cond, &a->mutex);
+    if (!a->npending)
+      break;
+    unsigned i = a->next;
+    pthread_mutex_unlock(&a->mutex);
+    int ok = mcpl_internal_write_data(a->f, a->bufs[i], a->nbytes[i]);
+    pthread_mutex_lock(&a->mutex);
+    if (!ok)
+      a->error = 1;
+    a->next = ( i + 1 ) % MCPLIMP_ASYNC_NBUFFERS;
+    --a->npending;
+    pthread_cond_broadcast(&a->cond);
+  }
+  pthread_mutex_unlock(&a->mutex);
+  return 0;
+}
+
+void mcpl_internal_async_start(mcpl_outfileinternal_t * f)
+{
+  mcpl_internal_async_t * a = (mcpl_internal_async_t*)calloc(sizeof(mcpl_internal_async_t),1);
+  if (!a)
+    return;
+  a->f = f;
+  pthread_mutex_init(&a->mutex, 0);
+  pthread_cond_init(&a->cond, 0);
+  if (pthread_create(&a->thread, 0, mcpl_internal_async_thread, a) != 0) {
+    //Not fatal, simply keep writing synchronously:
+    pthread_cond_destroy(&a->cond);
+    pthread_mutex_destroy(&a->mutex);
+    free(a);
+    return;
+  }
+  f->async = a;
+}
+
+void mcpl_internal_async_submit(mcpl_outfileinternal_t * f)
+{
+  //Hand over the write buffer, and continue with the next one:
+  mcpl_internal_async_t * a = f->async;
+  pthread_mutex_lock(&a->mutex);
+  if (a->error) {
+    pthread_mutex_unlock(&a->mutex);
+    mcpl_error("Errors encountered while attempting to write particle data (in background thread).");
+  }
+  if (!a->pos) {
+    int64_t pos = ftell(f->file);
+    if (pos < 0) {
+      pthread_mutex_unlock(&a->mutex);
+      mcpl_error("Errors encountered while attempting to write particle data.");
+    }
+    a->pos = pos;
+  }
+  unsigned i = a->current;
+  a->bufs[i] = f->writebuf;
+  a->nbytes[i] = f->writebuf_fill;
+  a->pos += f->writebuf_fill;
+  ++a->npending;
+  pthread_cond_broadcast(&a->cond);
+  i = a->current = ( i + 1 ) % MCPLIMP_ASYNC_NBUFFERS;
+  while ( a->npending && a->next == i )
+    pthread_cond_wait(&a->cond, &a->mutex);
+  f->writebuf = a->bufs[i];//(allocated on first use if still null)
+  a->bufs[i] = 0;
+  pthread_mutex_unlock(&a->mutex);
+  f->writebuf_fill = 0;
+}
+
+int mcpl_internal_async_drain(mcpl_outfileinternal_t * f)
+{
+  //Wait for all pending buffers to be written, and free them (but not the
+  //caller's current buffer). Returns 0 in case of write errors:
+  mcpl_internal_async_t * a = f->async;
+  pthread_mutex_lock(&a->mutex);
+  while (a->npending)
+    pthread_cond_wait(&a->cond, &a->mutex);
+  int ok = !a->error;
+  pthread_mutex_unlock(&a->mutex);
+  unsigned i;
+  for (i = 0; i < MCPLIMP_ASYNC_NBUFFERS; ++i) {
+    free(a->bufs[i]);
+    a->bufs[i] = 0;
+  }
+  return ok;
+}
+
+void mcpl_internal_async_stop(mcpl_outfileinternal_t * f)
+{
+  mcpl_internal_async_t * a = f->async;
+  int ok = mcpl_internal_async_drain(f);
+  pthread_mutex_lock(&a->mutex);
+  a->quit = 1;
+  pthread_cond_broadcast(&a->cond);
+  pthread_mutex_unlock(&a->mutex);
+  pthread_join(a->thread, 0);
+  pthread_cond_destroy(&a->cond);
+  pthread_mutex_destroy(&a->mutex);
+  free(a);
+  f->async = 0;
+  if (!ok)
+    mcpl_error("Errors encountered while attempting to write particle data (in background thread).");
+}
+#endif
+
+void mcpl_internal_flush_writebuf(mcpl_outfileinternal_t * f ) {
+  if (f->writebuf_fill) {
+#ifdef MCPLIMP_HAS_THREADS
+    if (f->async) {
+      mcpl_internal_async_submit(f);
+      return;
+    }
+#endif
+    mcpl_internal_write_to_file(f, f->writebuf, f->writebuf_fill);
+    f->writebuf_fill = 0;
+  }
+}
+
+void mcpl_internal_output_data(mcpl_outfileinternal_t * f, const char * buf, uint64_t nbytes ) {
+  //Write particle data following the header (which must already be written):
+#ifdef MCPLIMP_HAS_IO_URING
+  if (f->uring) {
+    //(the io_uring writer has its own buffering)
+    mcpl_internal_uring_write(f->uring, buf, nbytes);
+    return;
+  }
+#endif
+  //Collect data in the write buffer, to write it to the file in large chunks,
+  //which (except for the first one) starts at aligned positions in the file:
+  while (nbytes) {
+    if (!f->writebuf_fill) {
+      if (!f->writebuf) {
+#ifdef MCPLIMP_HAS_DIRECT_IO
+        //O_DIRECT requires aligned memory:
+        if ( f->direct && posix_memalign((void**)&f->writebuf, MCPLIMP_WRITEBUF_ALIGNMENT, f->writebuf_size) )
+          f->writebuf = 0;
+        if (!f->direct)
+#endif
+          f->writebuf = (char*)malloc(f->writebuf_size);
+        if (!f->writebuf)
+          mcpl_error("Unable to allocate write buffer");
+      }
+      int async = 0;
+#ifdef MCPLIMP_HAS_THREADS
+      async = f->async != 0;
+#endif
+      f->writebuf_limit = f->writebuf_size;
+      if ( f->writebuf_size > MCPLIMP_WRITEBUF_ALIGNMENT && !f->gz ) {
+        //(the file position is not available from the file handle once the
+        //background thread has started writing):
+        int64_t pos;
+#ifdef MCPLIMP_HAS_THREADS
+        if ( async && f->async->pos )
+          pos = (int64_t)f->async->pos;
+        else
+#endif
+#ifdef MCPLIMP_HAS_DIRECT_IO
+        if ( !async && f->direct )
+          pos = (int64_t)f->direct->pos;
+        else
+#endif
+          pos = ftell(f->file);
+        if (pos < 0)
+          mcpl_error("Errors encountered while attempting to write particle data.");
+        f->writebuf_limit -= pos % MCPLIMP_WRITEBUF_ALIGNMENT;
+      }
+      if ( nbytes >= f->writebuf_limit && !async && !f->direct ) {
+        //No need to copy a full chunk into the buffer:
+        mcpl_internal_write_to_file(f, buf, f->writebuf_limit);
+        buf += f->writebuf_limit;
+        nbytes -= f->writebuf_limit;
+        continue;
+      }
+    }
+    uint64_t ncopy = f->writebuf_limit - f->writebuf_fill;
+    if (ncopy > nbytes)
+      ncopy = nbytes;
+    memcpy(f->writebuf + f->writebuf_fill, buf, ncopy);
+    f->writebuf_fill += ncopy;
+    buf += ncopy;
+    nbytes -= ncopy;
+    if (f->writebuf_fill == f->writebuf_limit)
+      mcpl_internal_flush_writebuf(f);
+  }
+}
+
+void mcpl_update_nparticles(FILE* f, uint64_t n)
+{
+  //Seek and update nparticles at correct location in header:
+  const char * errmsg = "Errors encountered while attempting to update number of particles in file.";
+  int64_t savedpos = ftell(f);
+  if (savedpos<0)
+    mcpl_error(errmsg);
+  if (fseek( f, MCPLIMP_NPARTICLES_POS, SEEK_SET ))
+    mcpl_error(errmsg);
+  size_t nb = fwrite(&n, 1, sizeof(n), f);
+  if (nb != sizeof(n))
+    mcpl_error(errmsg);
+  if (fseek( f, savedpos, SEEK_SET ))
+    mcpl_error(errmsg);
+}
+
+void mcpl_internal_sync_file(mcpl_outfileinternal_t * f)
+{
+  if (fflush(f->file))
+    mcpl_error("Errors encountered while attempting to write particle data.");
+#if defined(__linux__)
+  if (fdatasync(fileno(f->file)))
+    mcpl_error("Errors encountered while attempting to write particle data.");
+#elif defined(MCPL_THIS_IS_UNIX)
+  if (fsync(fileno(f->file)))
+    mcpl_error("Errors encountered while attempting to write particle data.");
+#endif
+}
+
+void mcpl_internal_checkpoint(mcpl_outfileinternal_t * f)
+{
+  //Make sure that all particle data is in the file, then update nparticles in
+  //the header (optionally forcing data and header to storage in that order,
+  //so the count is consistent also in case of a system crash):
+  mcpl_internal_flush_writebuf(f);
+#ifdef MCPLIMP_HAS_THREADS
+  if ( f->async && !mcpl_internal_async_drain(f) )
+    mcpl_error("Errors encountered while attempting to write particle data (in background thread).");
+#endif
+#ifdef MCPLIMP_HAS_IO_URING
+  if (f->uring)
+    mcpl_internal_uring_flush(f->uring);
+#endif
+  if (f->ckpt_sync)
+    mcpl_internal_sync_file(f);
+  mcpl_update_nparticles(f->file,f->nparticles);
+  if (f->ckpt_sync)
+    mcpl_internal_sync_file(f);
+  f->ckpt_last = f->nparticles;
+  f->ckpt_time = time(0);
+}
+
+void mcpl_internal_checkpoint_check(mcpl_outfileinternal_t * f)
+{
+  //Called when nparticles reaches ckpt_next. The clock is only checked every
+  //MCPLIMP_CHECKPOINT_TIMECHECK_NPARTICLES particles, to keep the overhead
+  //per particle negligible:
+  int due = ( f->ckpt_interval && f->nparticles >= f->ckpt_last + f->ckpt_interval );
+  if ( !due && f->ckpt_seconds > 0.0 )
+    due = difftime(time(0), f->ckpt_time) >= f->ckpt_seconds;
+  if (due)
+    mcpl_internal_checkpoint(f);
+  f->ckpt_next = UINT64_MAX;
+  if (f->ckpt_interval)
+    f->ckpt_next = f->ckpt_last + f->ckpt_interval;
+  if ( f->ckpt_seconds > 0.0 && f->nparticles + MCPLIMP_CHECKPOINT_TIMECHECK_NPARTICLES < f->ckpt_next )
+    f->ckpt_next = f->nparticles + MCPLIMP_CHECKPOINT_TIMECHECK_NPARTICLES;
+}
+
+void mcpl_enable_checkpoints(mcpl_outfile_t of, uint64_t nparticles_interval,
+                             double seconds_interval, unsigned flags)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (flags & ~MCPL_CHECKPOINT_SYNC)
+    mcpl_error("mcpl_enable_checkpoints called with unsupported flags");
+  if ( !( seconds_interval >= 0.0 ) )
+    mcpl_error("mcpl_enable_checkpoints called with invalid time interval");
+  if ( f->role != MCPLIMP_ROLE_NORMAL )
+    mcpl_error("mcpl_enable_checkpoints called for file which is not written directly");
+  if (f->gz)
+    return;//(compressed data can not be made readable before it is complete)
+  f->ckpt_interval = nparticles_interval;
+  f->ckpt_seconds = seconds_interval;
+  f->ckpt_sync = ( flags & MCPL_CHECKPOINT_SYNC ) ? 1 : 0;
+  f->ckpt_last = f->nparticles;
+  f->ckpt_time = time(0);
+  f->ckpt_next = f->nparticles;
+  mcpl_internal_checkpoint_check(f);
+}
+
+#ifdef MCPLIMP_HAS_ATOMICS
+//Thread-safe ingestion: Each producer serialises particles into its own slab.
+//Full slabs are pushed onto a lock-free stack, from which a single writer
+//thread takes all published slabs at once, and appends them to the file (in
+//the order in which they were published). Producers only lock a mutex when
+//waking up a sleeping writer thread, or when too many slabs are waiting to be
+//written (to bound memory usage while the file system can not keep up):
+typedef struct mcpl_internal_slab {
+  struct mcpl_internal_slab * next;
+  uint64_t nparticles;
+  uint64_t capacity;
+  //(followed by the particle data)
+} mcpl_internal_slab_t;
+
+typedef struct mcpl_internal_ingest {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond_work;//signalled when slabs are available (or quit is set)
+  pthread_cond_t cond_space;//signalled when slabs have been written
+  mcpl_outfileinternal_t * f;
+  mcpl_internal_slab_t * head;//stack of published slabs (atomic)
+  unsigned inflight;//number of published slabs not yet written (atomic)
+  unsigned nblocked;//number of producers waiting for cond_space (atomic)
+  unsigned nproducers;//number of open producers (atomic)
+  int waiting;//writer thread is waiting for cond_work (atomic)
+  int quit;//(atomic)
+} mcpl_internal_ingest_t;
+
+void * mcpl_internal_ingest_thread(void * arg)
+{
+  mcpl_internal_ingest_t * ing = (mcpl_internal_ingest_t*)arg;
+  mcpl_outfileinternal_t * f = ing->f;
+  if (f->header_notwritten)
+    mcpl_write_header(f);
+  while (1) {
+    mcpl_internal_slab_t * slab = __atomic_exchange_n(&ing->head, (mcpl_internal_slab_t*)0, __ATOMIC_ACQUIRE);
+    if (!slab) {
+      pthread_mutex_lock(&ing->mutex);
+      __atomic_store_n(&ing->waiting, 1, __ATOMIC_SEQ_CST);
+      while ( !__atomic_load_n(&ing->head, __ATOMIC_SEQ_CST) && !__atomic_load_n(&ing->quit, __ATOMIC_SEQ_CST) )
+        pthread_cond_wait(&ing->cond_work, &ing->mutex);
+      __atomic_store_n(&ing->waiting, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&ing->mutex);
+      if ( !__atomic_load_n(&ing->head, __ATOMIC_SEQ_CST) )
+        break;//quit, and no more slabs will be published
+      continue;
+    }
+    //Reverse the stack to get the order of publication:
+    mcpl_internal_slab_t * ordered = 0;
+    while (slab) {
+      mcpl_internal_slab_t * next = slab->next;
+      slab->next = ordered;
+      ordered = slab;
+      slab = next;
+    }
+    while (ordered) {
+      slab = ordered;
+      ordered = slab->next;
+      f->nparticles += slab->nparticles;
+      mcpl_internal_output_data(f, (const char*)(slab + 1), slab->nparticles * f->particle_size);
+      if (f->nparticles >= f->ckpt_next)
+        mcpl_internal_checkpoint_check(f);
+      free(slab);
+      __atomic_sub_fetch(&ing->inflight, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&ing->nblocked, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&ing->mutex);
+        pthread_cond_broadcast(&ing->cond_space);
+        pthread_mutex_unlock(&ing->mutex);
+      }
+    }
+  }
+  return 0;
+}
+
+void mcpl_internal_ingest_publish(mcpl_internal_ingest_t * ing, mcpl_internal_slab_t * slab)
+{
+  unsigned inflight = __atomic_add_fetch(&ing->inflight, 1, __ATOMIC_SEQ_CST);
+  slab->next = __atomic_load_n(&ing->head, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&ing->head, &slab->next, slab, 1,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {}
+  if (__atomic_load_n(&ing->waiting, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&ing->mutex);
+    pthread_cond_signal(&ing->cond_work);
+    pthread_mutex_unlock(&ing->mutex);
+  }
+  if (inflight > MCPLIMP_INGEST_MAX_SLABS) {
+    pthread_mutex_lock(&ing->mutex);
+    __atomic_add_fetch(&ing->nblocked, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&ing->inflight, __ATOMIC_SEQ_CST) > MCPLIMP_INGEST_MAX_SLABS)
+      pthread_cond_wait(&ing->cond_space, &ing->mutex);
+    __atomic_sub_fetch(&ing->nblocked, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ing->mutex);
+  }
+}
+
+void mcpl_internal_producer_write(mcpl_outfileinternal_t * f, const char * buf, uint64_t n )
+{
+  while (n) {
+    if (!f->slab) {
+      uint64_t capacity = f->writebuf_size / f->particle_size;
+      if (!capacity)
+        capacity = 1;
+      f->slab = (mcpl_internal_slab_t*)malloc(sizeof(mcpl_internal_slab_t) + capacity * f->particle_size);
+      if (!f->slab)
+        mcpl_error("Unable to allocate write buffer");
+      f->slab->nparticles = 0;
+      f->slab->capacity = capacity;
+    }
+    mcpl_internal_slab_t * slab = f->slab;
+    uint64_t ncopy = slab->capacity - slab->nparticles;
+    if (ncopy > n)
+      ncopy = n;
+    memcpy((char*)(slab + 1) + slab->nparticles * f->particle_size, buf, ncopy * f->particle_size);
+    slab->nparticles += ncopy;
+    buf += ncopy * f->particle_size;
+    n -= ncopy;
+    if (slab->nparticles == slab->capacity) {
+      f->slab = 0;
+      mcpl_internal_ingest_publish(f->ingest, slab);
+    }
+  }
+}
+
+void mcpl_internal_ingest_stop(mcpl_outfileinternal_t * f)
+{
+  mcpl_internal_ingest_t * ing = f->ingest;
+  if (__atomic_load_n(&ing->nproducers, __ATOMIC_SEQ_CST))
+    mcpl_error("mcpl_close_outfile called before closing all producers of the file");
+  pthread_mutex_lock(&ing->mutex);
+  __atomic_store_n(&ing->quit, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_signal(&ing->cond_work);
+  pthread_mutex_unlock(&ing->mutex);
+  pthread_join(ing->thread, 0);
+  pthread_cond_destroy(&ing->cond_space);
+  pthread_cond_destroy(&ing->cond_work);
+  pthread_mutex_destroy(&ing->mutex);
+  free(ing);
+  f->ingest = 0;
+}
+#endif
+
+void mcpl_internal_write_particles_to_file(mcpl_outfileinternal_t * f,
+                                           const char * buf, uint64_t n ) {
+#ifdef MCPLIMP_HAS_ATOMICS
+  if (f->role == MCPLIMP_ROLE_PRODUCER) {
+    mcpl_internal_producer_write(f, buf, n);
+    return;
+  }
+  if (f->ingest)
+    mcpl_error("Particles must be added via producers once mcpl_outfile_producer was called for a file");
+#endif
+  //Ensure header is written:
+  if (f->header_notwritten)
+    mcpl_write_header(f);
+
+  //Increment nparticles and write the n serialised particles in buf to file:
+  f->nparticles += n;
+  mcpl_internal_output_data(f, buf, n * f->particle_size);
+  if (f->nparticles >= f->ckpt_next)
+    mcpl_internal_checkpoint_check(f);
+}
+
+mcpl_outfile_t mcpl_outfile_producer(mcpl_outfile_t of)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (f->role != MCPLIMP_ROLE_NORMAL)
+    mcpl_error("mcpl_outfile_producer called for unsupported file");
+#ifdef MCPLIMP_HAS_ATOMICS
+  mcpl_internal_ingest_t * ing = __atomic_load_n(&f->ingest, __ATOMIC_ACQUIRE);
+  if (!ing) {
+    //First producer: Start the writer thread (if several threads get here at
+    //the same time, only one of them gets to install its writer thread):
+    ing = (mcpl_internal_ingest_t*)calloc(sizeof(mcpl_internal_ingest_t),1);
+    assert(ing);
+    ing->f = f;
+    pthread_mutex_init(&ing->mutex, 0);
+    pthread_cond_init(&ing->cond_work, 0);
+    pthread_cond_init(&ing->cond_space, 0);
+    mcpl_internal_ingest_t * expected = 0;
+    if (__atomic_compare_exchange_n(&f->ingest, &expected, ing, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      if (pthread_create(&ing->thread, 0, mcpl_internal_ingest_thread, ing) != 0)
+        mcpl_error("Unable to start writer thread");
+    } else {
+      pthread_cond_destroy(&ing->cond_space);
+      pthread_cond_destroy(&ing->cond_work);
+      pthread_mutex_destroy(&ing->mutex);
+      free(ing);
+      ing = expected;
+    }
+  }
+  __atomic_add_fetch(&ing->nproducers, 1, __ATOMIC_SEQ_CST);
+
+  //Only settings which are never modified after the header is written are
+  //copied from the parent (its other fields belong to the writer thread):
+  mcpl_outfileinternal_t * fp = (mcpl_outfileinternal_t*)calloc(sizeof(mcpl_outfileinternal_t),1);
+  assert(fp);
+  fp->opt_userflags = f->opt_userflags;
+  fp->opt_polarisation = f->opt_polarisation;
+  fp->opt_singleprec = f->opt_singleprec;
+  fp->opt_universalpdgcode = f->opt_universalpdgcode;
+  fp->opt_universalweight = f->opt_universalweight;
+  fp->particle_size = f->particle_size;
+  fp->opt_signature = f->opt_signature;
+  fp->pack_fields = f->pack_fields;
+  fp->writebuf_size = f->writebuf_size;
+  fp->role = MCPLIMP_ROLE_PRODUCER;
+  fp->ingest = ing;
+  mcpl_outfile_t out;
+  out.internal = fp;
+  return out;
+#else
+  (void)f;
+  mcpl_error("mcpl_outfile_producer is not supported in this build (no thread support)");
+  return of;
+#endif
+}
+
+void mcpl_internal_write_particle_buffer_to_file(mcpl_outfileinternal_t * f ) {
+  mcpl_internal_write_particles_to_file(f, &(f->particle_buffer[0]), 1);
+}
+
+void mcpl_set_write_buffer_size(mcpl_outfile_t of, uint64_t nbytes)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (!nbytes)
+    mcpl_error("mcpl_set_write_buffer_size called with zero size");
+  if ( f->direct && nbytes % MCPLIMP_WRITEBUF_ALIGNMENT )
+    nbytes += MCPLIMP_WRITEBUF_ALIGNMENT - nbytes % MCPLIMP_WRITEBUF_ALIGNMENT;
+  mcpl_internal_flush_writebuf(f);
+#ifdef MCPLIMP_HAS_THREADS
+  if ( f->async && !mcpl_internal_async_drain(f) )
+    mcpl_error("Errors encountered while attempting to write particle data (in background thread).");
+#endif
+  free(f->writebuf);
+  f->writebuf = 0;
+  f->writebuf_size = nbytes;
+}
+
+void mcpl_enable_bulk_write(mcpl_outfile_t of, uint64_t nparticles_expected)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (!f->header_notwritten)
+    mcpl_error("mcpl_enable_bulk_write called too late.");
+  if ( f->role != MCPLIMP_ROLE_NORMAL )
+    mcpl_error("mcpl_enable_bulk_write called for file which is not written directly");
+#ifdef MCPLIMP_HAS_DIRECT_IO
+  if ( f->gz || f->direct )
+    return;//(the size of compressed files is not known in advance)
+  mcpl_internal_direct_t * d = (mcpl_internal_direct_t*)calloc(sizeof(mcpl_internal_direct_t),1);
+  if (!d)
+    mcpl_error("Unable to allocate memory for bulk writing");
+  d->nexpected = nparticles_expected;
+  d->fd = -1;
+#  ifdef MCPLIMP_HAS_IO_URING
+  if (f->uring) {
+    mcpl_internal_uring_destroy(f->uring);
+    f->uring = 0;
+  }
+#  endif
+  //Reallocate the write buffer with suitable size and alignment:
+  f->direct = d;
+  mcpl_set_write_buffer_size(of, f->writebuf_size);
+#else
+  (void)nparticles_expected;
+#endif
+}
+
+mcpl_outfile_t mcpl_create_outfile_flags(const char * filename, unsigned flags)
+{
+  if (flags & ~(MCPL_CREATE_ASYNC|MCPL_CREATE_GZIP))
+    mcpl_error("mcpl_create_outfile_flags called with unsupported flags");
+#ifndef MCPL_HASZLIB
+  if (flags & MCPL_CREATE_GZIP)
+    mcpl_error("MCPL_CREATE_GZIP is not supported in this build (zlib support was not enabled)");
+#endif
+  mcpl_outfile_t out = mcpl_internal_create_outfile(filename, flags & MCPL_CREATE_GZIP);
+#ifdef MCPLIMP_HAS_THREADS
+  mcpl_outfileinternal_t * f = (mcpl_outfileinternal_t *)out.internal;
+  //Files written via io_uring already have several writes in flight:
+  if ( (flags & MCPL_CREATE_ASYNC) && !f->uring )
+    mcpl_internal_async_start(f);
+#endif
+  return out;
+}
+
+void mcpl_add_particle(mcpl_outfile_t of,const mcpl_particle_t* particle)
+{
+  MCPLIMP_OUTFILEDECODE;
+  mcpl_internal_serialise_particle_to_buffer(particle,f);
+  mcpl_internal_write_particle_buffer_to_file(f);
+}
+
+void mcpl_internal_check_ekindir( uint64_t n, const double * ekin,
+                                  const double * ux, const double * uy, const double * uz,
+                                  uint64_t stride )
+{
+  //Same sanity checks as in mcpl_internal_serialise_particle_to_buffer, for n
+  //values found at the given stride (in units of doubles):
+  uint64_t i;
+  for (i = 0; i < n; ++i) {
+    double dirsq = ux[i*stride] * ux[i*stride] + uy[i*stride] * uy[i*stride] + uz[i*stride] * uz[i*stride];
+    if (fabs(dirsq-1.0)>1.0e-5)
+      mcpl_error("attempting to add particle with non-unit direction vector");
+    if (ekin[i*stride]<0.0)
+      mcpl_error("attempting to add particle with negative kinetic energy");
+  }
+}
+
+void mcpl_internal_add_packed_batch( mcpl_outfileinternal_t * f, uint64_t n,
+                                     const mcpl_particle_t * particles,
+                                     double packed[3][MCPLIMP_BATCH_NPARTICLES] )
+{
+  //Serialise n (at most MCPLIMP_BATCH_NPARTICLES) particles, whose ekin and
+  //direction were already packed, and write them to the file in one go:
+  char buf[MCPLIMP_BATCH_NPARTICLES * MCPLIMP_MAX_PARTICLE_SIZE];
+  double pack_ekindir[3];
+  uint64_t i;
+  for (i = 0; i < n; ++i) {
+    pack_ekindir[0] = packed[0][i];
+    pack_ekindir[1] = packed[1][i];
+    pack_ekindir[2] = packed[2][i];
+    f->pack_fields(&particles[i], pack_ekindir, buf + i * f->particle_size);
+  }
+  mcpl_internal_write_particles_to_file(f, buf, n);
+}
+
+void mcpl_add_particles(mcpl_outfile_t of, const mcpl_particle_t* particles, uint64_t n)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (!n)
+    return;
+  //Check all particles before adding any of them:
+  const mcpl_particle_t * p = particles;
+  mcpl_internal_check_ekindir(n, &p->ekin, &p->direction[0], &p->direction[1], &p->direction[2],
+                              sizeof(mcpl_particle_t) / sizeof(double));
+
+  double dir[3][MCPLIMP_BATCH_NPARTICLES];
+  double ekin[MCPLIMP_BATCH_NPARTICLES];
+  double packed[3][MCPLIMP_BATCH_NPARTICLES];
+  uint64_t ibatch, nbatch, i;
+  for (ibatch = 0; ibatch < n; ibatch += nbatch) {
+    nbatch = n - ibatch;
+    if (nbatch > MCPLIMP_BATCH_NPARTICLES)
+      nbatch = MCPLIMP_BATCH_NPARTICLES;
+    p = particles + ibatch;
+    for (i = 0; i < nbatch; ++i) {
+      dir[0][i] = p[i].direction[0];
+      dir[1][i] = p[i].direction[1];
+      dir[2][i] = p[i].direction[2];
+      ekin[i] = p[i].ekin;
+    }
+    mcpl_internal_pack_adaptproj_batch(nbatch, dir[0], dir[1], dir[2], ekin,
+                                       packed[0], packed[1], packed[2]);
+    mcpl_internal_add_packed_batch(f, nbatch, p, packed);
+  }
+}
+
+void mcpl_add_columns(mcpl_outfile_t of, const mcpl_columns_t* columns, uint64_t n)
+{
+  MCPLIMP_OUTFILEDECODE;
+  const mcpl_columns_t * c = columns;
+  if ( !c->ekin || !c->x || !c->y || !c->z || !c->ux || !c->uy || !c->uz || !c->time
+       || ( f->opt_polarisation && ( !c->polx || !c->poly || !c->polz ) )
+       || ( !f->opt_universalweight && !c->weight )
+       || ( !f->opt_universalpdgcode && !c->pdgcode )
+       || ( f->opt_userflags && !c->userflags ) )
+    mcpl_error("mcpl_add_columns called without array for field stored in file");
+  if (!n)
+    return;
+  //Check all particles before adding any of them:
+  mcpl_internal_check_ekindir(n, c->ekin, c->ux, c->uy, c->uz, 1);
+
+  mcpl_particle_t particles[MCPLIMP_BATCH_NPARTICLES];
+  memset(particles, 0, sizeof(particles));
+  double packed[3][MCPLIMP_BATCH_NPARTICLES];
+  uint64_t ibatch, nbatch, i, j;
+  for (ibatch = 0; ibatch < n; ibatch += nbatch) {
+    nbatch = n - ibatch;
+    if (nbatch > MCPLIMP_BATCH_NPARTICLES)
+      nbatch = MCPLIMP_BATCH_NPARTICLES;
+    mcpl_internal_pack_adaptproj_batch(nbatch, c->ux + ibatch, c->uy + ibatch, c->uz + ibatch,
+                                       c->ekin + ibatch, packed[0], packed[1], packed[2]);
+    //Gather remaining fields which are stored in the file:
+    for (i = 0, j = ibatch; i < nbatch; ++i, ++j) {
+      mcpl_particle_t * p = &particles[i];
+      p->position[0] = c->x[j];
+      p->position[1] = c->y[j];
+      p->position[2] = c->z[j];
+      p->time = c->time[j];
+    }
+    if (f->opt_polarisation) {
+      for (i = 0, j = ibatch; i < nbatch; ++i, ++j) {
+        particles[i].polarisation[0] = c->polx[j];
+        particles[i].polarisation[1] = c->poly[j];
+        particles[i].polarisation[2] = c->polz[j];
+      }
+    }
+    if (!f->opt_universalweight)
+      for (i = 0, j = ibatch; i < nbatch; ++i, ++j)
+        particles[i].weight = c->weight[j];
+    if (!f->opt_universalpdgcode)
+      for (i = 0, j = ibatch; i < nbatch; ++i, ++j)
+        particles[i].pdgcode = c->pdgcode[j];
+    if (f->opt_userflags)
+      for (i = 0, j = ibatch; i < nbatch; ++i, ++j)
+        particles[i].userflags = c->userflags[j];
+    mcpl_internal_add_packed_batch(f, nbatch, particles, packed);
+  }
+}
+
+mcpl_particle_t* mcpl_get_empty_particle(mcpl_outfile_t of)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (f->puser) {
+    //Calling more than once. This could be innocent, or it could indicate
+    //problems in multi-threaded user-code. Better disallow and give an error:
+    mcpl_error("mcpl_get_empty_particle must not be called more than once per output file");
+  } else {
+    f->puser = (mcpl_particle_t*)calloc(sizeof(mcpl_particle_t),1);
+  }
+  return f->puser;
+}
+
+void mcpl_close_outfile(mcpl_outfile_t of)
+{
+  MCPLIMP_OUTFILEDECODE;
+#ifdef MCPLIMP_HAS_ATOMICS
+  if (f->role == MCPLIMP_ROLE_PRODUCER) {
+    //Publish remaining particles and release the producer:
+    mcpl_internal_ingest_t * ing = f->ingest;
+    if (f->slab)
+      mcpl_internal_ingest_publish(ing, f->slab);
+    free(f->puser);
+    free(f);
+    __atomic_sub_fetch(&ing->nproducers, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  if (f->ingest)
+    mcpl_internal_ingest_stop(f);
+#endif
+  if (f->role != MCPLIMP_ROLE_NORMAL)
+    mcpl_error("mcpl_close_outfile called for file which must be closed with mcpl_close_outfile_mt");
+  if (f->header_notwritten)
+    mcpl_write_header(f);
+#ifdef MCPLIMP_HAS_IO_URING
+  if (f->uring) {
+    mcpl_internal_uring_flush(f->uring);
+    mcpl_internal_uring_destroy(f->uring);
+  }
+#endif
+  mcpl_internal_flush_writebuf(f);
+#ifdef MCPLIMP_HAS_THREADS
+  if (f->async)
+    mcpl_internal_async_stop(f);
+#endif
+#ifdef MCPLIMP_HAS_DIRECT_IO
+  if (f->direct)
+    mcpl_internal_direct_stop(f);
+#endif
+#ifdef MCPL_HASZLIB
+  if (f->gz) {
+    //End the compressed stream, and rewrite the prefix with the final number
+    //of particles:
+    if (!mcpl_internal_gzstream_write(f->gz, f->file, 0, 0, 1))
+      mcpl_error("Errors encountered while attempting to write particle data.");
+    mcpl_internal_gzstream_destroy(f->gz);
+    f->gz = 0;
+    if (f->nparticles)
+      mcpl_internal_gzstream_write_prefix(f->file,f->nparticles);
+  } else
+#endif
+  if (f->nparticles)
+    mcpl_update_nparticles(f->file,f->nparticles);
+  if (fclose(f->file))
+    mcpl_error("Errors encountered while attempting to close file.");
+  free(f->writebuf);
+  free(f->filename);
+  free(f->puser);
+  free(f);
+}
+
+int mcpl_closeandgzip_outfile_rc(mcpl_outfile_t of)
+{
+    printf("MCPL WARNING: Usage of function mcpl_closeandgzip_outfile_rc is obsolete as"
+         " mcpl_closeandgzip_outfile now also returns the status. Please update your code"
+           " to use mcpl_closeandgzip_outfile instead.\n");
+    return mcpl_closeandgzip_outfile(of);
+}
+
+int mcpl_closeandgzip_outfile(mcpl_outfile_t of)
+{
+  MCPLIMP_OUTFILEDECODE;
+  if (f->gz) {
+    //Already compressed while being written:
+    mcpl_close_outfile(of);
+    return 1;
+  }
+  char * filename = f->filename;
+  f->filename = 0;//prevent free in mcpl_close_outfile
+  mcpl_close_outfile(of);
+  int rc = mcpl_gzip_file(filename);
+  free(filename);
+  return rc;
+}
+
+//Byte swapping of packed particle data, for reading files written on platforms
+//with a different endianness. Each record consists of 8 byte fields (doubles)
+//followed by 4 byte fields, and all records are swapped in-place as soon as
+//they are read into the read buffer, after which they are used exactly like
+//data of other files. The SIMD kernels process the data as a stream, in which
+//each 16 byte lane of output is assembled with two byte shuffles from the 32
+//input bytes around it (fields do not in general line up with lanes when the
+//record size is not a multiple of 16). The shuffle masks repeat with a period
+//which covers an integral number of both records and 32 byte chunks:
+
+typedef struct mcpl_internal_byteswap {
+  unsigned particle_size;
+  unsigned nbytes_wide;//bytes at start of each record which are in 8 byte fields
+  unsigned period;//period of the shuffle masks in bytes (a multiple of 32)
+  unsigned char * masks_lo;//masks for input bytes [-8,8) relative to each lane
+  unsigned char * masks_hi;//masks for input bytes [8,24) relative to each lane
+  void (*swap)(const struct mcpl_internal_byteswap*, char*, uint64_t);
+} mcpl_internal_byteswap_t;
+
+void mcpl_internal_byteswap_scalar(const mcpl_internal_byteswap_t* bs, char* buf, uint64_t n)
+{
+  const unsigned lbuf = bs->particle_size;
+  const unsigned nwide = bs->nbytes_wide;
+  uint64_t i;
+  for (i = 0; i < n; ++i, buf += lbuf) {
+    unsigned j;
+    for (j = 0; j < nwide; j += 8) {
+      uint64_t v;
+      memcpy(&v, buf + j, sizeof(v));
+      v = mcpl_internal_bswap64(v);
+      memcpy(buf + j, &v, sizeof(v));
+    }
+    for (; j < lbuf; j += 4) {
+      uint32_t v;
+      memcpy(&v, buf + j, sizeof(v));
+      v = mcpl_internal_bswap32(v);
+      memcpy(buf + j, &v, sizeof(v));
+    }
+  }
+}
+
+#ifdef MCPLIMP_X86_SIMD
+
+__attribute__((target("ssse3")))
+void mcpl_internal_byteswap_ssse3(const mcpl_internal_byteswap_t* bs, char* buf, uint64_t n)
+{
+  //The (zero padded) partial lane at the end is processed in a copy:
+  uint64_t nbytes = n * bs->particle_size;
+  uint64_t nlanes = nbytes / 16;
+  unsigned ntail = (unsigned)( nbytes % 16 );
+  char tail[16] = {0};
+  memcpy(tail, buf + nlanes * 16, ntail);
+  if (ntail)
+    ++nlanes;
+  unsigned imask = 0;
+  __m128i prev = _mm_setzero_si128();
+  __m128i cur = _mm_loadu_si128((const __m128i*)( nlanes > 1 || !ntail ? buf : tail ));
+  uint64_t i;
+  for (i = 0; i < nlanes; ++i) {
+    __m128i next;
+    if ( i + 2 < nlanes || ( i + 2 == nlanes && !ntail ) )
+      next = _mm_loadu_si128((const __m128i*)( buf + 16 * ( i + 1 ) ));
+    else if ( i + 2 == nlanes )
+      next = _mm_loadu_si128((const __m128i*)tail);
+    else
+      next = _mm_setzero_si128();
+    __m128i lo = _mm_alignr_epi8(cur, prev, 8);
+    __m128i hi = _mm_alignr_epi8(next, cur, 8);
+    __m128i out = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_loadu_si128((const __m128i*)( bs->masks_lo + imask ))),
+                               _mm_shuffle_epi8(hi, _mm_loadu_si128((const __m128i*)( bs->masks_hi + imask ))));
+    _mm_storeu_si128((__m128i*)( i + 1 < nlanes || !ntail ? buf + 16 * i : tail ), out);
+    prev = cur;
+    cur = next;
+    imask += 16;
+    if (imask == bs->period)
+      imask = 0;
+  }
+  memcpy(buf + ( nbytes - ntail ), tail, ntail);
+}
+
+__attribute__((target("avx2")))
+void mcpl_internal_byteswap_avx2(const mcpl_internal_byteswap_t* bs, char* buf, uint64_t n)
+{
+  //As the SSSE3 version, but with two lanes at a time:
+  uint64_t nbytes = n * bs->particle_size;
+  uint64_t nchunks = nbytes / 32;
+  unsigned ntail = (unsigned)( nbytes % 32 );
+  char tail[32] = {0};
+  memcpy(tail, buf + nchunks * 32, ntail);
+  if (ntail)
+    ++nchunks;
+  unsigned imask = 0;
+  __m256i prev = _mm256_setzero_si256();
+  __m256i cur = _mm256_loadu_si256((const __m256i*)( nchunks > 1 || !ntail ? buf : tail ));
+  uint64_t i;
+  for (i = 0; i < nchunks; ++i) {
+    __m256i next;
+    if ( i + 2 < nchunks || ( i + 2 == nchunks && !ntail ) )
+      next = _mm256_loadu_si256((const __m256i*)( buf + 32 * ( i + 1 ) ));
+    else if ( i + 2 == nchunks )
+      next = _mm256_loadu_si256((const __m256i*)tail);
+    else
+      next = _mm256_setzero_si256();
+    __m256i lo = _mm256_alignr_epi8(cur, _mm256_permute2x128_si256(prev, cur, 0x21), 8);
+    __m256i hi = _mm256_alignr_epi8(_mm256_permute2x128_si256(cur, next, 0x21), cur, 8);
+    __m256i out = _mm256_or_si256(_mm256_shuffle_epi8(lo, _mm256_loadu_si256((const __m256i*)( bs->masks_lo + imask ))),
+                                  _mm256_shuffle_epi8(hi, _mm256_loadu_si256((const __m256i*)( bs->masks_hi + imask ))));
+    _mm256_storeu_si256((__m256i*)( i + 1 < nchunks || !ntail ? buf + 32 * i : tail ), out);
+    prev = cur;
+    cur = next;
+    imask += 32;
+    if (imask == bs->period)
+      imask = 0;
+  }
+  memcpy(buf + ( nbytes - ntail ), tail, ntail);
+}
+
+#endif
+
+mcpl_internal_byteswap_t * mcpl_internal_byteswap_create(unsigned particle_size, unsigned nbytes_wide)
+{
+  mcpl_internal_byteswap_t * bs = (mcpl_internal_byteswap_t*)calloc(sizeof(mcpl_internal_byteswap_t),1);
+  if (!bs)
+    mcpl_error("Unable to allocate memory");
+  assert( particle_size % 4 == 0 && nbytes_wide % 8 == 0 && nbytes_wide <= particle_size );
+  bs->particle_size = particle_size;
+  bs->nbytes_wide = nbytes_wide;
+  bs->swap = &mcpl_internal_byteswap_scalar;
+#ifdef MCPLIMP_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    bs->swap = &mcpl_internal_byteswap_avx2;
+  else if (__builtin_cpu_supports("ssse3"))
+    bs->swap = &mcpl_internal_byteswap_ssse3;
+#endif
+  if (bs->swap == &mcpl_internal_byteswap_scalar)
+    return bs;
+
+  //Shuffle masks, with the source of each output byte given relative to the
+  //inputs of its lane (0x80 gives zero):
+  bs->period = particle_size;
+  while (bs->period % 32)
+    bs->period += particle_size;
+  bs->masks_lo = (unsigned char*)malloc(2 * bs->period);
+  if (!bs->masks_lo)
+    mcpl_error("Unable to allocate memory");
+  bs->masks_hi = bs->masks_lo + bs->period;
+  unsigned b;
+  for (b = 0; b < bs->period; ++b) {
+    unsigned r = b % particle_size;//offset in record
+    unsigned size = ( r < nbytes_wide ? 8 : 4 );
+    unsigned field = r - ( r - ( r < nbytes_wide ? 0 : nbytes_wide ) ) % size;
+    unsigned src = ( b - r ) + field + ( size - 1 - ( r - field ) );
+    unsigned rel = src + 8 - ( b - b % 16 );//index into the 32 input bytes [-8,24)
+    assert(rel < 32);
+    bs->masks_lo[b] = (unsigned char)( rel < 16 ? rel : 0x80 );
+    bs->masks_hi[b] = (unsigned char)( rel < 16 ? 0x80 : rel - 16 );
+  }
+  return bs;
+}
+
+void mcpl_internal_byteswap_destroy(mcpl_internal_byteswap_t * bs)
+{
+  free(bs->masks_lo);
+  free(bs);
+}
+
+typedef struct mcpl_fileinternal {
+  FILE * file;
+#ifdef MCPL_HASZLIB
+  gzFile filegz;
+#else
+  void * filegz;
+#endif
+  char * hdr_srcprogname;
+  unsigned format_version;
+  int opt_userflags;
+  int opt_polarisation;
+  int opt_singleprec;
+  int32_t opt_universalpdgcode;
+  double opt_universalweight;
+  int is_little_endian;
+  mcpl_internal_byteswap_t * byteswap;//for files with foreign endianness (or null)
+  uint64_t nparticles;
+  uint32_t ncomments;
+  char ** comments;//loaded on demand (null until then)
+  uint64_t * comment_pos;//position of comments in the file
+  uint32_t * comment_lengths;
+  uint32_t nblobs;
+  char ** blobkeys;
+  uint32_t * bloblengths;
+  char ** blobs;//loaded on demand (null until then)
+  uint64_t * blob_pos;//position of blob data in the file
+  uint64_t blobsection_pos;//position of the blob keys in the file
+  int hdr_partial;//blob keys and positions (and first_particle_pos) not yet read
+  int header_only;//opened with mcpl_open_header
+  unsigned particle_size;
+  uint64_t first_particle_pos;
+  uint64_t current_particle_idx;
+  mcpl_particle_t* particle;
+  unsigned opt_signature;
+  char particle_buffer[MCPLIMP_MAX_PARTICLE_SIZE];
+  char * readbuf;//buffered particle data, refilled with large reads as needed
+  uint64_t readbuf_size;//requested size in bytes
+  uint64_t readbuf_begin;//index of first particle in readbuf
+  uint64_t readbuf_count;//number of particles in readbuf
+  uint64_t readbuf_nextfill;//number of particles to read at next sequential refill
+  uint64_t readbuf_capacity;//number of particles for which readbuf is allocated
+  uint64_t file_idx;//index of particle at the current position of file/filegz
+  int pread_fd;//file descriptor used for reading with pread instead (or -1)
+  struct mcpl_internal_readahead * readahead;//background reader (or null)
+  mcpl_internal_uring_t * uring;//reading of particle data via io_uring (or null)
+  struct mcpl_fileinternal * shared;//for cursors, the shared file owning the header data
+  mcpl_internal_hdrlock_t * hdrlock;//shared files: guards loading of comments and blobs (or null)
+  char * filename;//only kept for shared files
+  uint64_t range_begin;//reading is restricted to particles in [range_begin,range_end)
+  uint64_t range_end;
+  const char * last_particle_raw;//packed data of the most recently read particle
+  int particle_outdated;//particle does not yet hold the unpacked last_particle_raw
+  mcpl_layout_t layout;
+  char * mmap_data;//start of memory mapped file (when reading via mmap)
+  uint64_t mmap_size;
+  void (*unpack)(const struct mcpl_fileinternal*, const char*, mcpl_particle_t*);
+  void (*unpack_fields)(const struct mcpl_fileinternal*, const char*, mcpl_particle_t*, double*);
+} mcpl_fileinternal_t;
+
+typedef void (*mcpl_internal_unpack_fct_t)(const mcpl_fileinternal_t*, const char*, mcpl_particle_t*);
+typedef void (*mcpl_internal_unpack_fields_fct_t)(const mcpl_fileinternal_t*, const char*,
+                                                  mcpl_particle_t*, double*);
+
+#define MCPLIMP_FILEDECODE mcpl_fileinternal_t * f = (mcpl_fileinternal_t *)ff.internal; assert(f)
+
+MCPLIMP_FORCEINLINE void mcpl_internal_unpack_ekindir_generic( unsigned format_version,
+                                                                double * pack_ekindir,
+                                                                double * ekin,
+                                                                double * direction )
+{
+  //Unpack direction and ekin (note that pack_ekindir is modified):
+
+  if (format_version>=3) {
+    *ekin = fabs(pack_ekindir[2]);
+    pack_ekindir[2] = copysign(1.0,pack_ekindir[2]);
+    mcpl_unitvect_unpack_adaptproj(pack_ekindir,direction);
+  } else {
+    assert(format_version==2);
+    mcpl_unitvect_unpack_oct(pack_ekindir,direction);
+    *ekin = pack_ekindir[2];
+    if (signbit(pack_ekindir[2])) {
+      *ekin = - *ekin;
+      direction[2] = 0.0;
+    }
+  }
+}
+
+MCPLIMP_FORCEINLINE void mcpl_internal_unpack_fields_generic( const mcpl_fileinternal_t* f,
+                                                              const char * pbuf,
+                                                              mcpl_particle_t * p,
+                                                              double * pack_ekindir,
+                                                              int opt_singleprec,
+                                                              int opt_polarisation,
+                                                              int opt_universalpdgcode,
+                                                              int opt_universalweight,
+                                                              int opt_userflags )
+{
+  //Transfer packed particle data in pbuf (with the layout given by the options)
+  //to particle struct, except for ekin and direction which are instead left in
+  //their packed form in pack_ekindir:
   unsigned ibuf = 0;
-  char * pbuf = &(f->particle_buffer[0]);
   int i;
-  if (f->opt_singleprec) {
-    if (f->opt_polarisation) {
+  if (opt_singleprec) {
+    if (opt_polarisation) {
       for (i=0;i<3;++i) {
-        *(float*)&pbuf[ibuf] = (float)particle->polarisation[i];
+        p->polarisation[i] = *(float*)&pbuf[ibuf];
         ibuf += sizeof(float);
       }
+    } else {
+      for (i=0;i<3;++i)
+        p->polarisation[i] = 0.0;
     }
     for (i=0;i<3;++i) {
-      *(float*)&pbuf[ibuf] = (float)particle->position[i];
+      p->position[i] = *(float*)&pbuf[ibuf];
       ibuf += sizeof(float);
     }
     for (i=0;i<3;++i) {
-      *(float*)&pbuf[ibuf] = (float)pack_ekindir[i];
+      pack_ekindir[i] = *(float*)&pbuf[ibuf];
       ibuf += sizeof(float);
     }
-    *(float*)&pbuf[ibuf] = (float)particle->time;
+    p->time = *(float*)&pbuf[ibuf];
     ibuf += sizeof(float);
-    if (!f->opt_universalweight) {
-      *(float*)&pbuf[ibuf] = (float)particle->weight;
+    if (opt_universalweight) {
+      p->weight = f->opt_universalweight;
+    } else {
+      p->weight = *(float*)&pbuf[ibuf];
       ibuf += sizeof(float);
     }
   } else {
-    if (f->opt_polarisation) {
+    if (opt_polarisation) {
       for (i=0;i<3;++i) {
-        *(double*)&pbuf[ibuf] = particle->polarisation[i];
+        p->polarisation[i] = *(double*)&pbuf[ibuf];
         ibuf += sizeof(double);
       }
+    } else {
+      for (i=0;i<3;++i)
+        p->polarisation[i] = 0.0;
     }
     for (i=0;i<3;++i) {
-      *(double*)&pbuf[ibuf] = particle->position[i];
+      p->position[i] = *(double*)&pbuf[ibuf];
       ibuf += sizeof(double);
     }
     for (i=0;i<3;++i) {
-      *(double*)&pbuf[ibuf] = pack_ekindir[i];
+      pack_ekindir[i] = *(double*)&pbuf[ibuf];
       ibuf += sizeof(double);
     }
-    *(double*)&pbuf[ibuf] = particle->time;
+    p->time = *(double*)&pbuf[ibuf];
     ibuf += sizeof(double);
-    if (!f->opt_universalweight) {
-      *(double*)&pbuf[ibuf] = particle->weight;
+    if (opt_universalweight) {
+      p->weight = f->opt_universalweight;
+    } else {
+      p->weight = *(double*)&pbuf[ibuf];
       ibuf += sizeof(double);
     }
   }
-  if (!f->opt_universalpdgcode) {
-    *(int32_t*)&pbuf[ibuf] = particle->pdgcode;
+
+  if (opt_universalpdgcode) {
+    p->pdgcode = f->opt_universalpdgcode;
+  } else {
+    p->pdgcode = *(int32_t*)&pbuf[ibuf];
     ibuf += sizeof(int32_t);
   }
-  if (f->opt_userflags) {
-    *(uint32_t*)&pbuf[ibuf] = particle->userflags;
+  if (opt_userflags) {
+    p->userflags = *(uint32_t*)&pbuf[ibuf];
 #ifndef NDEBUG
     ibuf += sizeof(uint32_t);
 #endif
+  } else {
+    p->userflags = 0;
   }
   assert(ibuf==f->particle_size);
 }
 
-void mcpl_internal_write_particle_buffer_to_file(mcpl_outfileinternal_t * f ) {
-  //Ensure header is written:
-  if (f->header_notwritten)
-    mcpl_write_header(f);
 
-  //Increment nparticles and write buffer to file:
-  f->nparticles += 1;
-  size_t nb;
-  nb = fwrite(&(f->particle_buffer[0]), 1, f->particle_size, f->file);
-  if (nb!=f->particle_size)
-    mcpl_error("Errors encountered while attempting to write particle data.");
+#define MCPLIMP_DEFINE_UNPACK(L)                                                          \
+  static void mcpl_internal_unpack_fields_##L( const mcpl_fileinternal_t* f,              \
+                                               const char * pbuf, mcpl_particle_t * p,    \
+                                               double * pack_ekindir )                    \
+  {                                                                                       \
+    mcpl_internal_unpack_fields_generic( f, pbuf, p, pack_ekindir,                        \
+                                         MCPLIMP_LAYOUT_OPTIONS(L) );                     \
+  }                                                                                       \
+  static void mcpl_internal_unpack_v2_##L( const mcpl_fileinternal_t* f,                  \
+                                           const char * pbuf, mcpl_particle_t * p )       \
+  {                                                                                       \
+    double pack_ekindir[3];                                                               \
+    mcpl_internal_unpack_fields_generic( f, pbuf, p, pack_ekindir,                        \
+                                         MCPLIMP_LAYOUT_OPTIONS(L) );                     \
+    mcpl_internal_unpack_ekindir_generic( 2, pack_ekindir, &(p->ekin), p->direction );    \
+  }                                                                                       \
+  static void mcpl_internal_unpack_v3_##L( const mcpl_fileinternal_t* f,                  \
+                                           const char * pbuf, mcpl_particle_t * p )       \
+  {                                                                                       \
+    double pack_ekindir[3];                                                               \
+    mcpl_internal_unpack_fields_generic( f, pbuf, p, pack_ekindir,                        \
+                                         MCPLIMP_LAYOUT_OPTIONS(L) );                     \
+    mcpl_internal_unpack_ekindir_generic( 3, pack_ekindir, &(p->ekin), p->direction );    \
+  }
+MCPLIMP_FOREACH_LAYOUT(MCPLIMP_DEFINE_UNPACK)
+#define MCPLIMP_UNPACK_FIELDS_ENTRY(L) &mcpl_internal_unpack_fields_##L,
+#define MCPLIMP_UNPACK_V2_ENTRY(L) &mcpl_internal_unpack_v2_##L,
+#define MCPLIMP_UNPACK_V3_ENTRY(L) &mcpl_internal_unpack_v3_##L,
+static mcpl_internal_unpack_fields_fct_t const mcpl_internal_unpack_fields_fcts[MCPLIMP_NLAYOUTS] = {
+  MCPLIMP_FOREACH_LAYOUT(MCPLIMP_UNPACK_FIELDS_ENTRY)
+};
+static mcpl_internal_unpack_fct_t const mcpl_internal_unpack_v2_fcts[MCPLIMP_NLAYOUTS] = {
+  MCPLIMP_FOREACH_LAYOUT(MCPLIMP_UNPACK_V2_ENTRY)
+};
+static mcpl_internal_unpack_fct_t const mcpl_internal_unpack_v3_fcts[MCPLIMP_NLAYOUTS] = {
+  MCPLIMP_FOREACH_LAYOUT(MCPLIMP_UNPACK_V3_ENTRY)
+};
+
+void mcpl_internal_unpack_ekindir(unsigned format_version, double * pack_ekindir,
+                                  double * ekin, double * direction)
+{
+  mcpl_internal_unpack_ekindir_generic(format_version,pack_ekindir,ekin,direction);
 }
 
-void mcpl_add_particle(mcpl_outfile_t of,const mcpl_particle_t* particle)
+void mcpl_internal_unpack_particle(const mcpl_fileinternal_t* f, const char * pbuf,
+                                   mcpl_particle_t * p)
 {
-  MCPLIMP_OUTFILEDECODE;
-  mcpl_internal_serialise_particle_to_buffer(particle,f);
-  mcpl_internal_write_particle_buffer_to_file(f);
+  //Transfer packed particle data in pbuf (according to the settings of the
+  //input file) to particle struct:
+  f->unpack(f,pbuf,p);
 }
 
-void mcpl_update_nparticles(FILE* f, uint64_t n)
+
+size_t mcpl_internal_read_particle_data(mcpl_fileinternal_t* f, char * buf,
+                                        uint64_t idx, uint64_t n)
 {
-  //Seek and update nparticles at correct location in header:
-  const char * errmsg = "Errors encountered while attempting to update number of particles in file.";
-  int64_t savedpos = ftell(f);
-  if (savedpos<0)
-    mcpl_error(errmsg);
-  if (fseek( f, MCPLIMP_NPARTICLES_POS, SEEK_SET ))
-    mcpl_error(errmsg);
-  size_t nb = fwrite(&n, 1, sizeof(n), f);
-  if (nb != sizeof(n))
-    mcpl_error(errmsg);
-  if (fseek( f, savedpos, SEEK_SET ))
-    mcpl_error(errmsg);
+  //Read data of n particles starting at idx into buf, assuming that the file is
+  //already positioned at idx unless pread is used. Returns number of bytes read:
+  size_t nb;
+#ifdef MCPLIMP_HAS_PREAD
+  if (f->pread_fd >= 0)
+    nb = mcpl_internal_pread(f->pread_fd, buf, n*f->particle_size, f->first_particle_pos + idx*f->particle_size);
+  else
+#endif
+#ifdef MCPL_HASZLIB
+  if (f->filegz)
+    nb = gzread(f->filegz, buf, n*f->particle_size);
+  else
+#endif
+    nb = fread(buf, 1, n*f->particle_size, f->file);
+  (void)idx;
+  if (f->byteswap)
+    f->byteswap->swap(f->byteswap, buf, nb / f->particle_size);
+  return nb;
 }
 
-mcpl_particle_t* mcpl_get_empty_particle(mcpl_outfile_t of)
+#ifdef MCPLIMP_HAS_THREADS
+//With MCPL_OPEN_READAHEAD, a helper thread reads (and for .gz files inflates)
+//the particles following those in the read buffer into a second buffer, while
+//the particles in the read buffer are being consumed. When the consumer needs
+//the next particles, the two buffers are simply swapped. While a request is
+//pending, only the helper thread touches the file handle and the second buffer:
+typedef struct mcpl_internal_readahead {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  mcpl_fileinternal_t * f;
+  char * buf;//second buffer, same capacity as f->readbuf
+  uint64_t begin;//first particle of most recent request
+  uint64_t count;//number of particles in most recent request (0 if none)
+  size_t nbytes_read;
+  int pending;
+  int quit;
+} mcpl_internal_readahead_t;
+
+void * mcpl_internal_readahead_thread(void * arg)
 {
-  MCPLIMP_OUTFILEDECODE;
-  if (f->puser) {
-    //Calling more than once. This could be innocent, or it could indicate
-    //problems in multi-threaded user-code. Better disallow and give an error:
-    mcpl_error("mcpl_get_empty_particle must not be called more than once per output file");
-  } else {
-    f->puser = (mcpl_particle_t*)calloc(sizeof(mcpl_particle_t),1);
+  mcpl_internal_readahead_t * ra = (mcpl_internal_readahead_t*)arg;
+  pthread_mutex_lock(&ra->mutex);
+  while (1) {
+    while (!ra->pending && !ra->quit)
+      pthread_cond_wait(&ra->cond, &ra->mutex);
+    if (ra->quit)
+      break;
+    pthread_mutex_unlock(&ra->mutex);
+    size_t nb = mcpl_internal_read_particle_data(ra->f, ra->buf, ra->begin, ra->count);
+    pthread_mutex_lock(&ra->mutex);
+    ra->nbytes_read = nb;
+    ra->pending = 0;
+    pthread_cond_broadcast(&ra->cond);
   }
-  return f->puser;
+  pthread_mutex_unlock(&ra->mutex);
+  return 0;
 }
 
-void mcpl_close_outfile(mcpl_outfile_t of)
+void mcpl_internal_readahead_start(mcpl_fileinternal_t* f)
 {
-  MCPLIMP_OUTFILEDECODE;
-  if (f->header_notwritten)
-    mcpl_write_header(f);
-  if (f->nparticles)
-    mcpl_update_nparticles(f->file,f->nparticles);
-  fclose(f->file);
-  free(f->filename);
-  free(f->puser);
-  free(f);
+  mcpl_internal_readahead_t * ra = (mcpl_internal_readahead_t*)calloc(sizeof(mcpl_internal_readahead_t),1);
+  if (!ra)
+    return;
+  ra->f = f;
+  pthread_mutex_init(&ra->mutex, 0);
+  pthread_cond_init(&ra->cond, 0);
+  if (pthread_create(&ra->thread, 0, mcpl_internal_readahead_thread, ra) != 0) {
+    //Not fatal, simply keep reading synchronously:
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mutex);
+    free(ra);
+    return;
+  }
+  f->readahead = ra;
 }
 
-void mcpl_transfer_metadata(mcpl_file_t source, mcpl_outfile_t target)
+void mcpl_internal_readahead_wait(mcpl_fileinternal_t* f)
 {
-  //Note that MCPL format version 2 and 3 have the same meta-data in the header,
-  //except of course the version number itself.
-
-  if (mcpl_hdr_little_endian(source) != mcpl_platform_is_little_endian())
-    mcpl_error("mcpl_transfer_metadata can only work on files with same endianness as current platform.");
+  //Wait for any pending request to complete, after which the file handle can
+  //again be used directly. A failed request leaves the file position unknown:
+  mcpl_internal_readahead_t * ra = f->readahead;
+  pthread_mutex_lock(&ra->mutex);
+  while (ra->pending)
+    pthread_cond_wait(&ra->cond, &ra->mutex);
+  pthread_mutex_unlock(&ra->mutex);
+  if ( ra->count && ra->nbytes_read != ra->count * f->particle_size )
+    f->file_idx = (uint64_t)-1;
+}
 
-  mcpl_hdr_set_srcname(target,mcpl_hdr_srcname(source));
-  unsigned i;
-  for (i = 0; i < mcpl_hdr_ncomments(source); ++i)
-    mcpl_hdr_add_comment(target,mcpl_hdr_comment(source,i));
-  const char** blobkeys = mcpl_hdr_blobkeys(source);
-  if (blobkeys) {
-    int nblobs = mcpl_hdr_nblobs(source);
-    uint32_t ldata;
-    const char * data;
-    int ii;
-    for (ii = 0; ii < nblobs; ++ii) {
-      int res = mcpl_hdr_blob(source,blobkeys[ii],&ldata,&data);
-      assert(res);//key must exist
-      (void)res;
-      mcpl_hdr_add_data(target, blobkeys[ii], ldata, data);
-    }
+void mcpl_internal_readahead_request(mcpl_fileinternal_t* f)
+{
+  //Request the particles following those in the read buffer, ramping up the
+  //amount in the same way as for synchronous sequential reading:
+  mcpl_internal_readahead_t * ra = f->readahead;
+  ra->count = 0;
+  uint64_t begin = f->readbuf_begin + f->readbuf_count;
+  if ( begin >= f->range_end || begin != f->file_idx )
+    return;
+  if (!ra->buf) {
+    ra->buf = (char*)malloc(f->readbuf_capacity * f->particle_size);
+    if (!ra->buf)
+      mcpl_error("Unable to allocate read buffer");
   }
-  if (mcpl_hdr_has_userflags(source))
-    mcpl_enable_userflags(target);
-  if (mcpl_hdr_has_polarisation(source))
-    mcpl_enable_polarisation(target);
-  if (mcpl_hdr_has_doubleprec(source))
-    mcpl_enable_doubleprec(target);
-  int32_t updg = mcpl_hdr_universal_pdgcode(source);
-  if (updg)
-    mcpl_enable_universal_pdgcode(target,updg);
-  double uw = mcpl_hdr_universal_weight(source);
-  if (uw)
-    mcpl_enable_universal_weight(target,uw);
+  uint64_t n = f->readbuf_nextfill * 2;
+  if (n > f->readbuf_capacity)
+    n = f->readbuf_capacity;
+  f->readbuf_nextfill = n;
+  if (n > f->range_end - begin)
+    n = f->range_end - begin;
+  f->file_idx = begin + n;//file position once the request has completed
+  pthread_mutex_lock(&ra->mutex);
+  ra->begin = begin;
+  ra->count = n;
+  ra->pending = 1;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
 }
 
-int mcpl_closeandgzip_outfile_rc(mcpl_outfile_t of)
+int mcpl_internal_readahead_take(mcpl_fileinternal_t* f, uint64_t idx)
 {
-    printf("MCPL WARNING: Usage of function mcpl_closeandgzip_outfile_rc is obsolete as"
-         " mcpl_closeandgzip_outfile now also returns the status. Please update your code"
-           " to use mcpl_closeandgzip_outfile instead.\n");
-    return mcpl_closeandgzip_outfile(of);
+  //Swap in the result of the previous request if it contains particle idx
+  //(otherwise it is discarded). Returns 1 if this was the case:
+  mcpl_internal_readahead_t * ra = f->readahead;
+  mcpl_internal_readahead_wait(f);
+  uint64_t n = ra->count;
+  ra->count = 0;
+  if ( !n || idx < ra->begin || idx >= ra->begin + n )
+    return 0;
+  if (ra->nbytes_read != n * f->particle_size)
+    mcpl_error("Errors encountered while attempting to read particle data.");
+  char * tmp = f->readbuf;
+  f->readbuf = ra->buf;
+  ra->buf = tmp;
+  f->readbuf_begin = ra->begin;
+  f->readbuf_count = n;
+  return 1;
 }
 
-int mcpl_closeandgzip_outfile(mcpl_outfile_t of)
+void mcpl_internal_readahead_stop(mcpl_fileinternal_t* f)
 {
-  MCPLIMP_OUTFILEDECODE;
-  char * filename = f->filename;
-  f->filename = 0;//prevent free in mcpl_close_outfile
-  mcpl_close_outfile(of);
-  int rc = mcpl_gzip_file(filename);
-  free(filename);
-  return rc;
+  mcpl_internal_readahead_t * ra = f->readahead;
+  pthread_mutex_lock(&ra->mutex);
+  ra->quit = 1;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->mutex);
+  pthread_join(ra->thread, 0);
+  pthread_cond_destroy(&ra->cond);
+  pthread_mutex_destroy(&ra->mutex);
+  free(ra->buf);
+  free(ra);
+  f->readahead = 0;
 }
-
-typedef struct {
-  FILE * file;
-#ifdef MCPL_HASZLIB
-  gzFile filegz;
-#else
-  void * filegz;
 #endif
-  char * hdr_srcprogname;
-  unsigned format_version;
-  int opt_userflags;
-  int opt_polarisation;
-  int opt_singleprec;
-  int32_t opt_universalpdgcode;
-  double opt_universalweight;
-  int is_little_endian;
-  uint64_t nparticles;
-  uint32_t ncomments;
-  char ** comments;
-  uint32_t nblobs;
-  char ** blobkeys;
-  uint32_t * bloblengths;
-  char ** blobs;
-  unsigned particle_size;
-  uint64_t first_particle_pos;
-  uint64_t current_particle_idx;
-  mcpl_particle_t* particle;
-  unsigned opt_signature;
-  char particle_buffer[MCPLIMP_MAX_PARTICLE_SIZE];
-} mcpl_fileinternal_t;
 
-#define MCPLIMP_FILEDECODE mcpl_fileinternal_t * f = (mcpl_fileinternal_t *)ff.internal; assert(f)
+void mcpl_internal_free_readbuf(mcpl_fileinternal_t* f)
+{
+  //Release the read buffer(s), after waiting for the helper thread if needed:
+#ifdef MCPLIMP_HAS_THREADS
+  if (f->readahead) {
+    mcpl_internal_readahead_wait(f);
+    f->readahead->count = 0;
+    free(f->readahead->buf);
+    f->readahead->buf = 0;
+  }
+#endif
+#ifdef MCPLIMP_HAS_IO_URING
+  if (f->uring) {
+    mcpl_internal_uring_release_slots(f->uring, 1);
+    f->readbuf = 0;//was owned by f->uring
+  }
+#endif
+  free(f->readbuf);
+  f->readbuf = 0;
+  f->readbuf_count = 0;
+  f->readbuf_capacity = 0;
+}
 
-void mcpl_read_buffer(mcpl_fileinternal_t* f, unsigned* n, char ** buf, const char * errmsg)
+void mcpl_skip_buffer(mcpl_fileinternal_t* f, uint32_t* n, uint64_t* pos, const char * errmsg)
 {
+  //Read the length of the buffer at the current position and skip past its
+  //contents (without reading them), providing their position in the file:
   size_t nb;
 #ifdef MCPL_HASZLIB
   if (f->filegz)
@@ -879,15 +3486,23 @@ void mcpl_read_buffer(mcpl_fileinternal_t* f, unsigned* n, char ** buf, const ch
     nb = fread(n, 1, sizeof(*n), f->file);
   if (nb!=sizeof(*n))
     mcpl_error(errmsg);
-  *buf = (char*)calloc(*n,1);
+  if (f->byteswap)
+    *n = mcpl_internal_bswap32(*n);
+  int64_t tellpos;
+  int error;
 #ifdef MCPL_HASZLIB
-  if (f->filegz)
-    nb = gzread(f->filegz, *buf, *n);
-  else
+  if (f->filegz) {
+    tellpos = gztell(f->filegz);
+    error = tellpos < 0 || gzseek(f->filegz, *n, SEEK_CUR) != tellpos + *n;
+  } else
 #endif
-    nb = fread(*buf, 1, *n, f->file);
-  if (nb!=*n)
+  {
+    tellpos = ftell(f->file);
+    error = tellpos < 0 || fseek(f->file, *n, SEEK_CUR) != 0;
+  }
+  if (error)
     mcpl_error(errmsg);
+  *pos = (uint64_t)tellpos;
 }
 
 void mcpl_read_string(mcpl_fileinternal_t* f, char ** dest, const char* errmsg)
@@ -902,6 +3517,8 @@ void mcpl_read_string(mcpl_fileinternal_t* f, char ** dest, const char* errmsg)
     nb = fread(&n, 1, sizeof(n), f->file);
   if (nb!=sizeof(n))
     mcpl_error(errmsg);
+  if (f->byteswap)
+    n = mcpl_internal_bswap32(n);
   char * s = (char*)calloc(n+1,1);
 #ifdef MCPL_HASZLIB
   if (f->filegz)
@@ -915,7 +3532,105 @@ void mcpl_read_string(mcpl_fileinternal_t* f, char ** dest, const char* errmsg)
   *dest = s;
 }
 
-mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
+void mcpl_internal_init_layout(mcpl_fileinternal_t* f)
+{
+  //Byte offsets of the fields in the packed particle data:
+  mcpl_layout_t * l = &f->layout;
+  int fp = f->opt_singleprec ? sizeof(float) : sizeof(double);
+  int offset = 0;
+  l->format_version = f->format_version;
+  l->particle_size = f->particle_size;
+  l->fpsize = fp;
+  l->offset_polarisation = f->opt_polarisation ? offset : -1;
+  offset += f->opt_polarisation ? 3 * fp : 0;
+  l->offset_position = offset;
+  offset += 3 * fp;
+  l->offset_packed_ekindir = offset;
+  offset += 3 * fp;
+  l->offset_time = offset;
+  offset += fp;
+  l->offset_weight = f->opt_universalweight ? -1 : offset;
+  offset += f->opt_universalweight ? 0 : fp;
+  l->offset_pdgcode = f->opt_universalpdgcode ? -1 : offset;
+  offset += f->opt_universalpdgcode ? 0 : (int)sizeof(int32_t);
+  l->offset_userflags = f->opt_userflags ? offset : -1;
+  offset += f->opt_userflags ? (int)sizeof(uint32_t) : 0;
+  if ( (unsigned)offset != f->particle_size )
+    mcpl_error("File has particle size which is inconsistent with the enabled options");
+}
+
+void mcpl_internal_read_blobsection(mcpl_fileinternal_t* f)
+{
+  //Read the blob keys and locate the blob data, after which the particle data
+  //starts. For files opened with mcpl_open_header, this is postponed until
+  //needed, since it requires decompression of all blob data in .gz files:
+  const char * errmsg = "Errors encountered while attempting to read header";
+  assert(f->hdr_partial);
+  int64_t tellpos;
+  int error = 0;
+#ifdef MCPL_HASZLIB
+  if (f->filegz) {
+    tellpos = gztell(f->filegz);
+    if ( tellpos != (int64_t)f->blobsection_pos )
+      error = gzseek(f->filegz, f->blobsection_pos, SEEK_SET) != (int64_t)f->blobsection_pos;
+  } else
+#endif
+  {
+    tellpos = ftell(f->file);
+    if ( tellpos != (int64_t)f->blobsection_pos )
+      error = fseek(f->file, f->blobsection_pos, SEEK_SET) != 0;
+  }
+  if (error)
+    mcpl_error(errmsg);
+  if (f->nblobs) {
+    f->blobs = (char **)calloc(f->nblobs,sizeof(char*));
+    f->blobkeys = (char **)calloc(f->nblobs,sizeof(char*));
+    f->bloblengths = (uint32_t *)calloc(f->nblobs,sizeof(uint32_t));
+    f->blob_pos = (uint64_t *)calloc(f->nblobs,sizeof(uint64_t));
+    uint32_t i;
+    for (i =0; i < f->nblobs; ++i)
+      mcpl_read_string(f,&(f->blobkeys[i]),errmsg);
+    for (i =0; i < f->nblobs; ++i)
+      mcpl_skip_buffer(f, &(f->bloblengths[i]), &(f->blob_pos[i]), errmsg);
+  }
+#ifdef MCPL_HASZLIB
+  if (f->filegz)
+    tellpos = gztell(f->filegz);
+  else
+#endif
+    tellpos = ftell(f->file);
+  if (tellpos<0)
+    mcpl_error(errmsg);
+  f->first_particle_pos = tellpos;
+  f->hdr_partial = 0;
+}
+
+int mcpl_internal_has_zero_record(FILE * fh, uint64_t pos, uint64_t n, unsigned psize)
+{
+  //Check if any of n particle records starting at pos consists entirely of
+  //zero bytes (which is not expected for particles actually written, but is for
+  //example what space reserved in a file without data reads as):
+  uint64_t nbuf = 65536 / psize + 1;
+  char * buf = (char*)malloc(nbuf * psize);
+  if (!buf)
+    mcpl_error("Unable to allocate buffer");
+  int found = fseek(fh, pos, SEEK_SET) != 0;
+  while ( n && !found ) {
+    uint64_t nread = fread(buf, psize, n < nbuf ? n : nbuf, fh);
+    if (!nread)
+      break;
+    uint64_t i;
+    for (i = 0; i < nread && !found; ++i) {
+      const char * rec = buf + i * psize;
+      found = !rec[0] && !memcmp(rec, rec + 1, psize - 1);
+    }
+    n -= nread;
+  }
+  free(buf);
+  return found;
+}
+
+mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status, int header_only)
 {
   int caller_is_mcpl_repair = *repair_status;
   *repair_status = 0;//file not broken
@@ -940,6 +3655,11 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
     f->filegz = gzopen(filename,"rb");
     if (!f->filegz)
       mcpl_error("Unable to open file!");
+#  if ZLIB_VERNUM >= 0x1240
+    //When only reading the header, use a small buffer to avoid decompressing
+    //more than needed:
+    gzbuffer(f->filegz, header_only ? MCPLIMP_GZBUFFER_HEADER_SIZE : MCPLIMP_GZBUFFER_SIZE);
+#  endif
 #else
     mcpl_error("This installation of MCPL was not built with zlib support and can not read compressed (.gz) files directly.");
 #endif
@@ -965,15 +3685,13 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
   f->format_version = (start[4]-'0')*100 + (start[5]-'0')*10 + (start[6]-'0');
   if (f->format_version!=2&&f->format_version!=3)
     mcpl_error("File is in an unsupported MCPL version!");
-  f->is_little_endian = mcpl_platform_is_little_endian();
-  if (start[7]!=(f->is_little_endian?'L':'B')) {
-    if (start[7]=='L'||start[7]=='B')
-      mcpl_error("Endian-ness of current platform is different than the one used to write the file.");
-    else
-      mcpl_error("Unexpected value in endianness field!");
-  }
+  if (start[7]!='L'&&start[7]!='B')
+    mcpl_error("Unexpected value in endianness field!");
+  f->is_little_endian = ( start[7]=='L' );
+  //Data from files with foreign endianness is byte swapped after being read:
+  int swap_endian = ( f->is_little_endian != mcpl_platform_is_little_endian() );
 
-  //proceed reading header, knowing we have a consistent version and endian-ness.
+  //proceed reading header, knowing we have a consistent version.
   const char * errmsg = "Errors encountered while attempting to read header";
 
   uint64_t np;
@@ -985,7 +3703,7 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
     nb = fread(&np, 1, sizeof(np), f->file);
   if (nb!=sizeof(np))
     mcpl_error(errmsg);
-  f->nparticles = np;
+  f->nparticles = ( swap_endian ? mcpl_internal_bswap64(np) : np );
 
   uint32_t arr[8];
   assert(sizeof(arr)==32);
@@ -997,6 +3715,11 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
     nb=fread(arr, 1, sizeof(arr), f->file);
   if (nb!=sizeof(arr))
     mcpl_error(errmsg);
+  if (swap_endian) {
+    unsigned iarr;
+    for (iarr = 0; iarr < 8; ++iarr)
+      arr[iarr] = mcpl_internal_bswap32(arr[iarr]);
+  }
 
   f->ncomments = arr[0];
   f->nblobs = arr[1];
@@ -1018,6 +3741,12 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
     assert(nb==sizeof(f->opt_universalweight));
     if (nb!=sizeof(f->opt_universalweight))
       mcpl_error(errmsg);
+    if (swap_endian) {
+      uint64_t w;
+      memcpy(&w, &f->opt_universalweight, sizeof(w));
+      w = mcpl_internal_bswap64(w);
+      memcpy(&f->opt_universalweight, &w, sizeof(w));
+    }
   }
 
   f->opt_signature = 0
@@ -1026,30 +3755,40 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
     + 4 * f->opt_universalpdgcode
     + 8 * (f->opt_universalweight?1:0)
     + 16 * f->opt_userflags;
+  mcpl_internal_init_layout(f);
+  unsigned layout_index = MCPLIMP_LAYOUT_INDEX(f->opt_singleprec, f->opt_polarisation,
+                                               f->opt_universalpdgcode, f->opt_universalweight,
+                                               f->opt_userflags);
+  f->unpack_fields = mcpl_internal_unpack_fields_fcts[layout_index];
+  f->unpack = ( f->format_version==2 ? mcpl_internal_unpack_v2_fcts
+                : mcpl_internal_unpack_v3_fcts )[layout_index];
+  if (swap_endian) {
+    //Any integer fields follow the floating point fields:
+    int offset_int = ( f->layout.offset_pdgcode >= 0 ? f->layout.offset_pdgcode
+                       : ( f->layout.offset_userflags >= 0 ? f->layout.offset_userflags
+                           : (int)f->particle_size ) );
+    f->byteswap = mcpl_internal_byteswap_create(f->particle_size, f->opt_singleprec ? 0 : offset_int);
+  }
 
-  //Then some strings:
+  //Then some strings. Comments and blob data (which can be large) are only
+  //located here, and not loaded until requested:
   mcpl_read_string(f,&f->hdr_srcprogname,errmsg);
-  f->comments = f->ncomments ? (char **)calloc(f->ncomments,sizeof(char*)) : 0;
+  f->comments = 0;
+  f->comment_pos = 0;
+  f->comment_lengths = 0;
   uint32_t i;
-  for (i = 0; i < f->ncomments; ++i)
-    mcpl_read_string(f,&(f->comments[i]),errmsg);
-
-  f->blobkeys = 0;
-  f->bloblengths = 0;
-  f->blobs = 0;
-  if (f->nblobs) {
-    f->blobs = (char **)calloc(f->nblobs,sizeof(char*));
-    f->blobkeys = (char **)calloc(f->nblobs,sizeof(char*));
-    f->bloblengths = (uint32_t *)calloc(f->nblobs,sizeof(uint32_t));
-    for (i =0; i < f->nblobs; ++i)
-      mcpl_read_string(f,&(f->blobkeys[i]),errmsg);
-    for (i =0; i < f->nblobs; ++i)
-      mcpl_read_buffer(f, &(f->bloblengths[i]), &(f->blobs[i]), errmsg);
+  if (f->ncomments) {
+    f->comments = (char **)calloc(f->ncomments,sizeof(char*));
+    f->comment_pos = (uint64_t *)calloc(f->ncomments,sizeof(uint64_t));
+    f->comment_lengths = (uint32_t *)calloc(f->ncomments,sizeof(uint32_t));
+    for (i = 0; i < f->ncomments; ++i)
+      mcpl_skip_buffer(f, &(f->comment_lengths[i]), &(f->comment_pos[i]), errmsg);
   }
-  f->particle = (mcpl_particle_t*)calloc(sizeof(mcpl_particle_t),1);
 
-  //At first event now:
-  f->current_particle_idx = 0;
+  f->blobkeys = 0;
+  f->bloblengths = 0;
+  f->blobs = 0;
+  f->blob_pos = 0;
   int64_t tellpos = -1;
 #ifdef MCPL_HASZLIB
   if (f->filegz)
@@ -1059,7 +3798,27 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
     tellpos = ftell(f->file);
   if (tellpos<0)
     mcpl_error(errmsg);
-  f->first_particle_pos = tellpos;
+  f->blobsection_pos = tellpos;
+  f->hdr_partial = 1;
+  f->header_only = header_only;
+  f->pread_fd = -1;
+  f->range_begin = 0;
+  f->range_end = f->nparticles;
+  if ( header_only && f->nparticles && !caller_is_mcpl_repair ) {
+    //Nothing more to do for now:
+    out.internal = f;
+    return out;
+  }
+
+  mcpl_internal_read_blobsection(f);
+  if (!header_only) {
+    f->particle = (mcpl_particle_t*)calloc(sizeof(mcpl_particle_t),1);
+    f->last_particle_raw = f->particle_buffer;
+    f->readbuf_size = MCPLIMP_READBUF_DEFAULT_SIZE;
+  }
+
+  //At first event now:
+  f->current_particle_idx = 0;
 
   if ( f->nparticles==0 || caller_is_mcpl_repair ) {
     //Although empty files are permitted, it is possible that the file was never
@@ -1096,11 +3855,15 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
         if (endpos > (int64_t)f->first_particle_pos && (uint64_t)endpos != f->first_particle_pos) {
           uint64_t np = ( endpos - f->first_particle_pos ) / f->particle_size;
           if ( f->nparticles != np ) {
-            if ( f->nparticles > 0 && np > f->nparticles ) {
-              //should really not happen unless file was corrupted or file was
-              //first closed properly and then something was appended to it.
+            //(with non-zero nparticles, only mcpl_repair gets here, e.g. for
+            //files which were truncated after being closed, or which were
+            //written with checkpoints but never closed. In the latter case the
+            //data after the last checkpoint must consist of actual particles,
+            //otherwise the file was corrupted or something else was appended)
+            if ( f->nparticles > 0 && np > f->nparticles
+                 && mcpl_internal_has_zero_record(f->file, f->first_particle_pos + f->nparticles * f->particle_size,
+                                                  np - f->nparticles, f->particle_size) )
               mcpl_error("Input file has invalid combination of meta-data & filesize.");
-            }
             if (caller_is_mcpl_repair) {
               *repair_status = 3;//file broken and should be able to repair
             } else {
@@ -1114,22 +3877,175 @@ mcpl_file_t mcpl_actual_open_file(const char * filename, int * repair_status)
       fseek( f->file, f->first_particle_pos, SEEK_SET );//if this fseek failed, it might just be that we are at EOF with no particles.
     }
   }
+  f->range_end = f->nparticles;
 
   out.internal = f;
   return out;
 }
 
+
+#ifdef MCPLIMP_HAS_MMAP
+void mcpl_internal_mmap_willneed(mcpl_fileinternal_t* f)
+{
+  //Hint that the particles following the current position will be needed soon
+  //(typically after a seek):
+  if (!f->mmap_data || f->current_particle_idx >= f->range_end)
+    return;
+  uint64_t pagesize = (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t begin = f->first_particle_pos + f->current_particle_idx * f->particle_size;
+  uint64_t end = begin + (uint64_t)MCPLIMP_READBLOCK_NPARTICLES * f->particle_size;
+  if (end > f->mmap_size)
+    end = f->mmap_size;
+  begin -= begin % pagesize;
+  posix_madvise(f->mmap_data + begin, end - begin, POSIX_MADV_WILLNEED);
+}
+#endif
+
+void mcpl_internal_mmap_file(mcpl_fileinternal_t* f)
+{
+#ifdef MCPLIMP_HAS_MMAP
+  if (!f->file || !f->nparticles || f->byteswap)
+    return;//gzipped, empty or byte swapped: keep using standard I/O
+  //Only map the file if it actually contains all particles (if not, we leave
+  //it to the standard I/O code to emit errors when reaching the missing data):
+  uint64_t mapsize = f->first_particle_pos + f->nparticles * f->particle_size;
+  int fd = fileno(f->file);
+  struct stat st;
+  if ( fd < 0 || fstat(fd, &st) != 0 || (uint64_t)st.st_size < mapsize
+       || (uint64_t)(size_t)mapsize != mapsize )
+    return;
+  void * addr = mmap(0, (size_t)mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED)
+    return;
+  f->mmap_data = (char*)addr;
+  f->mmap_size = mapsize;
+  posix_madvise(f->mmap_data, (size_t)mapsize, POSIX_MADV_SEQUENTIAL);
+  mcpl_internal_mmap_willneed(f);
+  //The mapping stays valid after the file is closed:
+  fclose(f->file);
+  f->file = 0;
+#else
+  (void)f;
+#endif
+}
+
+mcpl_file_t mcpl_open_file_flags(const char * filename, unsigned flags)
+{
+  if (flags & ~(MCPL_OPEN_MMAP|MCPL_OPEN_READAHEAD))
+    mcpl_error("mcpl_open_file_flags called with unsupported flags");
+  int repair_status = 0;
+  mcpl_file_t out = mcpl_actual_open_file(filename,&repair_status,0);
+  mcpl_fileinternal_t * f = (mcpl_fileinternal_t *)out.internal;
+  if (flags & MCPL_OPEN_MMAP)
+    mcpl_internal_mmap_file(f);
+#ifdef MCPLIMP_HAS_IO_URING
+  if ( f->file && !f->mmap_data && f->nparticles )
+    f->uring = mcpl_internal_uring_create(fileno(f->file),0);
+#endif
+#ifdef MCPLIMP_HAS_THREADS
+  if ( (flags & MCPL_OPEN_READAHEAD) && !f->mmap_data && !f->uring && f->nparticles )
+    mcpl_internal_readahead_start(f);
+#endif
+  return out;
+}
+
 mcpl_file_t mcpl_open_file(const char * filename)
+{
+  return mcpl_open_file_flags(filename,0);
+}
+
+mcpl_file_t mcpl_open_file_mmap(const char * filename)
+{
+  return mcpl_open_file_flags(filename,MCPL_OPEN_MMAP);
+}
+
+mcpl_file_t mcpl_open_header(const char * filename)
 {
   int repair_status = 0;
-  return mcpl_actual_open_file(filename,&repair_status);
+  return mcpl_actual_open_file(filename,&repair_status,1);
+}
+
+typedef struct {
+  unsigned nfiles;
+  const char ** filenames;
+  void (*callback)(mcpl_file_t, unsigned, void *);
+  void * userdata;
+  unsigned next;//index of next file to process
+#ifdef MCPLIMP_HAS_THREADS
+  pthread_mutex_t mutex;
+#endif
+} mcpl_internal_scan_t;
+
+void * mcpl_internal_scan_worker(void * arg)
+{
+  mcpl_internal_scan_t * s = (mcpl_internal_scan_t*)arg;
+  while (1) {
+#ifdef MCPLIMP_HAS_THREADS
+    pthread_mutex_lock(&s->mutex);
+#endif
+    unsigned i = s->next;
+    if (i < s->nfiles)
+      ++s->next;
+#ifdef MCPLIMP_HAS_THREADS
+    pthread_mutex_unlock(&s->mutex);
+#endif
+    if (i >= s->nfiles)
+      break;
+    mcpl_file_t f = mcpl_open_header(s->filenames[i]);
+    s->callback(f, i, s->userdata);
+    mcpl_close_file(f);
+  }
+  return 0;
+}
+
+void mcpl_scan_headers(unsigned nfiles, const char ** filenames, unsigned nthreads,
+                       void (*callback)(mcpl_file_t, unsigned, void *), void * userdata)
+{
+  mcpl_internal_scan_t s;
+  s.nfiles = nfiles;
+  s.filenames = filenames;
+  s.callback = callback;
+  s.userdata = userdata;
+  s.next = 0;
+#ifdef MCPLIMP_HAS_THREADS
+  if (!nthreads)
+    nthreads = mcpl_internal_ncpu();
+  if (nthreads > nfiles)
+    nthreads = nfiles;
+  if (nthreads > 1) {
+    //The calling thread acts as one of the workers:
+    pthread_t * threads = (pthread_t*)malloc(sizeof(pthread_t)*(nthreads-1));
+    if (!threads)
+      mcpl_error("Unable to allocate memory for threads");
+    pthread_mutex_init(&s.mutex, 0);
+    unsigned i, nstarted = 0;
+    for (i = 0; i + 1 < nthreads; ++i) {
+      if (pthread_create(&threads[nstarted], 0, mcpl_internal_scan_worker, &s) != 0)
+        break;//fine, simply proceed with fewer threads
+      ++nstarted;
+    }
+    mcpl_internal_scan_worker(&s);
+    for (i = 0; i < nstarted; ++i)
+      pthread_join(threads[i], 0);
+    pthread_mutex_destroy(&s.mutex);
+    free(threads);
+    return;
+  }
+  pthread_mutex_init(&s.mutex, 0);
+  mcpl_internal_scan_worker(&s);
+  pthread_mutex_destroy(&s.mutex);
+#else
+  (void)nthreads;
+  mcpl_internal_scan_worker(&s);
+#endif
 }
 
 void mcpl_repair(const char * filename)
 {
   int repair_status = 1;
-  mcpl_file_t f = mcpl_actual_open_file(filename,&repair_status);
+  mcpl_file_t f = mcpl_actual_open_file(filename,&repair_status,0);
   uint64_t nparticles = mcpl_hdr_nparticles(f);
+  int foreign_endian = ( mcpl_hdr_little_endian(f) != mcpl_platform_is_little_endian() );
   mcpl_close_file(f);
   if (repair_status==0) {
     mcpl_error("File does not appear to be broken.");
@@ -1138,6 +4054,8 @@ void mcpl_repair(const char * filename)
   } else if (repair_status==2) {
     mcpl_error("File must be gunzipped before it can be checked and possibly repaired.");
   }
+  if (foreign_endian)
+    mcpl_error("Files with foreign endianness can not be repaired on this platform.");
   //Ok, we should repair the file by updating nparticles in the header:
   FILE * fh = fopen(filename,"rb+");
   if (!fh)
@@ -1146,7 +4064,7 @@ void mcpl_repair(const char * filename)
   fclose(fh);
   //Verify that we fixed it:
   repair_status = 1;
-  f = mcpl_actual_open_file(filename,&repair_status);
+  f = mcpl_actual_open_file(filename,&repair_status,0);
   uint64_t nparticles2 = mcpl_hdr_nparticles(f);
   mcpl_close_file(f);
   if (repair_status==0&&nparticles==nparticles2) {
@@ -1160,28 +4078,158 @@ void mcpl_close_file(mcpl_file_t ff)
 {
   MCPLIMP_FILEDECODE;
 
+#ifdef MCPLIMP_HAS_THREADS
+  if (f->readahead)
+    mcpl_internal_readahead_stop(f);
+#endif
+#ifdef MCPLIMP_HAS_IO_URING
+  if (f->uring) {
+    mcpl_internal_uring_destroy(f->uring);
+    f->uring = 0;
+    f->readbuf = 0;//was owned by f->uring
+  }
+#endif
+  if (f->shared) {
+    //cursor, only free what is not owned by the shared file:
+    free(f->particle);
+    free(f->readbuf);
+#ifdef MCPL_HASZLIB
+    if (f->filegz)
+      gzclose(f->filegz);
+#endif
+    if (f->file)
+      fclose(f->file);
+    free(f);
+    return;
+  }
+
+  mcpl_internal_hdrlock_destroy(f->hdrlock);
   free(f->hdr_srcprogname);
   uint32_t i;
   for (i = 0; i < f->ncomments; ++i)
     free(f->comments[i]);
   free(f->comments);
-  for (i = 0; i < f->nblobs; ++i)
-    free(f->blobkeys[i]);
-  for (i = 0; i < f->nblobs; ++i)
-    free(f->blobs[i]);
+  free(f->comment_pos);
+  free(f->comment_lengths);
+  if (f->blobkeys) {
+    //(not allocated if opened with mcpl_open_header and never accessed)
+    for (i = 0; i < f->nblobs; ++i)
+      free(f->blobkeys[i]);
+    for (i = 0; i < f->nblobs; ++i)
+      free(f->blobs[i]);
+  }
   free(f->blobkeys);
   free(f->blobs);
   free(f->bloblengths);
+  free(f->blob_pos);
   free(f->particle);
+  free(f->readbuf);
+  if (f->byteswap)
+    mcpl_internal_byteswap_destroy(f->byteswap);
+#ifdef MCPLIMP_HAS_MMAP
+  if (f->mmap_data)
+    munmap(f->mmap_data, (size_t)f->mmap_size);
+#endif
 #ifdef MCPL_HASZLIB
   if (f->filegz)
     gzclose(f->filegz);
 #endif
   if (f->file)
     fclose(f->file);
+  free(f->filename);
   free(f);
 }
 
+mcpl_shared_file_t mcpl_open_shared_file(const char * filename)
+{
+  mcpl_file_t ff = mcpl_open_file(filename);
+  MCPLIMP_FILEDECODE;
+  //Comments and blobs are still loaded on demand, from the file handle of the
+  //shared file while holding its lock. Without threads, no lock can be created,
+  //so they are loaded now instead:
+  f->hdrlock = mcpl_internal_hdrlock_create();
+  if (!f->hdrlock) {
+    uint32_t i;
+    for (i = 0; i < f->ncomments; ++i)
+      mcpl_hdr_comment(ff,i);
+    for (i = 0; i < f->nblobs; ++i) {
+      uint32_t ldata;
+      const char * data;
+      mcpl_hdr_blob(ff,f->blobkeys[i],&ldata,&data);
+    }
+  }
+  f->filename = (char*)malloc(strlen(filename)+1);
+  strcpy(f->filename,filename);
+  mcpl_shared_file_t out;
+  out.internal = f;
+  return out;
+}
+
+mcpl_file_t mcpl_shared_file_cursor(mcpl_shared_file_t sf)
+{
+  mcpl_fileinternal_t * fs = (mcpl_fileinternal_t *)sf.internal; assert(fs);
+  mcpl_fileinternal_t * f = (mcpl_fileinternal_t*)malloc(sizeof(mcpl_fileinternal_t));
+  assert(f);
+  //Start from a copy of the shared file (pointing to the header data owned by
+  //it), and reset all state related to reading particles:
+  memcpy(f, fs, sizeof(mcpl_fileinternal_t));
+  f->shared = fs;
+  f->file = 0;
+  f->filegz = 0;
+  f->filename = 0;
+  f->particle = (mcpl_particle_t*)calloc(sizeof(mcpl_particle_t),1);
+  memset(f->particle_buffer, 0, sizeof(f->particle_buffer));
+  f->last_particle_raw = f->particle_buffer;
+  f->particle_outdated = 0;
+  f->current_particle_idx = 0;
+  f->readbuf = 0;
+  f->readbuf_begin = 0;
+  f->readbuf_count = 0;
+  f->readbuf_nextfill = 0;
+  f->readbuf_capacity = 0;
+  f->file_idx = (uint64_t)-1;//unknown, seek before reading
+  f->pread_fd = -1;
+  f->readahead = 0;
+  f->uring = 0;
+  f->range_begin = 0;
+  f->range_end = f->nparticles;
+
+  //Data of uncompressed files are read directly from the shared file via pread
+  //where available, otherwise the cursor must open the file again:
+#ifdef MCPLIMP_HAS_PREAD
+  if (fs->file)
+    f->pread_fd = fileno(fs->file);
+  if (f->pread_fd < 0)
+#endif
+  {
+#ifdef MCPL_HASZLIB
+    if (fs->filegz) {
+      f->filegz = gzopen(fs->filename,"rb");
+      if (!f->filegz)
+        mcpl_error("Unable to open file!");
+#  if ZLIB_VERNUM >= 0x1240
+      gzbuffer(f->filegz, MCPLIMP_GZBUFFER_SIZE);
+#  endif
+    } else
+#endif
+    {
+      f->file = fopen(fs->filename,"rb");
+      if (!f->file)
+        mcpl_error("Unable to open file!");
+    }
+  }
+  mcpl_file_t out;
+  out.internal = f;
+  return out;
+}
+
+void mcpl_close_shared_file(mcpl_shared_file_t sf)
+{
+  mcpl_file_t ff;
+  ff.internal = sf.internal;
+  mcpl_close_file(ff);
+}
+
 
 unsigned mcpl_hdr_version(mcpl_file_t ff)
 {
@@ -1201,12 +4249,61 @@ unsigned mcpl_hdr_ncomments(mcpl_file_t ff)
   return f->ncomments;
 }
 
+char * mcpl_internal_load_hdr_data(mcpl_fileinternal_t* f, uint64_t pos, uint32_t n)
+{
+  //Load n bytes of comment or blob data at pos in the file into a new null
+  //terminated buffer, without affecting the reading of particles:
+  const char * errmsg = "Errors encountered while attempting to read header data.";
+  char * buf = (char*)malloc((size_t)n+1);
+  if (!buf)
+    mcpl_error("Unable to allocate memory for header data");
+  buf[n] = '\0';
+  if (f->mmap_data) {
+    memcpy(buf, f->mmap_data + pos, n);
+    return buf;
+  }
+#ifdef MCPLIMP_HAS_PREAD
+  if ( f->file && fileno(f->file) >= 0 ) {
+    if (mcpl_internal_pread(fileno(f->file), buf, n, pos) != n)
+      mcpl_error(errmsg);
+    return buf;
+  }
+#endif
+#ifdef MCPLIMP_HAS_THREADS
+  if (f->readahead)
+    mcpl_internal_readahead_wait(f);
+#endif
+  size_t nb;
+#ifdef MCPL_HASZLIB
+  if (f->filegz) {
+    if ( gzseek(f->filegz, pos, SEEK_SET) != (int64_t)pos )
+      mcpl_error(errmsg);
+    nb = gzread(f->filegz, buf, n);
+  } else
+#endif
+  {
+    if ( fseek(f->file, pos, SEEK_SET) != 0 )
+      mcpl_error(errmsg);
+    nb = fread(buf, 1, n, f->file);
+  }
+  if (nb != n)
+    mcpl_error(errmsg);
+  f->file_idx = (uint64_t)-1;//seek before reading particles again
+  return buf;
+}
+
 const char * mcpl_hdr_comment(mcpl_file_t ff, unsigned i)
 {
   MCPLIMP_FILEDECODE;
   if (i>=f->ncomments)
     mcpl_error("Invalid comment requested (index out of bounds)");
-  return f->comments[i];
+  mcpl_fileinternal_t * fh = ( f->shared ? f->shared : f );//owner of header data
+  mcpl_internal_hdrlock_lock(fh->hdrlock);
+  if (!fh->comments[i])
+    fh->comments[i] = mcpl_internal_load_hdr_data(fh, fh->comment_pos[i], fh->comment_lengths[i]);
+  const char * comment = fh->comments[i];
+  mcpl_internal_hdrlock_unlock(fh->hdrlock);
+  return comment;
 }
 
 int mcpl_hdr_nblobs(mcpl_file_t ff)
@@ -1218,6 +4315,8 @@ int mcpl_hdr_nblobs(mcpl_file_t ff)
 const char** mcpl_hdr_blobkeys(mcpl_file_t ff)
 {
   MCPLIMP_FILEDECODE;
+  if (f->hdr_partial)
+    mcpl_internal_read_blobsection(f);
   return (const char**)f->blobkeys;
 }
 
@@ -1225,222 +4324,866 @@ int mcpl_hdr_blob(mcpl_file_t ff, const char* key,
                   uint32_t* ldata, const char ** data)
 {
   MCPLIMP_FILEDECODE;
+  if (f->hdr_partial)
+    mcpl_internal_read_blobsection(f);
   uint32_t i;
   for (i = 0; i < f->nblobs; ++i) {
     if (strcmp(f->blobkeys[i],key)==0) {
-      *data = f->blobs[i];
+      if (f->mmap_data) {
+        //point directly into the memory mapped file:
+        *data = f->mmap_data + f->blob_pos[i];
+      } else {
+        mcpl_fileinternal_t * fh = ( f->shared ? f->shared : f );//owner of header data
+        mcpl_internal_hdrlock_lock(fh->hdrlock);
+        if (!fh->blobs[i])
+          fh->blobs[i] = mcpl_internal_load_hdr_data(fh, fh->blob_pos[i], fh->bloblengths[i]);
+        *data = fh->blobs[i];
+        mcpl_internal_hdrlock_unlock(fh->hdrlock);
+      }
       *ldata = f->bloblengths[i];
       return 1;
     }
   }
-  *data = 0;
-  *ldata = 0;
-  return 0;
+  *data = 0;
+  *ldata = 0;
+  return 0;
+}
+
+uint32_t mcpl_internal_hdr_bloblength(mcpl_file_t ff, uint32_t i)
+{
+  //Length of the data of blob i, without loading it:
+  MCPLIMP_FILEDECODE;
+  if (f->hdr_partial)
+    mcpl_internal_read_blobsection(f);
+  assert(i < f->nblobs);
+  return f->bloblengths[i];
+}
+
+const char * mcpl_internal_blob_data(mcpl_fileinternal_t * f, uint32_t i,
+                                     uint32_t offset, uint32_t n, char ** tmpbuf)
+{
+  //Access n bytes at offset in the data of blob i (the blob section must have
+  //been read). Data already in memory is used directly, otherwise it is read
+  //into a new buffer which is not kept, but returned in *tmpbuf for the caller
+  //to free. This avoids holding large blobs in memory when only passing through:
+  *tmpbuf = 0;
+  if (f->mmap_data)
+    return f->mmap_data + f->blob_pos[i] + offset;
+  mcpl_fileinternal_t * fh = ( f->shared ? f->shared : f );//owner of header data
+  mcpl_internal_hdrlock_lock(fh->hdrlock);
+  const char * data = fh->blobs[i];
+  if (data)
+    data += offset;
+  else
+    data = *tmpbuf = mcpl_internal_load_hdr_data(fh, fh->blob_pos[i] + offset, n);
+  mcpl_internal_hdrlock_unlock(fh->hdrlock);
+  return data;
+}
+
+int mcpl_internal_blobs_equal(mcpl_fileinternal_t * f1, mcpl_fileinternal_t * f2, uint32_t i)
+{
+  //Compare the data of blob i in two files (with equal lengths), chunk by
+  //chunk so large blobs are never completely loaded for this:
+  const uint32_t nchunkmax = 1048576;
+  uint32_t n = f1->bloblengths[i];
+  assert(n == f2->bloblengths[i]);
+  uint32_t offset = 0;
+  int equal = 1;
+  while ( equal && offset < n ) {
+    uint32_t nchunk = ( n - offset < nchunkmax ? n - offset : nchunkmax );
+    char * tmp1;
+    char * tmp2;
+    const char * data1 = mcpl_internal_blob_data(f1, i, offset, nchunk, &tmp1);
+    const char * data2 = mcpl_internal_blob_data(f2, i, offset, nchunk, &tmp2);
+    equal = ( memcmp(data1, data2, nchunk) == 0 );
+    free(tmp1);
+    free(tmp2);
+    offset += nchunk;
+  }
+  return equal;
+}
+
+void mcpl_transfer_metadata(mcpl_file_t source, mcpl_outfile_t target)
+{
+  //Note that MCPL format version 2 and 3 have the same meta-data in the header,
+  //except of course the version number itself.
+
+  mcpl_hdr_set_srcname(target,mcpl_hdr_srcname(source));
+  unsigned i;
+  for (i = 0; i < mcpl_hdr_ncomments(source); ++i)
+    mcpl_hdr_add_comment(target,mcpl_hdr_comment(source,i));
+  const char** blobkeys = mcpl_hdr_blobkeys(source);
+  if (blobkeys) {
+    //Blob data not already in memory is not kept in the source, but handed
+    //over to the target directly:
+    mcpl_fileinternal_t * fs = (mcpl_fileinternal_t *)source.internal;
+    uint32_t ii;
+    for (ii = 0; ii < fs->nblobs; ++ii) {
+      char * tmp;
+      const char * data = mcpl_internal_blob_data(fs, ii, 0, fs->bloblengths[ii], &tmp);
+      if (tmp)
+        mcpl_internal_hdr_add_data_owned(target, blobkeys[ii], fs->bloblengths[ii], tmp);
+      else
+        mcpl_hdr_add_data(target, blobkeys[ii], fs->bloblengths[ii], data);
+    }
+  }
+  if (mcpl_hdr_has_userflags(source))
+    mcpl_enable_userflags(target);
+  if (mcpl_hdr_has_polarisation(source))
+    mcpl_enable_polarisation(target);
+  if (mcpl_hdr_has_doubleprec(source))
+    mcpl_enable_doubleprec(target);
+  int32_t updg = mcpl_hdr_universal_pdgcode(source);
+  if (updg)
+    mcpl_enable_universal_pdgcode(target,updg);
+  double uw = mcpl_hdr_universal_weight(source);
+  if (uw)
+    mcpl_enable_universal_weight(target,uw);
+}
+
+const char* mcpl_hdr_srcname(mcpl_file_t ff)
+{
+  MCPLIMP_FILEDECODE;
+  return f->hdr_srcprogname;
+}
+
+int mcpl_hdr_has_userflags(mcpl_file_t ff)
+{
+  MCPLIMP_FILEDECODE;
+  return f->opt_userflags;
+}
+
+int mcpl_hdr_has_polarisation(mcpl_file_t ff)
+{
+  MCPLIMP_FILEDECODE;
+  return f->opt_polarisation;
+}
+
+int mcpl_hdr_has_doubleprec(mcpl_file_t ff)
+{
+  MCPLIMP_FILEDECODE;
+  return !f->opt_singleprec;
+}
+
+#ifdef MCPLIMP_HAS_IO_URING
+void mcpl_internal_uring_refill_readbuf(mcpl_fileinternal_t* f)
+{
+  //As mcpl_internal_refill_readbuf, but for files read via io_uring, where the
+  //read buffer is provided by one of the slots. After jumping to a new location
+  //(or initially) only a small amount is read. Once reading is found to proceed
+  //sequentially, requests for the following particles are kept in flight in all
+  //other slots:
+  mcpl_internal_uring_t * u = f->uring;
+  unsigned lbuf = f->particle_size;
+  uint64_t idx = f->current_particle_idx;
+  assert(idx < f->range_end);
+  int sequential = ( f->readbuf_count && idx == f->readbuf_begin + f->readbuf_count );
+  if (!u->slot_size) {
+    uint64_t n = f->readbuf_size / lbuf / MCPLIMP_URING_NSLOTS;
+    if (n > f->range_end - f->range_begin)
+      n = f->range_end - f->range_begin;
+    if (!n)
+      n = 1;
+    mcpl_internal_uring_alloc_slots(u, n * lbuf);
+  }
+  uint64_t nslot = u->slot_size / lbuf;
+
+  //The slot currently providing the read buffer is no longer needed:
+  if (u->current >= 0)
+    u->slots[u->current].state = MCPLIMP_URING_SLOT_FREE;
+  u->current = -1;
+  f->readbuf = 0;
+  f->readbuf_count = 0;
+
+  //Look for a pending or completed request containing idx:
+  uint64_t pos = f->first_particle_pos + idx * lbuf;
+  int i, islot = -1;
+  for (i = 0; i < MCPLIMP_URING_NSLOTS; ++i) {
+    mcpl_internal_uring_slot_t * s = &u->slots[i];
+    if ( s->state != MCPLIMP_URING_SLOT_FREE && pos >= s->offset && pos < s->offset + s->nbytes )
+      islot = i;
+  }
+  if (islot < 0) {
+    //Discard all requests and read at the new location:
+    mcpl_internal_uring_release_slots(u, 0);
+    uint64_t n = ( sequential ? nslot : MCPLIMP_READBUF_INITIAL_FILL / lbuf );
+    if (!n)
+      n = 1;
+    if (n > nslot)
+      n = nslot;
+    if (n > f->range_end - idx)
+      n = f->range_end - idx;
+    islot = 0;
+    mcpl_internal_uring_submit(u, islot, pos, n * lbuf);
+  } else {
+    //Discard requests for particles preceding those in the slot:
+    sequential = 1;
+    for (i = 0; i < MCPLIMP_URING_NSLOTS; ++i) {
+      if ( u->slots[i].state != MCPLIMP_URING_SLOT_FREE && u->slots[i].offset < u->slots[islot].offset ) {
+        mcpl_internal_uring_wait_slot(u, i);
+        u->slots[i].state = MCPLIMP_URING_SLOT_FREE;
+      }
+    }
+  }
+
+  mcpl_internal_uring_wait_slot(u, islot);
+  mcpl_internal_uring_slot_t * s = &u->slots[islot];
+  if (!s->ok)
+    mcpl_error("Errors encountered while attempting to read particle data.");
+  if (f->byteswap)
+    f->byteswap->swap(f->byteswap, s->buf, s->nbytes / lbuf);
+  u->current = islot;
+  f->readbuf = s->buf;
+  f->readbuf_begin = ( s->offset - f->first_particle_pos ) / lbuf;
+  f->readbuf_count = s->nbytes / lbuf;
+  if (!sequential)
+    return;
+
+  //Keep requests for the following particles in flight in the free slots:
+  uint64_t next = s->offset + s->nbytes;
+  for (i = 0; i < MCPLIMP_URING_NSLOTS; ++i) {
+    if ( u->slots[i].state != MCPLIMP_URING_SLOT_FREE && u->slots[i].offset + u->slots[i].nbytes > next )
+      next = u->slots[i].offset + u->slots[i].nbytes;
+  }
+  uint64_t endpos = f->first_particle_pos + f->range_end * lbuf;
+  for (i = 0; i < MCPLIMP_URING_NSLOTS && next < endpos; ++i) {
+    if (u->slots[i].state != MCPLIMP_URING_SLOT_FREE)
+      continue;
+    uint64_t nb = nslot * lbuf;
+    if (nb > endpos - next)
+      nb = endpos - next;
+    mcpl_internal_uring_submit(u, i, next, nb);
+    next += nb;
+  }
+}
+#endif
+
+void mcpl_internal_refill_readbuf(mcpl_fileinternal_t* f)
+{
+  //Fill the read buffer with particles starting at the current location. After
+  //jumping to a new location (or initially), only a small amount is read, which
+  //is then increased up to the size of the buffer as long as the reading
+  //continues sequentially:
+#ifdef MCPLIMP_HAS_IO_URING
+  if (f->uring) {
+    mcpl_internal_uring_refill_readbuf(f);
+    return;
+  }
+#endif
+  unsigned lbuf = f->particle_size;
+  uint64_t idx = f->current_particle_idx;
+  assert(idx < f->range_end);
+  uint64_t nbuf = f->readbuf_size / lbuf;
+  if (nbuf > f->range_end - f->range_begin)
+    nbuf = f->range_end - f->range_begin;
+  if (!nbuf)
+    nbuf = 1;
+  if (f->readbuf && f->readbuf_capacity < nbuf)
+    mcpl_internal_free_readbuf(f);//range was extended
+  if (!f->readbuf) {
+    f->readbuf = (char*)malloc(nbuf*lbuf);
+    if (!f->readbuf)
+      mcpl_error("Unable to allocate read buffer");
+    f->readbuf_count = 0;
+    f->readbuf_capacity = nbuf;
+  }
+  nbuf = f->readbuf_capacity;
+#ifdef MCPLIMP_HAS_THREADS
+  if (f->readahead && mcpl_internal_readahead_take(f, idx)) {
+    mcpl_internal_readahead_request(f);
+    return;
+  }
+#endif
+  uint64_t ninitial = MCPLIMP_READBUF_INITIAL_FILL / lbuf;
+  if (idx != f->file_idx && f->pread_fd < 0) {
+    int error;
+#ifdef MCPL_HASZLIB
+    if (f->filegz) {
+      int64_t targetpos = idx*lbuf+f->first_particle_pos;
+      error = gzseek( f->filegz, targetpos, SEEK_SET )!=targetpos;
+    } else
+#endif
+      error = fseek( f->file, f->first_particle_pos + lbuf * idx, SEEK_SET )!=0;
+    if (error)
+      mcpl_error("Errors encountered while seeking in particle list");
+    f->file_idx = idx;
+    f->readbuf_nextfill = ninitial;
+  } else if (idx != f->file_idx || !f->readbuf_count) {
+    f->readbuf_nextfill = ninitial;
+  } else {
+    f->readbuf_nextfill *= 2;
+  }
+  if (!f->readbuf_nextfill)
+    f->readbuf_nextfill = 1;
+  if (f->readbuf_nextfill > nbuf)
+    f->readbuf_nextfill = nbuf;
+
+  uint64_t n = f->range_end - idx;
+  if (n > f->readbuf_nextfill)
+    n = f->readbuf_nextfill;
+  if (mcpl_internal_read_particle_data(f, f->readbuf, idx, n) != n*lbuf)
+    mcpl_error("Errors encountered while attempting to read particle data.");
+  f->readbuf_begin = idx;
+  f->readbuf_count = n;
+  f->file_idx = idx + n;
+#ifdef MCPLIMP_HAS_THREADS
+  if (f->readahead)
+    mcpl_internal_readahead_request(f);
+#endif
+}
+
+const char * mcpl_internal_fetch_block(mcpl_fileinternal_t* f, uint64_t nmax, uint64_t* nread)
+{
+  //Provide the packed data of up to nmax particles at the current location and
+  //skip forward past them. Returns pointer to the packed data, which stays valid
+  //until the next read on the file. For memory mapped files, the returned
+  //pointer simply points into the mapped region, otherwise it points into the
+  //internal read buffer (which is refilled when it does not contain the
+  //particle at the current location):
+  *nread = 0;
+  if (f->header_only)
+    mcpl_error("Particles can not be read from files opened with mcpl_open_header");
+  uint64_t idx = f->current_particle_idx;
+  uint64_t nleft = ( idx < f->range_end ? f->range_end - idx : 0 );
+  uint64_t n = nmax < nleft ? nmax : nleft;
+  if (!n)
+    return 0;
+
+  unsigned lbuf = f->particle_size;
+  const char * buf;
+  if (f->mmap_data) {
+    if (n > MCPLIMP_READBLOCK_NPARTICLES)
+      n = MCPLIMP_READBLOCK_NPARTICLES;
+    buf = f->mmap_data + f->first_particle_pos + idx * lbuf;
+  } else {
+    if ( idx < f->readbuf_begin || idx >= f->readbuf_begin + f->readbuf_count )
+      mcpl_internal_refill_readbuf(f);
+    uint64_t navail = f->readbuf_begin + f->readbuf_count - idx;
+    if (n > navail)
+      n = navail;
+    buf = f->readbuf + ( idx - f->readbuf_begin ) * lbuf;
+  }
+
+  //Make sure the last particle is also available to mcpl_transfer_last_read_particle:
+  f->last_particle_raw = buf + (n-1)*lbuf;
+
+  f->current_particle_idx += n;
+  *nread = n;
+  return buf;
+}
+
+void mcpl_set_read_buffer_size(mcpl_file_t ff, uint64_t nbytes)
+{
+  MCPLIMP_FILEDECODE;
+  if (!nbytes)
+    mcpl_error("mcpl_set_read_buffer_size called with zero size");
+  if (f->readbuf) {
+    //Keep the last read particle available to mcpl_transfer_last_read_particle:
+    if (f->last_particle_raw != f->particle_buffer && !f->mmap_data) {
+      memcpy(f->particle_buffer, f->last_particle_raw, f->particle_size);
+      f->last_particle_raw = f->particle_buffer;
+    }
+    mcpl_internal_free_readbuf(f);
+  }
+  f->readbuf_size = nbytes;
 }
 
-const char* mcpl_hdr_srcname(mcpl_file_t ff)
+const mcpl_particle_t* mcpl_read(mcpl_file_t ff)
 {
   MCPLIMP_FILEDECODE;
-  return f->hdr_srcprogname;
+  uint64_t n;
+  const char * praw = mcpl_internal_fetch_block(f, 1, &n);
+  if (!praw)
+    return 0;
+  mcpl_internal_unpack_particle(f,praw,f->particle);
+  f->particle_outdated = 0;
+  return f->particle;
 }
 
-int mcpl_hdr_has_userflags(mcpl_file_t ff)
+int mcpl_read_raw(mcpl_file_t ff, const char ** rec)
 {
   MCPLIMP_FILEDECODE;
-  return f->opt_userflags;
+  uint64_t n;
+  *rec = mcpl_internal_fetch_block(f, 1, &n);
+  if (!*rec)
+    return 0;
+  f->particle_outdated = 1;
+  return 1;
 }
 
-int mcpl_hdr_has_polarisation(mcpl_file_t ff)
+const char * mcpl_internal_read_block(mcpl_fileinternal_t* f, mcpl_particle_t* out,
+                                      uint64_t nmax, uint64_t* nread)
 {
-  MCPLIMP_FILEDECODE;
-  return f->opt_polarisation;
+  //As mcpl_internal_fetch_block, but also unpacks the particles into the out array:
+  const char * buf = mcpl_internal_fetch_block(f, nmax, nread);
+  if (!buf)
+    return 0;
+  unsigned lbuf = f->particle_size;
+  uint64_t n = *nread;
+  uint64_t i;
+  if (f->format_version>=3) {
+    //Unpack ekin and directions in batches, with the vectorised kernels:
+    double in[3][MCPLIMP_BATCH_NPARTICLES];
+    double ekin[MCPLIMP_BATCH_NPARTICLES];
+    double dir[3][MCPLIMP_BATCH_NPARTICLES];
+    double pack_ekindir[3];
+    uint64_t ibatch, nbatch;
+    for (ibatch = 0; ibatch < n; ibatch += nbatch) {
+      nbatch = n - ibatch;
+      if (nbatch > MCPLIMP_BATCH_NPARTICLES)
+        nbatch = MCPLIMP_BATCH_NPARTICLES;
+      mcpl_particle_t * o = out + ibatch;
+      const char * b = buf + ibatch*lbuf;
+      for (i = 0; i < nbatch; ++i) {
+        f->unpack_fields(f, b + i*lbuf, o + i, pack_ekindir);
+        in[0][i] = pack_ekindir[0];
+        in[1][i] = pack_ekindir[1];
+        in[2][i] = pack_ekindir[2];
+      }
+      mcpl_internal_unpack_adaptproj_batch(nbatch, in[0], in[1], in[2],
+                                           ekin, dir[0], dir[1], dir[2]);
+      for (i = 0; i < nbatch; ++i) {
+        o[i].ekin = ekin[i];
+        o[i].direction[0] = dir[0][i];
+        o[i].direction[1] = dir[1][i];
+        o[i].direction[2] = dir[2][i];
+      }
+    }
+  } else {
+    for (i = 0; i < n; ++i)
+      mcpl_internal_unpack_particle(f, buf + i*lbuf, out + i);
+  }
+  *(f->particle) = out[n-1];
+  f->particle_outdated = 0;
+  return buf;
 }
 
-int mcpl_hdr_has_doubleprec(mcpl_file_t ff)
+uint64_t mcpl_read_block(mcpl_file_t ff, mcpl_particle_t* out, uint64_t nmax)
 {
   MCPLIMP_FILEDECODE;
-  return !f->opt_singleprec;
+  uint64_t ntot = 0;
+  uint64_t n;
+  while ( ntot < nmax && mcpl_internal_read_block(f, out + ntot, nmax - ntot, &n) )
+    ntot += n;
+  return ntot;
 }
 
-const mcpl_particle_t* mcpl_read(mcpl_file_t ff)
+void mcpl_internal_extract_fpcolumn(const mcpl_fileinternal_t* f, const char * buf,
+                                    uint64_t n, unsigned offset, double * out)
 {
-  MCPLIMP_FILEDECODE;
-  f->current_particle_idx += 1;
-  if ( f->current_particle_idx > f->nparticles ) {
-    f->current_particle_idx = f->nparticles;//overflow guard
-    return 0;
+  //Extract the floating point field at the given byte offset in n packed particles:
+  unsigned lbuf = f->particle_size;
+  uint64_t i;
+  if (f->opt_singleprec) {
+    for (i = 0; i < n; ++i)
+      out[i] = *(const float*)&buf[i*lbuf+offset];
+  } else {
+    for (i = 0; i < n; ++i)
+      out[i] = *(const double*)&buf[i*lbuf+offset];
   }
+}
 
-  //read particle data:
-  size_t nb;
+void mcpl_internal_fill_column(double * out, uint64_t n, double value)
+{
+  uint64_t i;
+  for (i = 0; i < n; ++i)
+    out[i] = value;
+}
+
+uint64_t mcpl_read_columns(mcpl_file_t ff, unsigned fields,
+                           const mcpl_columns_t* columns, uint64_t nmax)
+{
+  MCPLIMP_FILEDECODE;
+  if (fields & ~MCPL_FIELD_ALL)
+    mcpl_error("mcpl_read_columns called with invalid field flags");
+  if ( ( (fields&MCPL_FIELD_EKIN) && !columns->ekin )
+       || ( (fields&MCPL_FIELD_POLX) && !columns->polx )
+       || ( (fields&MCPL_FIELD_POLY) && !columns->poly )
+       || ( (fields&MCPL_FIELD_POLZ) && !columns->polz )
+       || ( (fields&MCPL_FIELD_X) && !columns->x )
+       || ( (fields&MCPL_FIELD_Y) && !columns->y )
+       || ( (fields&MCPL_FIELD_Z) && !columns->z )
+       || ( (fields&MCPL_FIELD_UX) && !columns->ux )
+       || ( (fields&MCPL_FIELD_UY) && !columns->uy )
+       || ( (fields&MCPL_FIELD_UZ) && !columns->uz )
+       || ( (fields&MCPL_FIELD_TIME) && !columns->time )
+       || ( (fields&MCPL_FIELD_WEIGHT) && !columns->weight )
+       || ( (fields&MCPL_FIELD_PDGCODE) && !columns->pdgcode )
+       || ( (fields&MCPL_FIELD_USERFLAGS) && !columns->userflags ) )
+    mcpl_error("mcpl_read_columns called without array for requested field");
+
+  //Byte offsets of the fields in the packed particle data:
+  const mcpl_layout_t * l = &f->layout;
+  unsigned fp = l->fpsize;
+  unsigned off_pos = l->offset_position;
+  unsigned off_ekindir = l->offset_packed_ekindir;
+  unsigned off_time = l->offset_time;
+  unsigned off_weight = l->offset_weight;
+  unsigned off_pdgcode = l->offset_pdgcode;
+  unsigned off_userflags = l->offset_userflags;
   unsigned lbuf = f->particle_size;
-  char * pbuf = &(f->particle_buffer[0]);
-#ifdef MCPL_HASZLIB
-    if (f->filegz)
-      nb = gzread(f->filegz, pbuf, lbuf);
-    else
-#endif
-      nb = fread(pbuf, 1, lbuf, f->file);
-  if (nb!=lbuf)
-    mcpl_error("Errors encountered while attempting to read particle data.");
 
-  //Transfer to particle struct:
-  unsigned ibuf = 0;
-  mcpl_particle_t * p = f->particle;
-  double pack_ekindir[3];
-  p->weight = f->opt_universalweight;
-  int i;
-  if (f->opt_singleprec) {
-    if (f->opt_polarisation) {
-      for (i=0;i<3;++i) {
-        p->polarisation[i] = *(float*)&pbuf[ibuf];
-        ibuf += sizeof(float);
-      }
-    } else {
-      for (i=0;i<3;++i)
-        p->polarisation[i] = 0.0;
+  uint64_t ntot = 0;
+  uint64_t n, i;
+  const char * buf;
+  while ( ntot < nmax && ( buf = mcpl_internal_fetch_block(f, nmax - ntot, &n) ) ) {
+    if (fields&MCPL_FIELD_EKIN) {
+      //ekin is stored as the magnitude of the third packed ekin+dir field:
+      double * ekin = columns->ekin + ntot;
+      mcpl_internal_extract_fpcolumn(f, buf, n, off_ekindir + 2 * fp, ekin);
+      for (i = 0; i < n; ++i)
+        ekin[i] = fabs(ekin[i]);
     }
-    for (i=0;i<3;++i) {
-      p->position[i] = *(float*)&pbuf[ibuf];
-      ibuf += sizeof(float);
+    if (fields&(MCPL_FIELD_POLX|MCPL_FIELD_POLY|MCPL_FIELD_POLZ)) {
+      double * pol[3] = { (fields&MCPL_FIELD_POLX) ? columns->polx + ntot : 0,
+                          (fields&MCPL_FIELD_POLY) ? columns->poly + ntot : 0,
+                          (fields&MCPL_FIELD_POLZ) ? columns->polz + ntot : 0 };
+      int j;
+      for (j = 0; j < 3; ++j) {
+        if (!pol[j])
+          continue;
+        if (f->opt_polarisation)
+          mcpl_internal_extract_fpcolumn(f, buf, n, l->offset_polarisation + j * fp, pol[j]);
+        else
+          mcpl_internal_fill_column(pol[j], n, 0.0);
+      }
     }
-    for (i=0;i<3;++i) {
-      pack_ekindir[i] = *(float*)&pbuf[ibuf];
-      ibuf += sizeof(float);
+    if (fields&MCPL_FIELD_X)
+      mcpl_internal_extract_fpcolumn(f, buf, n, off_pos, columns->x + ntot);
+    if (fields&MCPL_FIELD_Y)
+      mcpl_internal_extract_fpcolumn(f, buf, n, off_pos + fp, columns->y + ntot);
+    if (fields&MCPL_FIELD_Z)
+      mcpl_internal_extract_fpcolumn(f, buf, n, off_pos + 2 * fp, columns->z + ntot);
+    if (fields&(MCPL_FIELD_UX|MCPL_FIELD_UY|MCPL_FIELD_UZ)) {
+      //Only unpack directions when actually requested, since it is relatively expensive:
+      if (f->format_version>=3) {
+        //Batched unpacking with the vectorised kernels, directly into the
+        //requested output columns when possible:
+        double in[3][MCPLIMP_BATCH_NPARTICLES];
+        double ekin[MCPLIMP_BATCH_NPARTICLES];
+        double scratch[MCPLIMP_BATCH_NPARTICLES];
+        uint64_t ibatch, nbatch;
+        for (ibatch = 0; ibatch < n; ibatch += nbatch) {
+          nbatch = n - ibatch;
+          if (nbatch > MCPLIMP_BATCH_NPARTICLES)
+            nbatch = MCPLIMP_BATCH_NPARTICLES;
+          const char * b = buf + ibatch * lbuf;
+          mcpl_internal_extract_fpcolumn(f, b, nbatch, off_ekindir, in[0]);
+          mcpl_internal_extract_fpcolumn(f, b, nbatch, off_ekindir + fp, in[1]);
+          mcpl_internal_extract_fpcolumn(f, b, nbatch, off_ekindir + 2 * fp, in[2]);
+          uint64_t iout = ntot + ibatch;
+          mcpl_internal_unpack_adaptproj_batch(nbatch, in[0], in[1], in[2], ekin,
+                                               (fields&MCPL_FIELD_UX) ? columns->ux + iout : scratch,
+                                               (fields&MCPL_FIELD_UY) ? columns->uy + iout : scratch,
+                                               (fields&MCPL_FIELD_UZ) ? columns->uz + iout : scratch);
+        }
+      } else {
+        double pack_ekindir[3];
+        double ekin;
+        double dir[3];
+        for (i = 0; i < n; ++i) {
+          const char * pbuf = buf + i * lbuf + off_ekindir;
+          if (f->opt_singleprec) {
+            pack_ekindir[0] = ((const float*)pbuf)[0];
+            pack_ekindir[1] = ((const float*)pbuf)[1];
+            pack_ekindir[2] = ((const float*)pbuf)[2];
+          } else {
+            memcpy(pack_ekindir, pbuf, sizeof(pack_ekindir));
+          }
+          mcpl_internal_unpack_ekindir(f->format_version, pack_ekindir, &ekin, dir);
+          if (fields&MCPL_FIELD_UX)
+            columns->ux[ntot+i] = dir[0];
+          if (fields&MCPL_FIELD_UY)
+            columns->uy[ntot+i] = dir[1];
+          if (fields&MCPL_FIELD_UZ)
+            columns->uz[ntot+i] = dir[2];
+        }
+      }
     }
-    p->time = *(float*)&pbuf[ibuf];
-    ibuf += sizeof(float);
-    if (!p->weight) {
-      p->weight = *(float*)&pbuf[ibuf];
-      ibuf += sizeof(float);
+    if (fields&MCPL_FIELD_TIME)
+      mcpl_internal_extract_fpcolumn(f, buf, n, off_time, columns->time + ntot);
+    if (fields&MCPL_FIELD_WEIGHT) {
+      if (f->opt_universalweight)
+        mcpl_internal_fill_column(columns->weight + ntot, n, f->opt_universalweight);
+      else
+        mcpl_internal_extract_fpcolumn(f, buf, n, off_weight, columns->weight + ntot);
     }
-  } else {
-    if (f->opt_polarisation) {
-      for (i=0;i<3;++i) {
-        p->polarisation[i] = *(double*)&pbuf[ibuf];
-        ibuf += sizeof(double);
+    if (fields&MCPL_FIELD_PDGCODE) {
+      int32_t * pdgcode = columns->pdgcode + ntot;
+      if (f->opt_universalpdgcode) {
+        for (i = 0; i < n; ++i)
+          pdgcode[i] = f->opt_universalpdgcode;
+      } else {
+        for (i = 0; i < n; ++i)
+          pdgcode[i] = *(const int32_t*)&buf[i*lbuf+off_pdgcode];
       }
-    } else {
-      for (i=0;i<3;++i)
-        p->polarisation[i] = 0.0;
     }
-    for (i=0;i<3;++i) {
-      p->position[i] = *(double*)&pbuf[ibuf];
-      ibuf += sizeof(double);
+    if (fields&MCPL_FIELD_USERFLAGS) {
+      uint32_t * userflags = columns->userflags + ntot;
+      if (f->opt_userflags) {
+        for (i = 0; i < n; ++i)
+          userflags[i] = *(const uint32_t*)&buf[i*lbuf+off_userflags];
+      } else {
+        for (i = 0; i < n; ++i)
+          userflags[i] = 0;
+      }
     }
-    for (i=0;i<3;++i) {
-      pack_ekindir[i] = *(double*)&pbuf[ibuf];
-      ibuf += sizeof(double);
+    ntot += n;
+  }
+  //Make sure the last particle is also available to mcpl_transfer_last_read_particle:
+  if (ntot)
+    mcpl_internal_unpack_particle(f, f->last_particle_raw, f->particle);
+  f->particle_outdated = 0;
+  return ntot;
+}
+
+int mcpl_internal_filter_has_pdgcode(const mcpl_filter_t* filter, int32_t pdgcode)
+{
+  unsigned i;
+  for (i = 0; i < filter->npdgcodes; ++i)
+    if (filter->pdgcodes[i] == pdgcode)
+      return 1;
+  return 0;
+}
+
+uint64_t mcpl_internal_filter_pdgcode(const mcpl_fileinternal_t* f, const char * buf,
+                                      const mcpl_filter_t* filter, uint32_t* sel, uint64_t n)
+{
+  //Keep the n candidates in sel whose pdgcode is in the set of the filter
+  //(returns the number kept):
+  unsigned lbuf = f->particle_size;
+  unsigned offset = f->layout.offset_pdgcode;
+  uint64_t i, k = 0;
+  if (filter->npdgcodes == 1) {
+    int32_t pdgcode = filter->pdgcodes[0];
+    for (i = 0; i < n; ++i) {
+      sel[k] = sel[i];
+      k += ( *(const int32_t*)&buf[sel[i]*lbuf+offset] == pdgcode );
     }
-    p->time = *(double*)&pbuf[ibuf];
-    ibuf += sizeof(double);
-    if (!p->weight) {
-      p->weight = *(double*)&pbuf[ibuf];
-      ibuf += sizeof(double);
+  } else {
+    for (i = 0; i < n; ++i) {
+      sel[k] = sel[i];
+      k += mcpl_internal_filter_has_pdgcode(filter, *(const int32_t*)&buf[sel[i]*lbuf+offset]);
     }
   }
+  return k;
+}
 
-  if (f->opt_universalpdgcode) {
-    p->pdgcode = f->opt_universalpdgcode;
-  } else {
-    p->pdgcode = *(int32_t*)&pbuf[ibuf];
-    ibuf += sizeof(int32_t);
+uint64_t mcpl_internal_filter_fp(const mcpl_fileinternal_t* f, const char * buf,
+                                 unsigned offset, int absval, double vmin, double vmax,
+                                 uint32_t* sel, uint64_t n)
+{
+  //Keep the n candidates in sel whose floating point field at the given byte
+  //offset (or its absolute value) is in [vmin,vmax) (returns the number kept):
+  unsigned lbuf = f->particle_size;
+  uint64_t i, k = 0;
+  for (i = 0; i < n; ++i) {
+    const char * p = &buf[sel[i]*lbuf+offset];
+    double v = f->opt_singleprec ? (double)*(const float*)p : *(const double*)p;
+    if (absval)
+      v = fabs(v);
+    sel[k] = sel[i];
+    k += ( v >= vmin && v < vmax );
   }
-  if (f->opt_userflags) {
-    p->userflags = *(uint32_t*)&pbuf[ibuf];
-#ifndef NDEBUG
-    ibuf += sizeof(uint32_t);
-#endif
-  } else {
-    f->opt_userflags = 0;
+  return k;
+}
+
+uint64_t mcpl_internal_read_filtered_batch(mcpl_fileinternal_t* f, const mcpl_filter_t* filter,
+                                           uint64_t nmax, const char ** buf,
+                                           uint32_t* sel, uint64_t* nsel)
+{
+  //Scan up to nmax particles (at most MCPLIMP_BATCH_NPARTICLES at a time) at the
+  //current location and skip forward past them, providing their packed data in
+  //buf and the indices of those passing the filter in sel. The criteria are
+  //applied one at a time, directly on the packed data of the remaining
+  //candidates. Returns the number of particles scanned (0 at the end):
+  *buf = 0;
+  *nsel = 0;
+  unsigned criteria = filter->criteria;
+  if (criteria & ~MCPL_FILTER_ALL)
+    mcpl_error("Filter has invalid criteria flags");
+  if ( (criteria&MCPL_FILTER_PDGCODE) && filter->npdgcodes && !filter->pdgcodes )
+    mcpl_error("Filter has no array of pdgcodes");
+
+  //Criteria on universal values are decided for all particles at once, and if
+  //they fail there is no need to even read the particles:
+  int reject_all = 0;
+  if ( (criteria&MCPL_FILTER_PDGCODE) && f->opt_universalpdgcode ) {
+    reject_all = !mcpl_internal_filter_has_pdgcode(filter, f->opt_universalpdgcode);
+    criteria &= ~MCPL_FILTER_PDGCODE;
+  }
+  if ( (criteria&MCPL_FILTER_WEIGHT) && f->opt_universalweight ) {
+    double w = f->opt_universalweight;
+    reject_all |= !( w >= filter->weight_min && w < filter->weight_max );
+    criteria &= ~MCPL_FILTER_WEIGHT;
+  }
+  if (reject_all) {
+    uint64_t idx = f->current_particle_idx;
+    uint64_t n = ( idx < f->range_end ? f->range_end - idx : 0 );
+    if (n > nmax)
+      n = nmax;
+    f->current_particle_idx += n;
+    return n;
   }
-  assert(ibuf==lbuf);
 
-  //Unpack direction and ekin:
+  if (nmax > MCPLIMP_BATCH_NPARTICLES)
+    nmax = MCPLIMP_BATCH_NPARTICLES;
+  uint64_t n;
+  const char * b = mcpl_internal_fetch_block(f, nmax, &n);
+  if (!b)
+    return 0;
+  uint64_t i, ns = n;
+  for (i = 0; i < n; ++i)
+    sel[i] = (uint32_t)i;
+  const mcpl_layout_t * l = &f->layout;
+  if (criteria&MCPL_FILTER_PDGCODE)
+    ns = mcpl_internal_filter_pdgcode(f, b, filter, sel, ns);
+  if (criteria&MCPL_FILTER_EKIN) {
+    //ekin is the magnitude of the third packed ekin+dir field in all format
+    //versions (its sign holds direction information), so directions need not
+    //be unpacked:
+    ns = mcpl_internal_filter_fp(f, b, l->offset_packed_ekindir + 2 * l->fpsize,
+                                 1, filter->ekin_min, filter->ekin_max, sel, ns);
+  }
+  if (criteria&MCPL_FILTER_POSITION) {
+    int j;
+    for (j = 0; j < 3; ++j)
+      ns = mcpl_internal_filter_fp(f, b, l->offset_position + j * l->fpsize, 0,
+                                   filter->pos_min[j], filter->pos_max[j], sel, ns);
+  }
+  if (criteria&MCPL_FILTER_TIME)
+    ns = mcpl_internal_filter_fp(f, b, l->offset_time, 0, filter->time_min, filter->time_max, sel, ns);
+  if (criteria&MCPL_FILTER_WEIGHT)
+    ns = mcpl_internal_filter_fp(f, b, l->offset_weight, 0, filter->weight_min, filter->weight_max, sel, ns);
+  *buf = b;
+  *nsel = ns;
+  return n;
+}
 
+void mcpl_internal_unpack_selected(const mcpl_fileinternal_t* f, const char * buf,
+                                   const uint32_t * sel, uint64_t n, mcpl_particle_t* out)
+{
+  //Unpack the n (at most MCPLIMP_BATCH_NPARTICLES) particles with the given
+  //indices in the packed data:
+  unsigned lbuf = f->particle_size;
+  uint64_t i;
+  if (!n)
+    return;
   if (f->format_version>=3) {
-    p->ekin = fabs(pack_ekindir[2]);
-    pack_ekindir[2] = copysign(1.0,pack_ekindir[2]);
-    mcpl_unitvect_unpack_adaptproj(pack_ekindir,p->direction);
+    double in[3][MCPLIMP_BATCH_NPARTICLES];
+    double ekin[MCPLIMP_BATCH_NPARTICLES];
+    double dir[3][MCPLIMP_BATCH_NPARTICLES];
+    double pack_ekindir[3];
+    for (i = 0; i < n; ++i) {
+      f->unpack_fields(f, buf + sel[i]*lbuf, out + i, pack_ekindir);
+      in[0][i] = pack_ekindir[0];
+      in[1][i] = pack_ekindir[1];
+      in[2][i] = pack_ekindir[2];
+    }
+    mcpl_internal_unpack_adaptproj_batch(n, in[0], in[1], in[2],
+                                         ekin, dir[0], dir[1], dir[2]);
+    for (i = 0; i < n; ++i) {
+      out[i].ekin = ekin[i];
+      out[i].direction[0] = dir[0][i];
+      out[i].direction[1] = dir[1][i];
+      out[i].direction[2] = dir[2][i];
+    }
   } else {
-    assert(f->format_version==2);
-    mcpl_unitvect_unpack_oct(pack_ekindir,p->direction);
-    p->ekin = pack_ekindir[2];
-    if (signbit(pack_ekindir[2])) {
-      p->ekin = -p->ekin;
-      p->direction[2] = 0.0;
+    for (i = 0; i < n; ++i)
+      mcpl_internal_unpack_particle(f, buf + sel[i]*lbuf, out + i);
+  }
+}
+
+uint64_t mcpl_read_filtered(mcpl_file_t ff, const mcpl_filter_t* filter,
+                            mcpl_particle_t* out, uint64_t nmax)
+{
+  MCPLIMP_FILEDECODE;
+  //Particles failing the filter must not replace the last read particle, which
+  //is therefore kept in particle_buffer (where it stays valid when the read
+  //buffer is refilled):
+  if (f->last_particle_raw != f->particle_buffer) {
+    memcpy(f->particle_buffer, f->last_particle_raw, f->particle_size);
+    f->last_particle_raw = f->particle_buffer;
+  }
+  uint32_t sel[MCPLIMP_BATCH_NPARTICLES];
+  uint64_t nout = 0;
+  while (nout < nmax) {
+    uint64_t idx = f->current_particle_idx;
+    const char * buf;
+    uint64_t nsel;
+    if (!mcpl_internal_read_filtered_batch(f, filter, (uint64_t)-1, &buf, sel, &nsel))
+      break;
+    f->last_particle_raw = f->particle_buffer;
+    if (!nsel)
+      continue;
+    if (nsel > nmax - nout) {
+      //Leave the remaining particles for the next call:
+      nsel = nmax - nout;
+      f->current_particle_idx = idx + sel[nsel-1] + 1;
     }
+    mcpl_internal_unpack_selected(f, buf, sel, nsel, out + nout);
+    memcpy(f->particle_buffer, buf + sel[nsel-1] * f->particle_size, f->particle_size);
+    nout += nsel;
   }
-  return p;
+  if (nout) {
+    *(f->particle) = out[nout-1];
+    f->particle_outdated = 0;
+  }
+  return nout;
 }
 
+//NB: The functions for seeking and skipping only update the current position,
+//since the underlying file is anyway repositioned when (and if) the read buffer
+//must be refilled for the particle at the new position.
+
 int mcpl_skipforward(mcpl_file_t ff,uint64_t n)
 {
   MCPLIMP_FILEDECODE;
   //increment, but guard against overflows:
-  if ( n >= f->nparticles || f->current_particle_idx >= f->nparticles )
-    f->current_particle_idx = f->nparticles;
+  if ( n >= f->range_end || f->current_particle_idx >= f->range_end )
+    f->current_particle_idx = f->range_end;
   else
     f->current_particle_idx += n;
-  if ( f->current_particle_idx > f->nparticles )
-    f->current_particle_idx = f->nparticles;
+  if ( f->current_particle_idx > f->range_end )
+    f->current_particle_idx = f->range_end;
 
-  int notEOF = f->current_particle_idx<f->nparticles;
-  if (n==0)
-    return notEOF;
-  if (notEOF) {
-    int error;
-#ifdef MCPL_HASZLIB
-    if (f->filegz) {
-      int64_t targetpos = f->current_particle_idx*f->particle_size+f->first_particle_pos;
-      error = gzseek( f->filegz, targetpos, SEEK_SET )!=targetpos;
-    } else
+  int notEOF = f->current_particle_idx<f->range_end;
+#ifdef MCPLIMP_HAS_MMAP
+  if (n)
+    mcpl_internal_mmap_willneed(f);
 #endif
-      error = fseek( f->file, f->particle_size * n, SEEK_CUR )!=0;
-    if (error)
-      mcpl_error("Errors encountered while skipping in particle list");
-  }
   return notEOF;
 }
 
 int mcpl_rewind(mcpl_file_t ff)
 {
   MCPLIMP_FILEDECODE;
-  int already_there = (f->current_particle_idx==0);
-  f->current_particle_idx = 0;
-  int notEOF = f->current_particle_idx<f->nparticles;
-  if (notEOF&&!already_there) {
-    int error;
-#ifdef MCPL_HASZLIB
-    if (f->filegz) {
-      error = gzseek( f->filegz, f->first_particle_pos, SEEK_SET )!=(int64_t)f->first_particle_pos;
-    } else
+  int already_there = (f->current_particle_idx==f->range_begin);
+  f->current_particle_idx = f->range_begin;
+  int notEOF = f->current_particle_idx<f->range_end;
+#ifdef MCPLIMP_HAS_MMAP
+  if (!already_there)
+    mcpl_internal_mmap_willneed(f);
+#else
+  (void)already_there;
 #endif
-      error = fseek( f->file, f->first_particle_pos, SEEK_SET )!=0;
-    if (error)
-      mcpl_error("Errors encountered while rewinding particle list");
-  }
   return notEOF;
 }
 
 int mcpl_seek(mcpl_file_t ff,uint64_t ipos)
 {
   MCPLIMP_FILEDECODE;
+  if (ipos < f->range_begin)
+    ipos = f->range_begin;
   int already_there = (f->current_particle_idx==ipos);
-  f->current_particle_idx = (ipos<f->nparticles?ipos:f->nparticles);
-  int notEOF = f->current_particle_idx<f->nparticles;
-  if (notEOF&&!already_there) {
-    int error;
-#ifdef MCPL_HASZLIB
-    if (f->filegz) {
-      int64_t targetpos = f->current_particle_idx*f->particle_size+f->first_particle_pos;
-      error = gzseek( f->filegz, targetpos, SEEK_SET )!=targetpos;
-    } else
+  f->current_particle_idx = (ipos<f->range_end?ipos:f->range_end);
+  int notEOF = f->current_particle_idx<f->range_end;
+#ifdef MCPLIMP_HAS_MMAP
+  if (!already_there)
+    mcpl_internal_mmap_willneed(f);
+#else
+  (void)already_there;
 #endif
-      error = fseek( f->file, f->first_particle_pos + f->particle_size * ipos, SEEK_SET )!=0;
-    if (error)
-      mcpl_error("Errors encountered while seeking in particle list");
-  }
   return notEOF;
 }
 
@@ -1450,6 +5193,48 @@ uint64_t mcpl_currentposition(mcpl_file_t ff)
   return f->current_particle_idx;
 }
 
+int mcpl_set_range(mcpl_file_t ff, uint64_t begin, uint64_t end)
+{
+  MCPLIMP_FILEDECODE;
+  if ( begin > end || end > f->nparticles )
+    mcpl_error("mcpl_set_range called with invalid range");
+  f->range_begin = begin;
+  f->range_end = end;
+  f->current_particle_idx = (uint64_t)-1;//force mcpl_rewind to act
+  return mcpl_rewind(ff);
+}
+
+void mcpl_partition(mcpl_file_t ff, unsigned nparts, uint64_t * bounds)
+{
+  MCPLIMP_FILEDECODE;
+  if (!nparts)
+    mcpl_error("mcpl_partition called with nparts=0");
+  //Boundaries are placed at multiples of a granularity chosen such that the
+  //size in bytes of the particle data between them is a multiple of 4096. This
+  //is only done when the parts are large enough that the resulting imbalance
+  //is insignificant:
+  uint64_t np = f->nparticles;
+  uint64_t granularity = 4096;
+  unsigned psize = f->particle_size;
+  while ( psize % 2 == 0 && granularity > 1 ) {
+    psize /= 2;
+    granularity /= 2;
+  }
+  if ( np / nparts < 64 * granularity )
+    granularity = 1;
+  unsigned i;
+  bounds[0] = 0;
+  for (i = 1; i < nparts; ++i) {
+    //nb: computing i*np/nparts without risking overflow:
+    uint64_t b = (np / nparts) * i + ( (np % nparts) * i ) / nparts;
+    b = ( ( b + granularity / 2 ) / granularity ) * granularity;
+    if (b > np)
+      b = np;
+    bounds[i] = ( b < bounds[i-1] ? bounds[i-1] : b );
+  }
+  bounds[nparts] = np;
+}
+
 const char * mcpl_basename(const char * filename)
 {
   //portable "basename" which doesn't modify it's argument:
@@ -1466,6 +5251,8 @@ int mcpl_hdr_particle_size(mcpl_file_t ff)
 uint64_t mcpl_hdr_header_size(mcpl_file_t ff)
 {
   MCPLIMP_FILEDECODE;
+  if (f->hdr_partial)
+    mcpl_internal_read_blobsection(f);
   return f->first_particle_pos;
 }
 
@@ -1494,27 +5281,29 @@ int mcpl_hdr_little_endian(mcpl_file_t ff)
   return f->is_little_endian;
 }
 
-void mcpl_transfer_last_read_particle(mcpl_file_t source, mcpl_outfile_t target)
+const mcpl_layout_t* mcpl_hdr_layout(mcpl_file_t ff)
 {
-  mcpl_outfileinternal_t * ft = (mcpl_outfileinternal_t *)target.internal; assert(ft);
-  mcpl_fileinternal_t * fs = (mcpl_fileinternal_t *)source.internal; assert(fs);
+  MCPLIMP_FILEDECODE;
+  return &f->layout;
+}
 
-  if ( fs->current_particle_idx==0 && fs->particle->weight==0.0 && fs->particle->pdgcode==0 ) {
-    mcpl_error("mcpl_transfer_last_read_particle called with source file in invalid state"
-               " (did you forget to first call mcpl_read() on the source file before calling this function?)");
-    return;
-  }
+void mcpl_internal_transfer_particle(mcpl_fileinternal_t * fs, const char * praw,
+                                     const mcpl_particle_t * particle,
+                                     mcpl_outfileinternal_t * ft)
+{
+  //Transfer particle (available both unpacked and as packed data in the format
+  //of the source file) to the target file:
 
   //Sanity checks for universal fields here (but not in mcpl_add_particle since users are allowed to create files by setting just the universal fields):
-  if ( ft->opt_universalpdgcode && fs->particle->pdgcode != ft->opt_universalpdgcode) {
+  if ( ft->opt_universalpdgcode && particle->pdgcode != ft->opt_universalpdgcode) {
     printf("MCPL ERROR: mcpl_transfer_last_read_particle asked to transfer particle with pdgcode %li into a file with universal pdgcode of %li\n",
-           (long)fs->particle->pdgcode,(long)ft->opt_universalpdgcode);
+           (long)particle->pdgcode,(long)ft->opt_universalpdgcode);
     mcpl_error("mcpl_transfer_last_read_particle got incompatible pdgcode\n");
     return;
   }
-  if ( ft->opt_universalweight && fs->particle->weight != ft->opt_universalweight) {
+  if ( ft->opt_universalweight && particle->weight != ft->opt_universalweight) {
     printf("MCPL ERROR: mcpl_transfer_last_read_particle asked to transfer particle with weight %g into a file with universal weight of %g\n",
-               fs->particle->weight,ft->opt_universalweight);
+               particle->weight,ft->opt_universalweight);
     mcpl_error("mcpl_transfer_last_read_particle got incompatible weight\n");
     return;
   }
@@ -1527,43 +5316,176 @@ void mcpl_transfer_last_read_particle(mcpl_file_t source, mcpl_outfile_t target)
     //floating point precision is increasing. In these scenarious we can not
     //reuse the 3 floats representing packed direction+ekin but must proceed via
     //a full unpacking+repacking.
-    mcpl_add_particle(target,fs->particle);
+    mcpl_internal_serialise_particle_to_buffer(particle,ft);
+    mcpl_internal_write_particle_buffer_to_file(ft);
+    return;
+  }
+
+  if ( ft->opt_signature == fs->opt_signature ) {
+    //Particle data is encoded in exactly the same manner in src and target (a
+    //common scenario for many merge or extraction scenarios) -> simply transfer
+    //the bytes and be done with it:
+    assert(fs->particle_size==ft->particle_size);
+    memcpy(ft->particle_buffer,praw,fs->particle_size);
+    mcpl_internal_write_particle_buffer_to_file(ft);
+    return;
+  }
+
+  //The hard way - first serialise the source particle into the output buffer:
+  mcpl_internal_serialise_particle_to_buffer( particle, ft );
+
+  //If possible, override the 3 FP representing packed ekin+dir from the packing
+  //in the source, thus avoiding potentially lossy unpacking+packing:
+  size_t fpsize_target = ft->opt_singleprec ? sizeof(float) : sizeof(double);
+  size_t idx_packekindir_target = (ft->opt_polarisation ? 6 : 3) * fpsize_target;
+  size_t idx_packekindir_src = (fs->opt_polarisation ? 6 : 3) * fpsize_target;
+  if (fs->opt_singleprec == ft->opt_singleprec) {
+    memcpy( &(ft->particle_buffer[idx_packekindir_target]),
+            &(praw[idx_packekindir_src]),
+            fpsize_target * 3);
+  } else if ( ft->opt_singleprec && !fs->opt_singleprec ) {
+    //For the case of double precision -> single precision, we can simply
+    //perform a narrowing conversion:
+    const double * packekindir_src = (const double*)&(praw[idx_packekindir_src]);
+    float * packekindir_target = (float*)&(ft->particle_buffer[idx_packekindir_target]);
+    for (unsigned i = 0; i < 3; ++i) {
+      packekindir_target[i] = (float)packekindir_src[i];
+    }
+  }
+
+  mcpl_internal_write_particle_buffer_to_file(ft);
+}
+
+void mcpl_transfer_last_read_particle(mcpl_file_t source, mcpl_outfile_t target)
+{
+  mcpl_outfileinternal_t * ft = (mcpl_outfileinternal_t *)target.internal; assert(ft);
+  mcpl_fileinternal_t * fs = (mcpl_fileinternal_t *)source.internal; assert(fs);
+
+  if (fs->header_only)
+    mcpl_error("mcpl_transfer_last_read_particle called with file opened with mcpl_open_header");
+
+  if (fs->particle_outdated) {
+    //last particle was read with mcpl_read_raw:
+    mcpl_internal_unpack_particle(fs, fs->last_particle_raw, fs->particle);
+    fs->particle_outdated = 0;
+  }
+
+  if ( fs->current_particle_idx==0 && fs->particle->weight==0.0 && fs->particle->pdgcode==0 ) {
+    mcpl_error("mcpl_transfer_last_read_particle called with source file in invalid state"
+               " (did you forget to first call mcpl_read() on the source file before calling this function?)");
     return;
   }
 
-  if ( ft->opt_signature == fs->opt_signature ) {
-    //Particle data is encoded in exactly the same manner in src and target (a
-    //common scenario for many merge or extraction scenarios) -> simply transfer
-    //the bytes and be done with it:
-    assert(fs->particle_size==ft->particle_size);
-    memcpy(ft->particle_buffer,fs->particle_buffer,fs->particle_size);
-    mcpl_internal_write_particle_buffer_to_file(ft);
-    return;
-  }
+  mcpl_internal_transfer_particle(fs, fs->last_particle_raw, fs->particle, ft);
+}
+
+uint64_t mcpl_internal_rng(uint64_t * state)
+{
+  //SplitMix64 generator (fast and of good quality for any seed):
+  uint64_t z = ( *state += UINT64_C(0x9E3779B97F4A7C15) );
+  z = ( z ^ ( z >> 30 ) ) * UINT64_C(0xBF58476D1CE4E5B9);
+  z = ( z ^ ( z >> 27 ) ) * UINT64_C(0x94D049BB133111EB);
+  return z ^ ( z >> 31 );
+}
+
+uint64_t mcpl_internal_rng_below(uint64_t * state, uint64_t n)
+{
+  //Uniformly distributed integer in [0,n), without modulo bias:
+  uint64_t threshold = ( (uint64_t)0 - n ) % n;
+  uint64_t r;
+  do {
+    r = mcpl_internal_rng(state);
+  } while ( r < threshold );
+  return r % n;
+}
+
+int mcpl_internal_cmp_uint64(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return ( x > y ) - ( x < y );
+}
+
+void mcpl_internal_sample_run(mcpl_fileinternal_t* f, uint64_t begin, uint64_t end,
+                              const uint64_t * idx, uint64_t nselect, uint64_t * rngstate,
+                              mcpl_outfileinternal_t * fo)
+{
+  //Transfer nselect particles with indices in [begin,end) to the output file:
+  //Either those in the sorted idx array or, if idx is null, particles chosen on
+  //the fly by selection sampling. Reading is temporarily restricted to the
+  //particles in [begin,end), so no data beyond them is read:
+  uint64_t range_end = f->range_end;
+  f->range_end = end;
+  f->current_particle_idx = begin;
+  mcpl_particle_t particle;
+  uint64_t n, i, k = begin;
+  const char * buf;
+  while ( nselect && ( buf = mcpl_internal_fetch_block(f, end - k, &n) ) ) {
+    for (i = 0; i < n && nselect; ++i, ++k) {
+      if ( idx ? *idx != k : mcpl_internal_rng_below(rngstate, end - k) >= nselect )
+        continue;
+      if (idx)
+        ++idx;
+      --nselect;
+      const char * praw = buf + i * f->particle_size;
+      mcpl_internal_unpack_particle(f, praw, &particle);
+      mcpl_internal_transfer_particle(f, praw, &particle, fo);
+    }
+  }
+  f->range_end = range_end;
+  if (nselect)
+    mcpl_error("Unexpected read-error while sampling");
+}
+
+uint64_t mcpl_sample(mcpl_file_t ff, uint64_t n, uint64_t seed, mcpl_outfile_t out)
+{
+  MCPLIMP_FILEDECODE;
+  mcpl_outfileinternal_t * fo = (mcpl_outfileinternal_t *)out.internal; assert(fo);
+  uint64_t begin = f->range_begin;
+  uint64_t ntot = f->range_end - f->range_begin;
+  if (n > ntot)
+    n = ntot;
+  if (!n)
+    return 0;
 
-  //The hard way - first serialise the source particle into the output buffer:
-  mcpl_internal_serialise_particle_to_buffer( fs->particle, ft );
+  //Keep position and last read particle unchanged:
+  uint64_t pos = f->current_particle_idx;
+  if (f->last_particle_raw != f->particle_buffer) {
+    memcpy(f->particle_buffer, f->last_particle_raw, f->particle_size);
+    f->last_particle_raw = f->particle_buffer;
+  }
 
-  //If possible, override the 3 FP representing packed ekin+dir from the packing
-  //in the source, thus avoiding potentially lossy unpacking+packing:
-  size_t fpsize_target = ft->opt_singleprec ? sizeof(float) : sizeof(double);
-  size_t idx_packekindir_target = (ft->opt_polarisation ? 6 : 3) * fpsize_target;
-  size_t idx_packekindir_src = (fs->opt_polarisation ? 6 : 3) * fpsize_target;
-  if (fs->opt_singleprec == ft->opt_singleprec) {
-    memcpy( &(ft->particle_buffer[idx_packekindir_target]),
-            &(fs->particle_buffer[idx_packekindir_src]),
-            fpsize_target * 3);
-  } else if ( ft->opt_singleprec && !fs->opt_singleprec ) {
-    //For the case of double precision -> single precision, we can simply
-    //perform a narrowing conversion:
-    double * packekindir_src = (double*)&(fs->particle_buffer[idx_packekindir_src]);
-    float * packekindir_target = (float*)&(ft->particle_buffer[idx_packekindir_target]);
-    for (unsigned i = 0; i < 3; ++i) {
-      packekindir_target[i] = (float)packekindir_src[i];
+  uint64_t rngstate = seed;
+  uint64_t maxgap = MCPLIMP_READBUF_INITIAL_FILL / f->particle_size;
+  if ( ntot / n <= maxgap ) {
+    //Most data must be read anyway, so simply do a single sequential pass:
+    mcpl_internal_sample_run(f, begin, f->range_end, 0, n, &rngstate, fo);
+  } else {
+    //Generate sorted random indices (redrawing any duplicates):
+    uint64_t * idx = (uint64_t*)malloc(n * sizeof(uint64_t));
+    if (!idx)
+      mcpl_error("Unable to allocate memory for sampling");
+    uint64_t i, j, m = 0;
+    while (m < n) {
+      for (i = m; i < n; ++i)
+        idx[i] = begin + mcpl_internal_rng_below(&rngstate, ntot);
+      qsort(idx, n, sizeof(uint64_t), mcpl_internal_cmp_uint64);
+      for (m = 1, i = 1; i < n; ++i)
+        if (idx[i] != idx[m-1])
+          idx[m++] = idx[i];
     }
+    //Seek to each index, but read through short gaps (coalescing the reads of
+    //nearby particles):
+    for (i = 0; i < n; i = j) {
+      for (j = i + 1; j < n && idx[j] - idx[j-1] <= maxgap; ++j) {}
+      mcpl_internal_sample_run(f, idx[i], idx[j-1] + 1, idx + i, j - i, &rngstate, fo);
+    }
+    free(idx);
   }
 
-  mcpl_internal_write_particle_buffer_to_file(ft);
+  f->current_particle_idx = pos;
+  f->last_particle_raw = f->particle_buffer;
+  return n;
 }
 
 void mcpl_dump_header(mcpl_file_t f)
@@ -1585,11 +5507,7 @@ void mcpl_dump_header(mcpl_file_t f)
   const char** blobkeys = mcpl_hdr_blobkeys(f);
   uint32_t ib;
   for (ib = 0; ib < nb; ++ib) {
-    const char * data;
-    uint32_t ldata;
-    int ok = mcpl_hdr_blob(f, blobkeys[ib], &ldata, &data);
-    if (!ok)
-      mcpl_error("Unexpected blob access error");
+    uint32_t ldata = mcpl_internal_hdr_bloblength(f, ib);
     printf("          -> %lu bytes of data with key \"%s\"\n",(unsigned long)ldata,blobkeys[ib]);
   }
 
@@ -1635,13 +5553,28 @@ void mcpl_dump_particles(mcpl_file_t f, uint64_t nskip, uint64_t nlimit,
   printf("\n");
   mcpl_skipforward(f,nskip);
   uint64_t count = nlimit;
-  const mcpl_particle_t* p;
-  while((nlimit==0||count--)&&(p=mcpl_read(f))) {
-    if (filter && !filter(p) ) {
-      ++count;
-      continue;
+  mcpl_particle_t* pblock = (mcpl_particle_t*)malloc(MCPLIMP_READBLOCK_NPARTICLES*sizeof(mcpl_particle_t));
+  if (!pblock)
+    mcpl_error("Unable to allocate memory for particle block");
+  uint64_t nblock = 0;
+  uint64_t iblock = 0;
+  while(nlimit==0||count) {
+    if (iblock==nblock) {
+      //Read next block of particles (but not more than needed):
+      uint64_t nwanted = MCPLIMP_READBLOCK_NPARTICLES;
+      if (nlimit && !filter && count < nwanted)
+        nwanted = count;
+      nblock = mcpl_read_block(f,pblock,nwanted);
+      iblock = 0;
+      if (!nblock)
+        break;
     }
-    uint64_t idx = mcpl_currentposition(f)-1;//-1 since mcpl_read skipped ahead
+    uint64_t idx = mcpl_currentposition(f) - nblock + iblock;
+    const mcpl_particle_t* p = &pblock[iblock++];
+    if (filter && !filter(p) )
+      continue;
+    if (nlimit)
+      --count;
     printf("%5" PRIu64 " %11i %11.5g %11.5g %11.5g %11.5g %11.5g %11.5g %11.5g %11.5g",
            idx,
            p->pdgcode,
@@ -1661,13 +5594,14 @@ void mcpl_dump_particles(mcpl_file_t f, uint64_t nskip, uint64_t nlimit,
       printf(" 0x%08x",p->userflags);
     printf("\n");
   }
+  free(pblock);
 }
 
 void mcpl_dump(const char * filename, int parts, uint64_t nskip, uint64_t nlimit)
 {
   if (parts<0||parts>2)
     mcpl_error("mcpl_dump got forbidden value for argument parts");
-  mcpl_file_t f = mcpl_open_file(filename);
+  mcpl_file_t f = ( parts==1 ? mcpl_open_header(filename) : mcpl_open_file_mmap(filename) );
   printf("Opened MCPL file %s:\n",mcpl_basename(filename));
   if (parts==0||parts==1)
     mcpl_dump_header(f);
@@ -1695,18 +5629,20 @@ int mcpl_actual_can_merge(mcpl_file_t ff1, mcpl_file_t ff2)
   if (f1->opt_singleprec!=f2->opt_singleprec) return 0;
   if (f1->opt_universalpdgcode!=f2->opt_universalpdgcode) return 0;
   if (f1->opt_universalweight!=f2->opt_universalweight) return 0;
-  if (f1->is_little_endian!=f2->is_little_endian) return 0;
   if (f1->particle_size!=f2->particle_size) return 0;
   if (f1->ncomments!=f2->ncomments) return 0;
   if (f1->nblobs!=f2->nblobs) return 0;
   uint32_t i;
   for (i = 0; i<f1->ncomments; ++i) {
-    if (strcmp(f1->comments[i],f2->comments[i])!=0) return 0;
+    if (f1->comment_lengths[i]!=f2->comment_lengths[i]) return 0;
+    if (strcmp(mcpl_hdr_comment(ff1,i),mcpl_hdr_comment(ff2,i))!=0) return 0;
   }
   for (i = 0; i<f1->nblobs; ++i) {
     if (f1->bloblengths[i]!=f2->bloblengths[i]) return 0;
     if (strcmp(f1->blobkeys[i],f2->blobkeys[i])!=0) return 0;
-    if (memcmp(f1->blobs[i],f2->blobs[i],f1->bloblengths[i])!=0) return 0;
+  }
+  for (i = 0; i<f1->nblobs; ++i) {
+    if (!mcpl_internal_blobs_equal(f1,f2,i)) return 0;
   }
   return 1;
 }
@@ -1820,8 +5756,10 @@ void mcpl_warn_duplicates(unsigned n, const char ** filenames)
 //Internal function for merges which will transfer the particle data in the
 //input file into an output file handle which must already be open and ready to
 //be written to, and otherwise be associated with an MCPL file with a compatible
-//format. Note that the error messages assume the overall operation is a merge:
-void mcpl_transfer_particle_contents(FILE * fo, mcpl_file_t ffi, uint64_t nparticles)
+//format. If uo is not null, the data is instead written via io_uring. Note that
+//the error messages assume the overall operation is a merge:
+void mcpl_transfer_particle_contents(FILE * fo, mcpl_internal_uring_t * uo,
+                                     mcpl_file_t ffi, uint64_t nparticles)
 {
   mcpl_fileinternal_t * fi = (mcpl_fileinternal_t *)ffi.internal; assert(fi);
 
@@ -1829,36 +5767,212 @@ void mcpl_transfer_particle_contents(FILE * fo, mcpl_file_t ffi, uint64_t nparti
     return;//no particles to transfer
 
   unsigned particle_size = fi->particle_size;
-
-  //buffer for transferring up to 1000 particles at a time:
-  const unsigned npbufsize = 1000;
-  char * buf = (char*)malloc(npbufsize*particle_size);
   uint64_t np_remaining = nparticles;
 
   while(np_remaining) {
     //NB: On linux > 2.6.33 we could use sendfile for more efficient in-kernel
     //transfer of data between two files!
-    uint64_t toread = np_remaining >= npbufsize ? npbufsize : np_remaining;
-    np_remaining -= toread;
 
-    //read:
-    size_t nb;
-#ifdef MCPL_HASZLIB
-    if (fi->filegz)
-      nb = gzread(fi->filegz, buf, toread*particle_size);
-    else
-#endif
-      nb = fread(buf,1,toread*particle_size,fi->file);
-    if (nb!=toread*particle_size)
+    //read (via the read buffer of the input file):
+    uint64_t nread;
+    const char * buf = mcpl_internal_fetch_block(fi, np_remaining, &nread);
+    if (!buf)
       mcpl_error("Unexpected read-error while merging");
+    np_remaining -= nread;
 
     //write:
-    nb = fwrite(buf,1,toread*particle_size,fo);
-    if (nb!=toread*particle_size)
+#ifdef MCPLIMP_HAS_IO_URING
+    if (uo) {
+      mcpl_internal_uring_write(uo, buf, nread*particle_size);
+      continue;
+    }
+#else
+    (void)uo;
+#endif
+    size_t nb = fwrite(buf,1,nread*particle_size,fo);
+    if (nb!=nread*particle_size)
       mcpl_error("Unexpected write-error while merging");
   }
+}
 
+void mcpl_internal_copy_file_data(FILE * src, uint64_t nbytes, FILE * dst, uint64_t dstpos)
+{
+  //Copy the first nbytes of src to position dstpos in dst (both must be flushed):
+  const char * errmsg = "Errors encountered while attempting to copy particle data.";
+  uint64_t srcpos = 0;
+#ifdef MCPLIMP_HAS_COPY_FILE_RANGE
+  //Copy inside the kernel (or just share the data blocks, on file systems
+  //supporting it), falling back to reading and writing on failure:
+  int64_t in = 0, out = (int64_t)dstpos;
+  while (nbytes) {
+    long r = syscall(SYS_copy_file_range, fileno(src), &in, fileno(dst), &out, (size_t)nbytes, 0u);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    nbytes -= (uint64_t)r;
+  }
+  srcpos = (uint64_t)in;
+  dstpos = (uint64_t)out;
+#endif
+  if (!nbytes)
+    return;
+  if ( fseek(src, (long)srcpos, SEEK_SET) || fseek(dst, (long)dstpos, SEEK_SET) )
+    mcpl_error(errmsg);
+  size_t lbuf = MCPLIMP_WRITEBUF_DEFAULT_SIZE;
+  char * buf = (char*)malloc(lbuf);
+  if (!buf)
+    mcpl_error(errmsg);
+  while (nbytes) {
+    size_t n = nbytes < lbuf ? (size_t)nbytes : lbuf;
+    if ( fread(buf, 1, n, src) != n || fwrite(buf, 1, n, dst) != n )
+      mcpl_error(errmsg);
+    nbytes -= n;
+  }
   free(buf);
+  if (fflush(dst))
+    mcpl_error(errmsg);
+}
+
+typedef struct {
+  mcpl_outfileinternal_t * parent;
+  unsigned nshards;
+  mcpl_outfileinternal_t ** shards;
+} mcpl_outfilemtinternal_t;
+
+mcpl_outfile_mt_t mcpl_create_outfile_mt(const char * filename, unsigned nthreads)
+{
+  if (!nthreads)
+    mcpl_error("mcpl_create_outfile_mt called with nthreads=0");
+  mcpl_outfile_t of = mcpl_create_outfile(filename);
+  MCPLIMP_OUTFILEDECODE;
+  f->role = MCPLIMP_ROLE_SHARD_PARENT;
+  f->hdrlock = mcpl_internal_hdrlock_create();
+  mcpl_outfilemtinternal_t * mt = (mcpl_outfilemtinternal_t*)malloc(sizeof(mcpl_outfilemtinternal_t));
+  assert(mt);
+  mt->parent = f;
+  mt->nshards = nthreads;
+  mt->shards = (mcpl_outfileinternal_t**)calloc(nthreads,sizeof(mcpl_outfileinternal_t*));
+  assert(mt->shards);
+  mcpl_outfile_mt_t out;
+  out.internal = mt;
+  return out;
+}
+
+mcpl_outfile_t mcpl_outfile_mt_header(mcpl_outfile_mt_t omt)
+{
+  mcpl_outfilemtinternal_t * mt = (mcpl_outfilemtinternal_t *)omt.internal; assert(mt);
+  mcpl_outfile_t out;
+  out.internal = mt->parent;
+  return out;
+}
+
+mcpl_outfile_t mcpl_outfile_mt_writer(mcpl_outfile_mt_t omt, unsigned ithread)
+{
+  mcpl_outfilemtinternal_t * mt = (mcpl_outfilemtinternal_t *)omt.internal; assert(mt);
+  if (ithread >= mt->nshards)
+    mcpl_error("mcpl_outfile_mt_writer called with too large thread index");
+  mcpl_outfile_t out;
+  out.internal = mt->shards[ithread];
+  if (out.internal)
+    return out;
+
+  //Start from a copy of the parent (sharing its settings but not its header
+  //data), writing only particle data to a separate shard file. The copy is made
+  //under the lock, since other threads can add comments and blobs meanwhile:
+  mcpl_outfileinternal_t * p = mt->parent;
+  mcpl_outfileinternal_t * f = (mcpl_outfileinternal_t*)malloc(sizeof(mcpl_outfileinternal_t));
+  assert(f);
+  mcpl_internal_hdrlock_lock(p->hdrlock);
+  memcpy(f, p, sizeof(mcpl_outfileinternal_t));
+  mcpl_internal_hdrlock_unlock(p->hdrlock);
+  f->hdrlock = 0;
+  f->filename = (char*)malloc(strlen(p->filename)+20);
+  sprintf(f->filename,"%s.shard%u",p->filename,ithread);
+  if (mcpl_file_certainly_exists(f->filename))
+    mcpl_error("Temporary shard file for mcpl_outfile_mt_writer already exists");
+  f->file = fopen(f->filename,"w+b");
+  if (!f->file)
+    mcpl_error("Unable to open output file!");
+  f->hdr_srcprogname = 0;
+  f->ncomments = 0;
+  f->comments = 0;
+  f->nblobs = 0;
+  f->blobkeys = 0;
+  f->bloblengths = 0;
+  f->blobs = 0;
+  f->header_notwritten = 0;
+  f->nparticles = 0;
+  f->puser = 0;
+  f->uring = 0;
+  f->writebuf = 0;
+  f->writebuf_fill = 0;
+  f->role = MCPLIMP_ROLE_SHARD_WRITER;
+  mt->shards[ithread] = f;
+  out.internal = f;
+  return out;
+}
+
+void mcpl_close_outfile_mt(mcpl_outfile_mt_t omt)
+{
+  mcpl_outfilemtinternal_t * mt = (mcpl_outfilemtinternal_t *)omt.internal; assert(mt);
+  mcpl_outfileinternal_t * p = mt->parent;
+  const char * errmsg = "Errors encountered while attempting to merge shard files.";
+
+  //Write header and any particles added directly to the parent, and find the
+  //position at which to append the shards:
+  if (p->header_notwritten)
+    mcpl_write_header(p);
+  uint64_t pos;
+#ifdef MCPLIMP_HAS_IO_URING
+  if (p->uring) {
+    mcpl_internal_uring_flush(p->uring);
+    pos = p->uring->offset;
+  } else
+#endif
+  {
+    mcpl_internal_flush_writebuf(p);
+    int64_t tellpos = ftell(p->file);
+    if ( tellpos < 0 || fflush(p->file) )
+      mcpl_error(errmsg);
+    pos = (uint64_t)tellpos;
+  }
+
+  //Append shards in order:
+  unsigned i;
+  for (i = 0; i < mt->nshards; ++i) {
+    mcpl_outfileinternal_t * f = mt->shards[i];
+    if (!f)
+      continue;
+    if ( f->opt_signature != p->opt_signature
+         || f->opt_universalpdgcode != p->opt_universalpdgcode
+         || f->opt_universalweight != p->opt_universalweight )
+      mcpl_error("Header options of mcpl_outfile_mt_t were changed after writers were created");
+    mcpl_internal_flush_writebuf(f);
+    if (fflush(f->file))
+      mcpl_error(errmsg);
+    uint64_t nbytes = f->nparticles * f->particle_size;
+    mcpl_internal_copy_file_data(f->file, nbytes, p->file, pos);
+    pos += nbytes;
+    p->nparticles += f->nparticles;
+    fclose(f->file);
+    remove(f->filename);
+    free(f->writebuf);
+    free(f->filename);
+    free(f->puser);
+    free(f);
+  }
+  if (fseek(p->file, (long)pos, SEEK_SET))
+    mcpl_error(errmsg);
+
+  p->role = MCPLIMP_ROLE_NORMAL;
+  mcpl_internal_hdrlock_destroy(p->hdrlock);
+  p->hdrlock = 0;
+  mcpl_outfile_t of;
+  of.internal = p;
+  mcpl_close_outfile(of);
+  free(mt->shards);
+  free(mt);
 }
 
 
@@ -2026,7 +6140,8 @@ mcpl_outfile_t mcpl_merge_files( const char* file_output,
     if (mcpl_hdr_version(fi)==MCPL_FORMATVERSION) {
       //Can transfer raw bytes:
       uint64_t npi = mcpl_hdr_nparticles(fi);
-      mcpl_transfer_particle_contents(out_internal->file, fi, npi);
+      mcpl_internal_flush_writebuf(out_internal);
+      mcpl_transfer_particle_contents(out_internal->file, out_internal->uring, fi, npi);
       out_internal->nparticles += npi;
     } else {
       //Merging from older version. Transfer via public interface to re-encode
@@ -2089,6 +6204,13 @@ void mcpl_merge_inplace(const char * file1, const char* file2)
     mcpl_error("direct modification of gzipped files is not supported.");
   }
 
+  if (f1->byteswap) {
+    //(particles of file2 are in any case converted to native endianness)
+    mcpl_close_file(ff1);
+    mcpl_close_file(ff2);
+    mcpl_error("direct modification of files with foreign endianness is not supported.");
+  }
+
   uint64_t np1 = f1->nparticles;
   uint64_t np2 = f2->nparticles;
   if (!np2)
@@ -2117,8 +6239,20 @@ void mcpl_merge_inplace(const char * file1, const char* file2)
   //Transfer particle contents, setting nparticles to 0 during the operation (so
   //the file appears broken and in need of mcpl_repair in case of errors during
   //the transfer):
+  mcpl_internal_uring_t * u1a = 0;
+#ifdef MCPLIMP_HAS_IO_URING
+  u1a = mcpl_internal_uring_create(fileno(f1a),1);
+  if (u1a)
+    u1a->offset = first_particle_pos + particle_size*np1;
+#endif
   mcpl_update_nparticles(f1a,0);
-  mcpl_transfer_particle_contents(f1a, ff2, np2);
+  mcpl_transfer_particle_contents(f1a, u1a, ff2, np2);
+#ifdef MCPLIMP_HAS_IO_URING
+  if (u1a) {
+    mcpl_internal_uring_flush(u1a);
+    mcpl_internal_uring_destroy(u1a);
+  }
+#endif
   mcpl_update_nparticles(f1a,np1+np2);
 
   //Finish up.
@@ -2150,6 +6284,7 @@ int mcpl_tool_usage( char** argv, const char * errmsg ) {
   printf("  %s [dump-options] FILE\n",progname);
   printf("  %s --merge [merge-options] FILE1 FILE2\n",progname);
   printf("  %s --extract [extract-options] FILE1 FILE2\n",progname);
+  printf("  %s --sample N [--seed S] FILE1 FILE2\n",progname);
   printf("  %s --repair FILE\n",progname);
   printf("  %s --version\n",progname);
   printf("  %s --help\n",progname);
@@ -2183,6 +6318,14 @@ int mcpl_tool_usage( char** argv, const char * errmsg ) {
   printf("  -lN, -sN        : Select range of particles in FILE1 (as above).\n");
   printf("  -pPDGCODE       : select particles of type given by PDGCODE.\n");
   printf("\n");
+  printf("Sample options:\n");
+  printf("  --sample N FILE1 FILE2\n");
+  printf("                    Copies N particles selected uniformly at random (without\n");
+  printf("                    replacement) from FILE1 into a new FILE2, keeping their order.\n");
+  printf("                    Only the selected particles are read when N is small.\n");
+  printf("  --seed S        : Seed for the random selection (default 0). The same seed\n");
+  printf("                    always gives the same selection.\n");
+  printf("\n");
   printf("Other options:\n");
   printf("  -r, --repair FILE\n");
   printf("                    Attempt to repair FILE which was not properly closed, by up-\n");
@@ -2243,6 +6386,8 @@ int mcpl_tool(int argc,char** argv) {
   int opt_inplace = 0;
   int opt_extract = 0;
   int opt_preventcomment = 0;//undocumented unoffical flag for mcpl unit tests
+  int64_t opt_sample = -1;
+  int64_t opt_seed = -1;
   int opt_repair = 0;
   int opt_version = 0;
   int opt_text = 0;
@@ -2317,8 +6462,11 @@ int mcpl_tool(int argc,char** argv) {
       const char * lo_text = "text";
       const char * lo_forcemerge = "forcemerge";
       const char * lo_keepuserflags = "keepuserflags";
+      const char * lo_sample = "sample";
+      const char * lo_seed = "seed";
       //Use strstr instead of "strcmp(a,"--help")==0" to support shortened
-      //versions (works since all our long-opts start with unique char).
+      //versions (works since all our long-opts start with unique char, except
+      //for --sample and --seed which can be shortened to --sa and --se).
       if (strstr(lo_help,a)==lo_help) return free(filenames), mcpl_tool_usage(argv,0);
       else if (strstr(lo_justhead,a)==lo_justhead) opt_justhead = 1;
       else if (strstr(lo_nohead,a)==lo_nohead) opt_nohead = 1;
@@ -2331,6 +6479,16 @@ int mcpl_tool(int argc,char** argv) {
       else if (strstr(lo_version,a)==lo_version) opt_version = 1;
       else if (strstr(lo_preventcomment,a)==lo_preventcomment) opt_preventcomment = 1;
       else if (strstr(lo_text,a)==lo_text) opt_text = 1;
+      else if (strlen(a)>=2&&(strstr(lo_sample,a)==lo_sample||strstr(lo_seed,a)==lo_seed)) {
+        //options taking a number as the next argument:
+        int is_sample = (strstr(lo_sample,a)==lo_sample);
+        int64_t * target = is_sample ? &opt_sample : &opt_seed;
+        if (*target!=-1)
+          return free(filenames),mcpl_tool_usage(argv,is_sample?"--sample specified more than once":"--seed specified more than once");
+        if (i+1==argc||!mcpl_str2int(argv[i+1],0,target)||*target<0)
+          return free(filenames),mcpl_tool_usage(argv,is_sample?"--sample must be followed by a number":"--seed must be followed by a number");
+        ++i;
+      }
       else return free(filenames),mcpl_tool_usage(argv,"Unrecognised option");
     } else if (n>=1&&a[0]!='-') {
       //input file
@@ -2355,6 +6513,9 @@ int mcpl_tool(int argc,char** argv) {
   if ( opt_merge!=0 && opt_forcemerge!=0 )
     return free(filenames),mcpl_tool_usage(argv,"--merge and --forcemerge can not both be specified .");
 
+  if ( opt_sample==-1 && opt_seed!=-1 )
+    return free(filenames),mcpl_tool_usage(argv,"--seed can only be used with --sample.");
+
   int number_dumpopts = (opt_justhead + opt_nohead + (blobkey!=0));
   if (opt_extract==0)
     number_dumpopts += (opt_num_limit!=-1) + (opt_num_skip!=-1);
@@ -2362,7 +6523,8 @@ int mcpl_tool(int argc,char** argv) {
   int any_extractopts = (opt_extract!=0||pdgcode_str!=0);
   int any_mergeopts = (opt_merge!=0||opt_forcemerge!=0);
   int any_textopts = (opt_text!=0);
-  if (any_dumpopts+any_mergeopts+any_extractopts+any_textopts+opt_repair+opt_version>1)
+  int any_sampleopts = (opt_sample!=-1);
+  if (any_dumpopts+any_mergeopts+any_extractopts+any_textopts+any_sampleopts+opt_repair+opt_version>1)
     return free(filenames),mcpl_tool_usage(argv,"Conflicting options specified.");
 
   if (blobkey&&(number_dumpopts>1))
@@ -2441,7 +6603,7 @@ int mcpl_tool(int argc,char** argv) {
     if (mcpl_file_certainly_exists(filenames[1]))
       return free(filenames),mcpl_tool_usage(argv,"Requested output file already exists.");
 
-    mcpl_file_t fi = mcpl_open_file(filenames[0]);
+    mcpl_file_t fi = mcpl_open_file_mmap(filenames[0]);
     mcpl_outfile_t fo = mcpl_create_outfile(filenames[1]);
     mcpl_transfer_metadata(fi, fo);
     uint64_t fi_nparticles = mcpl_hdr_nparticles(fi);
@@ -2453,11 +6615,16 @@ int mcpl_tool(int argc,char** argv) {
     }
 
     int32_t pdgcode_select = 0;
+    mcpl_filter_t filter;
+    memset(&filter, 0, sizeof(filter));
     if (pdgcode_str) {
       int64_t pdgcode64;
       if (!mcpl_str2int(pdgcode_str, 0, &pdgcode64) || pdgcode64<-2147483648 || pdgcode64>2147483647 || !pdgcode64)
         return free(filenames),mcpl_tool_usage(argv,"Must specify non-zero 32bit integer as argument to -p.");
       pdgcode_select = (int32_t)pdgcode64;
+      filter.criteria = MCPL_FILTER_PDGCODE;
+      filter.npdgcodes = 1;
+      filter.pdgcodes = &pdgcode_select;
     }
 
     if (opt_num_skip>0)
@@ -2466,12 +6633,25 @@ int mcpl_tool(int argc,char** argv) {
     //uint64_t(-1) instead of UINT64_MAX to fix clang c++98 compilation
     uint64_t left = opt_num_limit>0 ? (uint64_t)opt_num_limit : (uint64_t)-1;
     uint64_t added = 0;
-    const mcpl_particle_t* particle;
-    while ( left-- && ( particle = mcpl_read(fi) ) ) {
-      if (pdgcode_select && pdgcode_select!= particle->pdgcode)
+    mcpl_fileinternal_t * fi_internal = (mcpl_fileinternal_t *)fi.internal;
+    mcpl_outfileinternal_t * fo_internal = (mcpl_outfileinternal_t *)fo.internal;
+    //The filter is applied on the packed data, so only selected particles are unpacked:
+    mcpl_particle_t pblock[MCPLIMP_BATCH_NPARTICLES];
+    uint32_t sel[MCPLIMP_BATCH_NPARTICLES];
+    uint64_t nscanned, nsel;
+    const char * rawblock;
+    while ( left && ( nscanned = mcpl_internal_read_filtered_batch(fi_internal, &filter, left, &rawblock, sel, &nsel) ) ) {
+      left -= nscanned;
+      if (!nsel)
         continue;
-      mcpl_transfer_last_read_particle(fi, fo);//Doing mcpl_add_particle(fo,particle) is potentially (very rarely) lossy
-      ++added;
+      mcpl_internal_unpack_selected(fi_internal, rawblock, sel, nsel, pblock);
+      uint64_t isel;
+      for (isel = 0; isel < nsel; ++isel) {
+        //Transfer packed data, since doing mcpl_add_particle(fo,particle) is potentially (very rarely) lossy:
+        mcpl_internal_transfer_particle(fi_internal, rawblock + sel[isel] * fi_internal->particle_size,
+                                        &pblock[isel], fo_internal);
+        ++added;
+      }
     }
 
     char *fo_filename = (char*)malloc(strlen(mcpl_outfile_filename(fo))+4);
@@ -2488,6 +6668,44 @@ int mcpl_tool(int argc,char** argv) {
     return 0;
   }
 
+  if (any_sampleopts) {
+    if (nfilenames>2)
+      return free(filenames),mcpl_tool_usage(argv,"Too many arguments.");
+
+    if (nfilenames!=2)
+      return free(filenames),mcpl_tool_usage(argv,"Must specify both input and output files with --sample.");
+
+    if (mcpl_file_certainly_exists(filenames[1]))
+      return free(filenames),mcpl_tool_usage(argv,"Requested output file already exists.");
+
+    mcpl_file_t fi = mcpl_open_file_mmap(filenames[0]);
+    mcpl_outfile_t fo = mcpl_create_outfile(filenames[1]);
+    mcpl_transfer_metadata(fi, fo);
+    uint64_t fi_nparticles = mcpl_hdr_nparticles(fi);
+
+    if (!opt_preventcomment) {
+      char comment[1024];
+      sprintf(comment, "mcpltool: sampled particles from file with %" PRIu64 " particles (seed %" PRIu64 ")",
+              fi_nparticles, (uint64_t)(opt_seed>0?opt_seed:0));
+      mcpl_hdr_add_comment(fo,comment);
+    }
+
+    uint64_t added = mcpl_sample(fi, (uint64_t)opt_sample, (uint64_t)(opt_seed>0?opt_seed:0), fo);
+
+    char *fo_filename = (char*)malloc(strlen(mcpl_outfile_filename(fo))+4);
+    fo_filename[0] = '\0';
+    strcat(fo_filename,mcpl_outfile_filename(fo));
+    if (mcpl_closeandgzip_outfile(fo))
+      strcat(fo_filename,".gz");
+    mcpl_close_file(fi);
+
+    printf("MCPL: Succesfully sampled %" PRIu64 " / %" PRIu64 " particles from %s into %s\n",
+           added,fi_nparticles,filenames[0],fo_filename);
+    free(fo_filename);
+    free(filenames);
+    return 0;
+  }
+
   if (opt_text) {
 
     if (nfilenames>2)
@@ -2509,15 +6727,22 @@ int mcpl_tool(int argc,char** argv) {
             "         y[cm]                   z[cm]                      ux                  "
             "    uy                      uz                time[ms]                  weight  "
             "                 pol-x                   pol-y                   pol-z  userflags\n");
-    const mcpl_particle_t* p;
-    while ( ( p = mcpl_read(fi) ) ) {
-      uint64_t idx = mcpl_currentposition(fi)-1;//-1 since mcpl_read skipped ahead
-      fprintf(fout,"%5" PRIu64 " %11i %23.18g %23.18g %23.18g %23.18g %23.18g %23.18g %23.18g %23.18g %23.18g"
-              " %23.18g %23.18g %23.18g 0x%08x\n",
-              idx,p->pdgcode,p->ekin,p->position[0],p->position[1],p->position[2],
-              p->direction[0],p->direction[1],p->direction[2],p->time,p->weight,
-              p->polarisation[0],p->polarisation[1],p->polarisation[2],p->userflags);
+    mcpl_particle_t* pblock = (mcpl_particle_t*)malloc(MCPLIMP_READBLOCK_NPARTICLES*sizeof(mcpl_particle_t));
+    if (!pblock)
+      mcpl_error("Unable to allocate memory for particle block");
+    uint64_t nblock, iblock;
+    uint64_t idx = 0;
+    while ( ( nblock = mcpl_read_block(fi,pblock,MCPLIMP_READBLOCK_NPARTICLES) ) ) {
+      for (iblock = 0; iblock < nblock; ++iblock, ++idx) {
+        const mcpl_particle_t* p = &pblock[iblock];
+        fprintf(fout,"%5" PRIu64 " %11i %23.18g %23.18g %23.18g %23.18g %23.18g %23.18g %23.18g %23.18g %23.18g"
+                " %23.18g %23.18g %23.18g 0x%08x\n",
+                idx,p->pdgcode,p->ekin,p->position[0],p->position[1],p->position[2],
+                p->direction[0],p->direction[1],p->direction[2],p->time,p->weight,
+                p->polarisation[0],p->polarisation[1],p->polarisation[2],p->userflags);
+      }
     }
+    free(pblock);
     fclose(fout);
     mcpl_close_file(fi);
     free(filenames);
@@ -2580,82 +6805,12 @@ int mcpl_gzip_file_rc(const char * filename)
 
 #if defined(MCPL_HASZLIB) && !defined(Z_SOLO) && !defined(MCPL_NO_CUSTOM_GZIP)
 #  define MCPLIMP_HAS_CUSTOM_GZIP
-int _mcpl_custom_gzip(const char *file, const char *mode);//return 1 if successful, 0 if not
-#endif
-
-#if defined MCPL_THIS_IS_UNIX && !defined(MCPL_NO_EXT_GZIP)
-//Platform is unix-like enough that we assume gzip is installed and we can
-//include posix headers.
-#  include <sys/types.h>
-#  include <sys/wait.h>
-#  include <errno.h>
-
-int mcpl_gzip_file(const char * filename)
-{
-  const char * bn = strrchr(filename, '/');
-  bn = bn ? bn + 1 : filename;
 
-  //spawn process in which to perform gzip:
-  printf("MCPL: Attempting to compress file %s with gzip\n",bn);
-  fflush(0);
-  pid_t gzip_pid = fork();
-  if (gzip_pid) {
-    //main proc
-    int chld_state = 0;
-    pid_t ret = waitpid(gzip_pid,&chld_state,0);
-    if (ret!=gzip_pid||chld_state!=0) {
-#  ifdef MCPLIMP_HAS_CUSTOM_GZIP
-      printf("MCPL WARNING: Problems invoking gzip - will revert to a custom zlib based compression\n");
-      if (!_mcpl_custom_gzip(filename,"wb"))
-        mcpl_error("Problems encountered while attempting to compress file");
-      else
-        printf("MCPL: Succesfully compressed file into %s.gz\n",bn);
-#  else
-      mcpl_error("Problems encountered while attempting to invoke gzip");
-#  endif
-    }
-    else
-      printf("MCPL: Succesfully compressed file into %s.gz\n",bn);
-  } else {
-    //spawned proc in which to invoke gzip
-    execlp("gzip", "gzip", "-f",filename, (char*)0);
-    printf("MCPL: execlp/gzip error: %s\n",strerror(errno));
-    exit(1);
-  }
-  return 1;
-}
-#else
-//Non unix-y platform (like windows). We could use e.g. windows-specific calls
-//instead of the fork() and waitpid() used above, but gzip likely not present on
-//the system anyway, so we either resort to using zlib directly to gzip, or we
-//disable the feature and print a warning.
-#  ifndef MCPLIMP_HAS_CUSTOM_GZIP
-int mcpl_gzip_file(const char * filename)
-{
-  const char * bn = strrchr(filename, '/');
-  bn = bn ? bn + 1 : filename;
-  printf("MCPL WARNING: Requested compression of %s to %s.gz is not supported in this build.\n",bn,bn);
-  return 0;
-}
-#  else
-int mcpl_gzip_file(const char * filename)
+int _mcpl_custom_gzip(const char *filename)
 {
-  const char * bn = strrchr(filename, '/');
-  bn = bn ? bn + 1 : filename;
-  printf("MCPL: Attempting to compress file %s with zlib\n",bn);
-  if (!_mcpl_custom_gzip(filename,"wb"))
-    printf("MCPL ERROR: Problems encountered while compressing file %s.\n",bn);
-  else
-    printf("MCPL: Succesfully compressed file into %s.gz\n",bn);
-  return 1;
-}
-#  endif
-#endif
+  //Return 1 if successful, 0 if not. Compression is done with multiple threads
+  //when possible (see mcpl_internal_gzstream_t above).
 
-#ifdef MCPLIMP_HAS_CUSTOM_GZIP
-
-int _mcpl_custom_gzip(const char *filename, const char *mode)
-{
   //Open input file:
   FILE *handle_in = fopen(filename, "rb");
   if (!handle_in)
@@ -2668,37 +6823,105 @@ int _mcpl_custom_gzip(const char *filename, const char *mode)
   strcat(outfn,".gz");
 
   //Open output file:
-  gzFile handle_out = gzopen(outfn, mode);
-
-  free(outfn);
-
+  FILE *handle_out = fopen(outfn, "wb");
   if (!handle_out) {
+    free(outfn);
     fclose(handle_in);
     return 0;
   }
 
   //Compress input to output:
-  char buf[16384];
-  size_t len;
-  while (1) {
-    len = (int)fread(buf, 1, sizeof(buf), handle_in);
+  mcpl_internal_gzstream_t * gz = mcpl_internal_gzstream_create();
+  size_t bufsize = 8 * MCPLIMP_GZSTREAM_BLOCK_SIZE;
+  char * buf = (char*)malloc(bufsize);
+  int ok = buf != 0;
+  while (ok) {
+    size_t len = fread(buf, 1, bufsize, handle_in);
     if (ferror(handle_in))
-      return 0;
+      ok = 0;
     if (!len)
       break;
-    if ((size_t)gzwrite(handle_out, buf, (unsigned)len) != len)
-      return 0;
+    ok = ok && mcpl_internal_gzstream_write(gz, handle_out, buf, len, 0);
   }
+  if (ok)
+    ok = mcpl_internal_gzstream_write(gz, handle_out, 0, 0, 1);
+  mcpl_internal_gzstream_destroy(gz);
+  free(buf);
 
-  //close file:
+  //close files:
   fclose(handle_in);
-  if (gzclose(handle_out) != Z_OK)
+  if (fclose(handle_out))
+    ok = 0;
+  if (!ok) {
+    unlink(outfn);
+    free(outfn);
     return 0;
+  }
+  free(outfn);
 
   //remove input file and return success:
   unlink(filename);
   return 1;
+}
+#endif
+
+#if defined MCPL_THIS_IS_UNIX && !defined(MCPL_NO_EXT_GZIP)
+//Platform is unix-like enough that we assume gzip is installed and we can
+//include posix headers.
+#  define MCPLIMP_HAS_EXT_GZIP
+#  include <sys/types.h>
+#  include <sys/wait.h>
+#  include <errno.h>
 
+int mcpl_internal_ext_gzip(const char * filename)
+{
+  //spawn process in which to perform gzip (return 1 if successful, 0 if not):
+  fflush(0);
+  pid_t gzip_pid = fork();
+  if (gzip_pid) {
+    //main proc
+    int chld_state = 0;
+    pid_t ret = waitpid(gzip_pid,&chld_state,0);
+    return ret==gzip_pid && chld_state==0;
+  } else {
+    //spawned proc in which to invoke gzip
+    execlp("gzip", "gzip", "-f",filename, (char*)0);
+    printf("MCPL: execlp/gzip error: %s\n",strerror(errno));
+    exit(1);
+  }
 }
+#endif
 
+//Compression is preferably done with zlib directly, which is faster as it uses
+//multiple threads. On unix platforms, a system-provided gzip executable is
+//used if zlib is not available. On other platforms (like windows), gzip is
+//likely not present on the system anyway, so if zlib is not available the
+//feature is disabled and a warning is printed.
+int mcpl_gzip_file(const char * filename)
+{
+  const char * bn = strrchr(filename, '/');
+  bn = bn ? bn + 1 : filename;
+#if defined(MCPLIMP_HAS_CUSTOM_GZIP) || defined(MCPLIMP_HAS_EXT_GZIP)
+#  ifdef MCPLIMP_HAS_CUSTOM_GZIP
+  printf("MCPL: Attempting to compress file %s with zlib\n",bn);
+  if (_mcpl_custom_gzip(filename)) {
+    printf("MCPL: Succesfully compressed file into %s.gz\n",bn);
+    return 1;
+  }
+#    ifdef MCPLIMP_HAS_EXT_GZIP
+  printf("MCPL WARNING: Problems encountered with zlib based compression - will revert to invoking gzip\n");
+#    endif
+#  endif
+#  ifdef MCPLIMP_HAS_EXT_GZIP
+  printf("MCPL: Attempting to compress file %s with gzip\n",bn);
+  if (mcpl_internal_ext_gzip(filename)) {
+    printf("MCPL: Succesfully compressed file into %s.gz\n",bn);
+    return 1;
+  }
+#  endif
+  mcpl_error("Problems encountered while attempting to compress file");
+#else
+  printf("MCPL WARNING: Requested compression of %s to %s.gz is not supported in this build.\n",bn,bn);
 #endif
+  return 0;
+}
@@ -53,8 +53,67 @@ extern "C" {
 
 #pragma pack (pop)
 
+  /* Set of separate arrays, one per particle field, for use with the column-   */
+  /* oriented mcpl_read_columns function (arrays for fields which are not      */
+  /* requested can be left null):                                             */
+
+  typedef struct {
+    double * ekin;
+    double * polx;
+    double * poly;
+    double * polz;
+    double * x;
+    double * y;
+    double * z;
+    double * ux;
+    double * uy;
+    double * uz;
+    double * time;
+    double * weight;
+    int32_t * pdgcode;
+    uint32_t * userflags;
+  } mcpl_columns_t;
+
+  /* Description of the layout of the packed particle records in a file, as    */
+  /* returned by mcpl_read_raw. All offsets are in bytes from the start of a    */
+  /* record, and are -1 for fields which are not stored per-particle. Floating */
+  /* point fields are stored as float or double depending on fpsize. The three */
+  /* packed_ekindir values hold the direction and ekin in a compressed form     */
+  /* (which depends on format_version), in which the absolute value of the     */
+  /* third value is the kinetic energy:                                        */
+
+  typedef struct {
+    unsigned format_version;   /* same as mcpl_hdr_version                 */
+    unsigned particle_size;    /* bytes per record                         */
+    unsigned fpsize;           /* 4 (float) or 8 (double)                  */
+    int offset_polarisation;   /* 3 floating point values                  */
+    int offset_position;       /* 3 floating point values                  */
+    int offset_packed_ekindir; /* 3 floating point values                  */
+    int offset_time;           /* 1 floating point value                   */
+    int offset_weight;         /* 1 floating point value                   */
+    int offset_pdgcode;        /* int32_t                                  */
+    int offset_userflags;      /* uint32_t                                 */
+  } mcpl_layout_t;
+
+  /* Selection criteria for mcpl_read_filtered. Only the criteria enabled in   */
+  /* the criteria bitmask (constructed from the MCPL_FILTER_xxx flags) are     */
+  /* applied, and the members belonging to other criteria are ignored. Ranges  */
+  /* are half-open, i.e. a value v passes when min <= v < max:                 */
+
+  typedef struct {
+    unsigned criteria;         /* combination of MCPL_FILTER_xxx flags     */
+    unsigned npdgcodes;        /* pdgcode must be one of the npdgcodes     */
+    const int32_t * pdgcodes;  /* values in the pdgcodes array             */
+    double ekin_min, ekin_max;
+    double pos_min[3], pos_max[3];
+    double time_min, time_max;
+    double weight_min, weight_max;
+  } mcpl_filter_t;
+
   typedef struct { void * internal; } mcpl_file_t;    /* file-object used while reading .mcpl */
   typedef struct { void * internal; } mcpl_outfile_t; /* file-object used while writing .mcpl */
+  typedef struct { void * internal; } mcpl_shared_file_t; /* file shared by multiple readers */
+  typedef struct { void * internal; } mcpl_outfile_mt_t; /* file written by multiple threads */
 
   /****************************/
   /* Creating new .mcpl files */
@@ -63,6 +122,24 @@ extern "C" {
   /* Instantiate new file object (will also open and override specified file) */
   mcpl_outfile_t mcpl_create_outfile(const char * filename);
 
+  /* Alternative to mcpl_create_outfile, with options given as a combination */
+  /* of the MCPL_CREATE_xxx flags below. With MCPL_CREATE_ASYNC, particles are */
+  /* still serialised by the calling thread, but full write buffers are handed */
+  /* to a background thread which writes them to the file. At most a few      */
+  /* buffers are in flight, after which the caller waits for the file system. */
+  /* Write errors in the background thread are reported when the next buffer  */
+  /* is handed over or by mcpl_close_outfile. MCPL_CREATE_ASYNC is ignored on  */
+  /* platforms without POSIX threads.                                          */
+  /* With MCPL_CREATE_GZIP, the file is compressed on the fly while particles */
+  /* are added, and written directly as <filename>.mcpl.gz (which existing    */
+  /* readers can open as usual). This avoids writing and re-reading a full    */
+  /* uncompressed file as with mcpl_closeandgzip_outfile, which simply closes */
+  /* such files. MCPL_CREATE_GZIP requires zlib support (MCPL_HASZLIB), and   */
+  /* results in an error otherwise:                                           */
+  mcpl_outfile_t mcpl_create_outfile_flags(const char * filename, unsigned flags);
+#define MCPL_CREATE_ASYNC 0x1
+#define MCPL_CREATE_GZIP  0x2
+
   const char * mcpl_outfile_filename(mcpl_outfile_t);/* filename being written to (might have had .mcpl appended) */
 
   /* Optionally set global options or add info to the header: */
@@ -80,6 +157,44 @@ extern "C" {
   /* and then passing in a pointer to an mcpl_particle_t instance:          */
   void mcpl_add_particle(mcpl_outfile_t,const mcpl_particle_t*);
 
+  /* Add n particles at once, either from an array or from separate arrays per */
+  /* field. This gives the same file content as calling mcpl_add_particle for */
+  /* each, but is faster since directions are packed in a vectorised manner   */
+  /* and data is written in large chunks. All particles are checked before any */
+  /* are added. With mcpl_add_columns, arrays must be provided for all fields */
+  /* stored in the file (i.e. except for those enabled as universal or not     */
+  /* enabled at all), while arrays for other fields are ignored:              */
+  void mcpl_add_particles(mcpl_outfile_t, const mcpl_particle_t*, uint64_t n);
+  void mcpl_add_columns(mcpl_outfile_t, const mcpl_columns_t*, uint64_t n);
+
+  /* Set the size in bytes of the internal buffer in which added particles are */
+  /* collected before being written to the file in large chunks (default is   */
+  /* 1MB). Data in the buffer is always written when the file is closed:      */
+  void mcpl_set_write_buffer_size(mcpl_outfile_t, uint64_t nbytes);
+
+  /* For very large files: Preallocate space on disk for the expected number  */
+  /* of particles when the header is written (avoiding fragmentation), and    */
+  /* write particle data with O_DIRECT, bypassing the page cache (so memory    */
+  /* used by other processes is not evicted to cache the output). Any unused  */
+  /* space is released by mcpl_close_outfile, and writing more particles than */
+  /* expected is fine. Must be called before the header is written. Ignored   */
+  /* for compressed files and on platforms other than Linux:                  */
+  void mcpl_enable_bulk_write(mcpl_outfile_t, uint64_t nparticles_expected);
+
+  /* Periodically update the number of particles in the header of the file  */
+  /* while it is being written (after writing all data added until then), so */
+  /* files of jobs which are killed before closing the file are immediately  */
+  /* readable (with the particles added up to the last checkpoint). A        */
+  /* checkpoint is made every nparticles_interval particles and/or whenever   */
+  /* seconds_interval seconds have passed since the last one (zero disables  */
+  /* either). With MCPL_CHECKPOINT_SYNC, data and header are also flushed to */
+  /* storage (with fdatasync) at each checkpoint, to be consistent even after */
+  /* a system crash. Should be called before adding particles via producers.  */
+  /* Ignored for compressed files:                                           */
+  void mcpl_enable_checkpoints(mcpl_outfile_t, uint64_t nparticles_interval,
+                               double seconds_interval, unsigned flags);
+#define MCPL_CHECKPOINT_SYNC 0x1
+
   /* Finally, always remember to close the file: */
   void mcpl_close_outfile(mcpl_outfile_t);
 
@@ -92,14 +207,88 @@ extern "C" {
      reused and will be automatically free'd when the file is closed: */
   mcpl_particle_t* mcpl_get_empty_particle(mcpl_outfile_t);
 
+  /* Writing one file from multiple threads: Create it with                   */
+  /* mcpl_create_outfile_mt, configure the header with the functions above on   */
+  /* the file returned by mcpl_outfile_mt_header, and get a writer for each     */
+  /* thread index i (0<=i<nthreads) with mcpl_outfile_mt_writer. Writers can be */
+  /* created and used concurrently from different threads without locking (a   */
+  /* given writer must only be used by one thread at a time), and write their  */
+  /* particles to separate temporary shard files (named as the output file     */
+  /* with ".shard<i>" appended). At mcpl_close_outfile_mt, the shards are      */
+  /* appended to the output file in order of thread index (so the result does  */
+  /* not depend on thread scheduling) and removed. On Linux, the data is copied */
+  /* with copy_file_range (in-kernel, or by sharing data blocks on file systems */
+  /* supporting it). Header options must not be changed after the first writer */
+  /* is created, but comments and blobs can be added until the file is closed  */
+  /* (also while other threads create writers). Writers must not be closed with */
+  /* mcpl_close_outfile:                                                        */
+  mcpl_outfile_mt_t mcpl_create_outfile_mt(const char * filename, unsigned nthreads);
+  mcpl_outfile_t mcpl_outfile_mt_header(mcpl_outfile_mt_t);
+  mcpl_outfile_t mcpl_outfile_mt_writer(mcpl_outfile_mt_t, unsigned ithread);
+  void mcpl_close_outfile_mt(mcpl_outfile_mt_t);
+
+  /* Alternatively, any number of threads can add particles to the same file   */
+  /* (in no particular order) via producers. A producer is an output file      */
+  /* object obtained with mcpl_outfile_producer, and it can be used with the    */
+  /* functions adding particles (and mcpl_get_empty_particle) without locking.  */
+  /* Each producer collects particles in its own buffer (of the size set with  */
+  /* mcpl_set_write_buffer_size on the file), and hands full buffers to a       */
+  /* background thread which writes them to the file. Producers can be created */
+  /* concurrently from different threads (a given producer must only be used   */
+  /* by one thread at a time). The header must be fully configured before the  */
+  /* first producer is created, and particles can no longer be added directly  */
+  /* to the file afterwards. Producers are closed with mcpl_close_outfile, and  */
+  /* must all be closed before the file itself:                                 */
+  mcpl_outfile_t mcpl_outfile_producer(mcpl_outfile_t);
+
   /***********************/
   /* Reading .mcpl files */
   /***********************/
 
   /* Open file and load header information into memory, skip to the first (if */
-  /* any) particle in the list:                                               */
+  /* any) particle in the list. The contents of comments and blobs are only   */
+  /* read from the file when first accessed. Files written on platforms with  */
+  /* a different endianness are converted transparently while being read:     */
   mcpl_file_t mcpl_open_file(const char * filename);
 
+  /* Alternative to mcpl_open_file, which for uncompressed files reads the    */
+  /* particle data directly from a read-only memory map of the file instead  */
+  /* of using standard file I/O. Reading and seeking then requires no copying */
+  /* of data or system calls. Falls back to standard file I/O for .gz files, */
+  /* files with foreign endianness, or on platforms where memory mapping is  */
+  /* not available:                                                          */
+  mcpl_file_t mcpl_open_file_mmap(const char * filename);
+
+  /* Alternative to mcpl_open_file, with options given as a combination of the */
+  /* MCPL_OPEN_xxx flags below. MCPL_OPEN_MMAP is as mcpl_open_file_mmap, and  */
+  /* MCPL_OPEN_READAHEAD makes a background thread read (and for .gz files,   */
+  /* decompress) the next chunk of particle data while the current one is     */
+  /* being consumed, which mostly benefits sequential reading of .gz files or */
+  /* files on slow storage. Functions for reading and seeking are used exactly */
+  /* as for other files. MCPL_OPEN_READAHEAD is ignored on platforms without   */
+  /* POSIX threads, or if the file is also memory mapped:                      */
+  mcpl_file_t mcpl_open_file_flags(const char * filename, unsigned flags);
+#define MCPL_OPEN_MMAP      0x1
+#define MCPL_OPEN_READAHEAD 0x2
+
+  /* Open only the header of a file, for fast scans of the meta-data of many   */
+  /* files. The returned object can be used with the mcpl_hdr_xxx functions    */
+  /* and must be closed with mcpl_close_file, but no particles can be read     */
+  /* from it. For .gz files, only the data needed is decompressed (note that   */
+  /* mcpl_hdr_blobkeys, mcpl_hdr_blob and mcpl_hdr_header_size must skip past  */
+  /* all blob data):                                                           */
+  mcpl_file_t mcpl_open_header(const char * filename);
+
+  /* Open the headers of nfiles files with mcpl_open_header, using a pool of   */
+  /* nthreads threads (0 for one per CPU), and invoke the callback with each,  */
+  /* after which it is closed again. The callback is invoked concurrently from */
+  /* different threads and in no particular order:                            */
+  void mcpl_scan_headers( unsigned nfiles, const char ** filenames,
+                          unsigned nthreads,
+                          void (*callback)(mcpl_file_t hdr, unsigned ifile,
+                                           void * userdata),
+                          void * userdata );
+
   /* Access header data: */
   unsigned mcpl_hdr_version(mcpl_file_t);/* file format version (not the same as MCPL_VERSION) */
   uint64_t mcpl_hdr_nparticles(mcpl_file_t);/* number of particles stored in file              */
@@ -118,18 +307,108 @@ extern "C" {
   int32_t mcpl_hdr_universal_pdgcode(mcpl_file_t);/* returns 0 in case of per-particle pdgcode */
   double mcpl_hdr_universal_weight(mcpl_file_t);/* returns 0.0 in case of per-particle weights */
   int mcpl_hdr_little_endian(mcpl_file_t);
+  const mcpl_layout_t* mcpl_hdr_layout(mcpl_file_t);/* layout of packed particle records */
 
   /* Request pointer to particle at current location and skip forward to the next */
   /* particle. Return value will be null in case there was no particle at the     */
   /* current location (normally due to end-of-file):                              */
   const mcpl_particle_t* mcpl_read(mcpl_file_t);
 
+  /* Read up to nmax particles from the current location into the provided array */
+  /* and skip forward past them. This is more efficient than calling mcpl_read   */
+  /* for each particle. Returns the number of particles read, which will only be */
+  /* less than nmax when reaching the end-of-file:                               */
+  uint64_t mcpl_read_block(mcpl_file_t, mcpl_particle_t* out, uint64_t nmax);
+
+  /* Column-oriented alternative to mcpl_read_block, which reads up to nmax     */
+  /* particles, but only fills the arrays in columns which are selected by the  */
+  /* fields bitmask (constructed from the MCPL_FIELD_xxx flags below). Fields   */
+  /* which are not requested are never unpacked, making this the most efficient */
+  /* way to scan a file for a few quantities. Returns the number of particles   */
+  /* read, which will only be less than nmax when reaching the end-of-file:     */
+  uint64_t mcpl_read_columns(mcpl_file_t, unsigned fields,
+                             const mcpl_columns_t* columns, uint64_t nmax);
+#define MCPL_FIELD_EKIN      0x0001
+#define MCPL_FIELD_POLX      0x0002
+#define MCPL_FIELD_POLY      0x0004
+#define MCPL_FIELD_POLZ      0x0008
+#define MCPL_FIELD_X         0x0010
+#define MCPL_FIELD_Y         0x0020
+#define MCPL_FIELD_Z         0x0040
+#define MCPL_FIELD_UX        0x0080
+#define MCPL_FIELD_UY        0x0100
+#define MCPL_FIELD_UZ        0x0200
+#define MCPL_FIELD_TIME      0x0400
+#define MCPL_FIELD_WEIGHT    0x0800
+#define MCPL_FIELD_PDGCODE   0x1000
+#define MCPL_FIELD_USERFLAGS 0x2000
+#define MCPL_FIELD_ALL       0x3FFF
+
+  /* Read up to nmax particles passing the given filter from the current        */
+  /* location into the provided array, and skip forward past all particles     */
+  /* examined. The filter is evaluated directly on the packed data, and only   */
+  /* particles passing it are unpacked, which makes this much more efficient   */
+  /* than testing particles after reading them when few pass. Returns the      */
+  /* number of particles read, which will only be less than nmax when reaching */
+  /* the end-of-file. The last of them (only) can be forwarded with            */
+  /* mcpl_transfer_last_read_particle:                                         */
+  uint64_t mcpl_read_filtered(mcpl_file_t, const mcpl_filter_t*,
+                              mcpl_particle_t* out, uint64_t nmax);
+#define MCPL_FILTER_PDGCODE  0x01
+#define MCPL_FILTER_EKIN     0x02
+#define MCPL_FILTER_POSITION 0x04
+#define MCPL_FILTER_TIME     0x08
+#define MCPL_FILTER_WEIGHT   0x10
+#define MCPL_FILTER_ALL      0x1F
+
+  /* Set rec to point to the packed data of the particle at the current location */
+  /* (with a layout as described by mcpl_hdr_layout) and skip forward to the    */
+  /* next particle, without unpacking anything. The data stays valid until the  */
+  /* next read operation on the file. The particle can still be forwarded with */
+  /* mcpl_transfer_last_read_particle afterwards. Returns 0 in case there was no */
+  /* particle at the current location (normally due to end-of-file):           */
+  int mcpl_read_raw(mcpl_file_t, const char ** rec);
+
+  /* Set the size in bytes of the internal buffer used when reading particle   */
+  /* data (default is 4MB). Particle data is read from the file in large chunks */
+  /* into this buffer, and seeking to particles already in the buffer does not */
+  /* require any I/O. Not used for files opened with mcpl_open_file_mmap:      */
+  void mcpl_set_read_buffer_size(mcpl_file_t, uint64_t nbytes);
+
   /* Seek and skip in particles (returns 0 when there is no particle at the new position): */
   int mcpl_skipforward(mcpl_file_t,uint64_t n);
   int mcpl_rewind(mcpl_file_t);
   int mcpl_seek(mcpl_file_t,uint64_t ipos);
   uint64_t mcpl_currentposition(mcpl_file_t);
 
+  /* Restrict reading to the particles with indices in [begin,end). The file is */
+  /* positioned at begin, after which reading ends (as at end-of-file) at end,  */
+  /* mcpl_rewind returns to begin, and seeking and skipping stays inside the    */
+  /* range. Positions are still indices in the entire file. Returns 0 if the   */
+  /* range is empty. Can be used with all files (reading a range which does not */
+  /* start at the beginning of a .gz file is slower, due to decompression):     */
+  int mcpl_set_range(mcpl_file_t, uint64_t begin, uint64_t end);
+
+  /* Split the particles in a file into nparts balanced and non-overlapping    */
+  /* ranges covering all particles, for parallel processing with mcpl_set_range. */
+  /* Part i will be [bounds[i],bounds[i+1]), so the bounds array must have room  */
+  /* for nparts+1 entries. When the parts are large, the bounds are chosen to    */
+  /* correspond to suitably aligned boundaries in the particle data:           */
+  void mcpl_partition(mcpl_file_t, unsigned nparts, uint64_t * bounds);
+
+  /* Reading the same file from multiple threads: Open it once as a shared file */
+  /* (parsing the header only once), and create a cursor for each thread. A     */
+  /* cursor can be used with all the functions above just like a file returned  */
+  /* by mcpl_open_file, and has its own independent position and buffers, but    */
+  /* no copy of the header data. Cursors can be created and used concurrently   */
+  /* from different threads without locking (a given cursor must only be used   */
+  /* by one thread at a time). For uncompressed files on POSIX platforms, all    */
+  /* cursors read directly from the same file descriptor with pread. Cursors are */
+  /* closed with mcpl_close_file, and must all be closed before the shared file: */
+  mcpl_shared_file_t mcpl_open_shared_file(const char * filename);
+  mcpl_file_t mcpl_shared_file_cursor(mcpl_shared_file_t);
+  void mcpl_close_shared_file(mcpl_shared_file_t);
+
   /* Deallocate memory and release file-handle with: */
   void mcpl_close_file(mcpl_file_t);
 
@@ -171,28 +450,50 @@ extern "C" {
 
 
   /* Attempt to fix number of particles in the header of a file which was never */
-  /* properly closed:                                                           */
+  /* properly closed (this also recovers the particles written after the last  */
+  /* checkpoint of files written with mcpl_enable_checkpoints, provided none of */
+  /* the records after it consists entirely of zero bytes):                    */
   void mcpl_repair(const char * file1);
 
   /* For easily creating a standard mcpl-tool cmdline application: */
   int mcpl_tool(int argc, char** argv);
 
-  /* Attempt to run gzip on a file (does not require MCPL_HASZLIB on unix) */
-  /* Returns non-zero if gzipping was succesful.                           */
+  /* Attempt to gzip a file (does not require MCPL_HASZLIB on unix). With   */
+  /* MCPL_HASZLIB, compression is done with zlib using multiple threads, and */
+  /* otherwise by running the gzip command. Returns non-zero if gzipping was */
+  /* succesful.                                                              */
   int mcpl_gzip_file(const char * filename);
 
+  /* Limit the number of threads used for compression with zlib by           */
+  /* mcpl_gzip_file and for files created with MCPL_CREATE_GZIP (0, the       */
+  /* default, means one per CPU, and 1 means no extra threads). Threads are    */
+  /* not started at all for small amounts of data. The setting applies to all */
+  /* files, and should not be changed while any are being compressed:         */
+  void mcpl_set_compression_threads(unsigned nthreads);
+
   /* Convenience function which transfers all settings, blobs and comments to */
   /* target. Intended to make it easy to filter files via custom C code.      */
   void mcpl_transfer_metadata(mcpl_file_t source, mcpl_outfile_t target);
 
   /* Function which can be used when transferring particles from one MCPL file  */
   /* to another. A particle must have been already read from the source file    */
-  /* with a call to mcpl_read(..). This function will transfer the packed par-  */
-  /* ticle data exactly when possible (using mcpl_add_particle can in principle */
-  /* introduce tiny numerical uncertainties due to the internal unpacking and   */
-  /* repacking of direction vectors involved):                                  */
+  /* with a call to mcpl_read(..) or mcpl_read_raw(..). This function will      */
+  /* transfer the packed particle data exactly when possible (using             */
+  /* mcpl_add_particle can in principle introduce tiny numerical uncertainties  */
+  /* due to the internal unpacking and repacking of direction vectors involved): */
   void mcpl_transfer_last_read_particle(mcpl_file_t source, mcpl_outfile_t target);
 
+  /* Transfer n particles selected uniformly at random (without replacement)   */
+  /* from the source file (or its range, if mcpl_set_range was used) to the    */
+  /* target file, keeping their order. The selection depends only on seed and  */
+  /* on the number of particles, not on whether the file is compressed. When n  */
+  /* is small compared to the number of particles, only the selected particles */
+  /* are read, so the cost scales with n rather than with the file size. The   */
+  /* current position in the source file is not changed. Returns the number of */
+  /* particles transferred (n, or fewer if the file has fewer particles):      */
+  uint64_t mcpl_sample(mcpl_file_t source, uint64_t n, uint64_t seed,
+                       mcpl_outfile_t target);
+
   /******************/
   /* Error handling */
   /******************/
@@ -381,7 +381,21 @@ int mcpl2phits( const char * inmcplfile, const char * outphitsdumpfile,
 
   double dumpdata[13] = {0.,0.,0.,0.,0.,0.,0.,0.,0.,0.,0.,0.,0.};//explicit since gcc 4.1-4.6 might warn on ={0}; syntax
 
-  while ( ( mcpl_p = mcpl_read(fmcpl) ) ) {
+  //Read particles in blocks for efficiency:
+  const uint64_t nblockmax = 1000;
+  mcpl_particle_t* pblock = (mcpl_particle_t*)malloc(nblockmax*sizeof(mcpl_particle_t));
+  assert(pblock);
+  uint64_t nblock = 0;
+  uint64_t iblock = 0;
+
+  while ( 1 ) {
+    if (iblock==nblock) {
+      iblock = 0;
+      nblock = mcpl_read_block(fmcpl,pblock,nblockmax);
+      if (!nblock)
+        break;
+    }
+    mcpl_p = &pblock[iblock++];
     int32_t rawtype =  conv_code_pdg2phits( mcpl_p->pdgcode );
     if (!rawtype) {
       ++skipped_nophitstype;
@@ -427,6 +441,8 @@ int mcpl2phits( const char * inmcplfile, const char * outphitsdumpfile,
 
   }
 
+  free(pblock);
+
   printf("Ending particle conversion loop.\n");
 
   if (skipped_nophitstype) {